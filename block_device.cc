@@ -0,0 +1,365 @@
+#include "block_device.h"
+#include "fat_error.h"
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace cs5250 {
+
+namespace {
+
+// read up to `bytes` at `offset`, fewer only at the end of the file; the
+// number read, or -1
+int64_t PreadFull(int fd, uint8_t *buffer, uint64_t bytes, uint64_t offset) {
+    uint64_t done = 0;
+    while (done < bytes) {
+        auto got = pread(fd, buffer + done, bytes - done, offset + done);
+        if (got == -1 && errno == EINTR)
+            continue;
+        if (got == -1)
+            return -1;
+        if (got == 0)
+            break;
+        done += got;
+    }
+    return done;
+}
+
+bool PwriteAll(int fd, const uint8_t *buffer, uint64_t bytes,
+               uint64_t offset) {
+    while (bytes > 0) {
+        auto written = pwrite(fd, buffer, bytes, offset);
+        if (written == -1 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return false;
+        buffer += written;
+        offset += written;
+        bytes -= written;
+    }
+    return true;
+}
+
+} // namespace
+
+std::unique_ptr<BlockDevice> BlockDevice::Open(int fd, uint64_t size,
+                                               const FATOptions &options) {
+    if (options.io == IOBackend::Pread)
+        return std::make_unique<PreadDevice>(fd, size, options.cache_bytes,
+                                             options.advise);
+
+    auto prot = PROT_READ | (options.read_only ? 0 : PROT_WRITE);
+    auto flags = MAP_SHARED | (options.populate ? MAP_POPULATE : 0);
+    auto image = mmap(NULL, size, prot, flags, fd, 0);
+    if (image == MAP_FAILED)
+        return nullptr;
+    return std::make_unique<MmapDevice>(
+        fd, size, static_cast<uint8_t *>(image), options.advise);
+}
+
+MmapDevice::~MmapDevice() { munmap(image_, size_); }
+
+bool MmapDevice::Read(uint64_t offset, void *buffer, uint64_t bytes) {
+    if (offset + bytes > size_)
+        return false;
+    memcpy(buffer, image_ + offset, bytes);
+    return true;
+}
+
+void MmapDevice::Import(IOEngine &engine, int fd, uint64_t fd_offset,
+                        uint64_t offset, uint64_t bytes, uint64_t span,
+                        IOEngine::Done done) {
+    // read straight into the mapped clusters
+    memset(image_ + offset + bytes, 0, span - bytes);
+    dirty_pages_.Mark(Region::Data, offset, span);
+    engine.Read(fd, fd_offset, image_ + offset, bytes, std::move(done));
+}
+
+void MmapDevice::Export(IOEngine &engine, uint64_t offset, uint64_t bytes,
+                        int fd, uint64_t fd_offset, IOEngine::Done done) {
+    engine.Write(fd, fd_offset, image_ + offset, bytes, std::move(done));
+}
+
+bool MmapDevice::Flush(bool durable) {
+    if (durable)
+        return dirty_pages_.Flush(image_);
+    // the kernel writes the pages back on its own
+    for (size_t region = 0; region < size_t(Region::Count); ++region)
+        dirty_pages_.Take(static_cast<Region>(region));
+    return true;
+}
+
+void MmapDevice::Advise(uint64_t offset, uint64_t bytes, Advice advice) {
+    if (!advise_ || bytes == 0)
+        return;
+    // madvise takes whole pages
+    uint64_t page = sysconf(_SC_PAGESIZE);
+    auto begin = offset / page * page;
+    auto end = std::min(size_, offset + bytes);
+    int how = MADV_NORMAL;
+    switch (advice) {
+    case Advice::WillNeed:
+        how = MADV_WILLNEED;
+        break;
+    case Advice::Sequential:
+        how = MADV_SEQUENTIAL;
+        break;
+    case Advice::HugePages:
+        how = MADV_HUGEPAGE;
+        break;
+    }
+    madvise(image_ + begin, end - begin, how);
+}
+
+uint64_t PreadDevice::BytesOfBlock(uint64_t block) const {
+    auto offset = OffsetOfBlock(block);
+    if (offset >= size_)
+        return 0;
+    return std::min(block_bytes_, size_ - offset);
+}
+
+bool PreadDevice::Read(uint64_t offset, void *buffer, uint64_t bytes) {
+    return PreadFull(fd_, static_cast<uint8_t *>(buffer), bytes, offset) ==
+           int64_t(bytes);
+}
+
+uint8_t *PreadDevice::Load(uint64_t metadata_bytes, uint64_t block_bytes) {
+    metadata_bytes_ = std::min(metadata_bytes, size_);
+    block_bytes_ = block_bytes;
+    // enough blocks for every thread to hold a few pins at once
+    capacity_ = std::max<uint64_t>(cache_bytes_ / block_bytes_, 64);
+
+    metadata_.reset(new uint8_t[metadata_bytes_]);
+    zeros_.reset(new uint8_t[block_bytes_]());
+    if (PreadFull(fd_, metadata_.get(), metadata_bytes_, 0) !=
+        int64_t(metadata_bytes_))
+        return nullptr;
+    return metadata_.get();
+}
+
+bool PreadDevice::WriteBack(uint64_t block, Block &cached) {
+    if (!PwriteAll(fd_, cached.data.get(), BytesOfBlock(block),
+                   OffsetOfBlock(block)))
+        return false;
+    cached.dirty.reset();
+    return true;
+}
+
+std::unique_ptr<uint8_t[]> PreadDevice::Evict() {
+    std::unique_ptr<uint8_t[]> buffer;
+    while (blocks_.size() >= capacity_ && !lru_.empty()) {
+        auto block = lru_.front();
+        lru_.pop_front();
+        auto it = blocks_.find(block);
+        if (it->second.dirty && !WriteBack(block, it->second))
+            write_back_failed_ = true;
+        buffer = std::move(it->second.data);
+        blocks_.erase(it);
+    }
+    return buffer;
+}
+
+BlockDevice::Pin PreadDevice::Access(uint64_t offset, uint64_t bytes) {
+    if (offset + bytes <= metadata_bytes_)
+        return Pin(metadata_.get() + offset);
+
+    auto block = (offset - metadata_bytes_) / block_bytes_;
+    auto within = (offset - metadata_bytes_) % block_bytes_;
+    assert(within + bytes <= block_bytes_);
+
+    std::unique_lock lock(mutex_);
+    auto it = blocks_.find(block);
+    if (it != blocks_.end()) {
+        auto &cached = it->second;
+        if (cached.pins++ == 0)
+            lru_.erase(cached.unpinned);
+        // another thread may still be reading it in
+        loaded_.wait(lock, [&cached] { return cached.loaded; });
+        if (cached.failed) {
+            if (--cached.pins == 0)
+                blocks_.erase(block);
+            throw FATError("failed to read the image");
+        }
+        return Pin(cached.data.get() + within, this, block);
+    }
+
+    auto buffer = Evict();
+    if (!buffer)
+        buffer.reset(new uint8_t[block_bytes_]);
+    auto &cached = blocks_[block];
+    cached.pins = 1;
+    cached.data = std::move(buffer);
+    auto data = cached.data.get();
+
+    // the read itself does not hold up other blocks
+    lock.unlock();
+    auto got = PreadFull(fd_, data, BytesOfBlock(block), OffsetOfBlock(block));
+    if (got >= 0)
+        memset(data + got, 0, block_bytes_ - got);
+    lock.lock();
+
+    cached.loaded = true;
+    cached.failed = got < 0;
+    loaded_.notify_all();
+    if (cached.failed) {
+        if (--cached.pins == 0)
+            blocks_.erase(block);
+        throw FATError("failed to read the image");
+    }
+    return Pin(data + within, this, block);
+}
+
+void PreadDevice::Unpin(uint64_t block) {
+    std::lock_guard lock(mutex_);
+    auto &cached = blocks_.at(block);
+    if (--cached.pins == 0) {
+        lru_.push_back(block);
+        cached.unpinned = std::prev(lru_.end());
+    }
+}
+
+void PreadDevice::MarkDirty(Region region, uint64_t offset, uint64_t bytes) {
+    if (offset < metadata_bytes_) {
+        auto in_metadata = std::min(bytes, metadata_bytes_ - offset);
+        dirty_metadata_.Mark(region, offset, in_metadata);
+        offset += in_metadata;
+        bytes -= in_metadata;
+    }
+    if (bytes == 0)
+        return;
+
+    std::lock_guard lock(mutex_);
+    auto first = (offset - metadata_bytes_) / block_bytes_;
+    auto last = (offset + bytes - 1 - metadata_bytes_) / block_bytes_;
+    for (auto block = first; block <= last; ++block) {
+        auto it = blocks_.find(block);
+        if (it == blocks_.end())
+            continue;
+        auto &dirty = it->second.dirty;
+        if (!dirty || region < *dirty)
+            dirty = region;
+    }
+}
+
+void PreadDevice::Import(IOEngine &engine, int fd, uint64_t fd_offset,
+                         uint64_t offset, uint64_t bytes, uint64_t span,
+                         IOEngine::Done done) {
+    // cached copies of the range are out of date, and must not be written
+    // back over it later
+    {
+        std::lock_guard lock(mutex_);
+        auto first = (offset - metadata_bytes_) / block_bytes_;
+        auto last = (offset + span - 1 - metadata_bytes_) / block_bytes_;
+        for (auto block = first; block <= last; ++block) {
+            auto it = blocks_.find(block);
+            if (it == blocks_.end())
+                continue;
+            assert(it->second.pins == 0);
+            lru_.erase(it->second.unpinned);
+            blocks_.erase(it);
+        }
+    }
+    unsynced_data_ = true;
+
+    // the slack is less than a block
+    auto slack = span - bytes;
+    auto joined = IOEngine::Join(slack != 0 ? 2 : 1, std::move(done));
+    engine.Copy(fd, fd_offset, fd_, offset, bytes, joined);
+    if (slack != 0)
+        engine.Write(fd_, offset + bytes, zeros_.get(), slack, joined);
+}
+
+void PreadDevice::Export(IOEngine &engine, uint64_t offset, uint64_t bytes,
+                         int fd, uint64_t fd_offset, IOEngine::Done done) {
+    // blocks written since they were read only exist in the cache, and go
+    // out from there pinned; the rest is copied from the image in runs as
+    // long as possible
+    struct Part {
+        uint64_t offset;
+        uint64_t bytes;
+        std::shared_ptr<Pin> pin;
+    };
+    std::vector<Part> parts;
+    for (auto at = offset; at < offset + bytes;) {
+        auto block = (at - metadata_bytes_) / block_bytes_;
+        auto within = (at - metadata_bytes_) % block_bytes_;
+        auto chunk = std::min(block_bytes_ - within, offset + bytes - at);
+        bool dirty;
+        {
+            std::lock_guard lock(mutex_);
+            auto it = blocks_.find(block);
+            dirty = it != blocks_.end() && it->second.loaded &&
+                    it->second.dirty;
+        }
+        if (dirty)
+            parts.push_back(
+                {at, chunk, std::make_shared<Pin>(Access(at, chunk))});
+        else if (!parts.empty() && !parts.back().pin &&
+                 parts.back().offset + parts.back().bytes == at)
+            parts.back().bytes += chunk;
+        else
+            parts.push_back({at, chunk, nullptr});
+        at += chunk;
+    }
+
+    auto joined = IOEngine::Join(parts.size(), std::move(done));
+    for (auto &part : parts) {
+        auto to = fd_offset + (part.offset - offset);
+        if (part.pin)
+            engine.Write(fd, to, part.pin->Data(), part.bytes,
+                         [joined, pin = part.pin](bool ok) { joined(ok); });
+        else
+            engine.Copy(fd_, part.offset, fd, to, part.bytes, joined);
+    }
+}
+
+bool PreadDevice::Flush(bool durable) {
+    std::lock_guard lock(mutex_);
+    bool ok = !write_back_failed_;
+    write_back_failed_ = false;
+    for (size_t index = 0; index < size_t(Region::Count); ++index) {
+        auto region = static_cast<Region>(index);
+        bool written = false;
+        for (auto [begin, end] : dirty_metadata_.Take(region)) {
+            end = std::min(end, metadata_bytes_);
+            if (!PwriteAll(fd_, metadata_.get() + begin, end - begin, begin))
+                ok = false;
+            written = true;
+        }
+        // in the order of the image
+        std::vector<uint64_t> dirty;
+        for (auto &[block, cached] : blocks_)
+            if (cached.dirty == region)
+                dirty.push_back(block);
+        std::sort(dirty.begin(), dirty.end());
+        for (auto block : dirty) {
+            if (!WriteBack(block, blocks_[block]))
+                ok = false;
+            written = true;
+        }
+        if (region == Region::Data && durable) {
+            written = written || unsynced_data_;
+            unsynced_data_ = false;
+        }
+        if (durable && written && fdatasync(fd_) == -1)
+            ok = false;
+    }
+    return ok;
+}
+
+void PreadDevice::Advise(uint64_t offset, uint64_t bytes, Advice advice) {
+    // the metadata is read whole when the device is loaded, and there are
+    // no mappings to put on huge pages
+    if (!advise_ || offset + bytes <= metadata_bytes_)
+        return;
+    if (advice == Advice::WillNeed)
+        posix_fadvise(fd_, offset, bytes, POSIX_FADV_WILLNEED);
+    else if (advice == Advice::Sequential)
+        posix_fadvise(fd_, offset, bytes, POSIX_FADV_SEQUENTIAL);
+}
+
+} // namespace cs5250
@@ -0,0 +1,243 @@
+#pragma once
+
+#include "dirty_pages.h"
+#include "fat_options.h"
+#include "io_engine.h"
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace cs5250 {
+
+// how a range of the image is about to be used
+enum class Advice {
+    // read soon, so worth reading ahead of time
+    WillNeed,
+    // read or written once from front to back
+    Sequential,
+    // touched all over for as long as the image is open
+    HugePages,
+};
+
+/*
+ * The bytes of an image, as FATManager reads and writes them.
+ *
+ * Everything in front of the data region (reserved sectors, FATs and the
+ * fixed root directory) is held in memory as one buffer while the device
+ * is open. The data region is reached through pins, each holding a span of
+ * the image in memory until it is dropped; a span must not cross a block,
+ * which is a cluster, unless the device has no span limit.
+ *
+ * Bytes written through a pointer of the device must be marked dirty, or
+ * they may never reach the image.
+ */
+class BlockDevice {
+  public:
+    // a span of the image kept in memory for as long as the pin lives
+    class Pin {
+      private:
+        BlockDevice *device_ = nullptr;
+        uint64_t block_ = 0;
+        uint8_t *data_ = nullptr;
+
+      public:
+        Pin() = default;
+        explicit Pin(uint8_t *data, BlockDevice *device = nullptr,
+                     uint64_t block = 0)
+            : device_(device), block_(block), data_(data) {}
+        Pin(Pin &&other) noexcept
+            : device_(std::exchange(other.device_, nullptr)),
+              block_(other.block_), data_(other.data_) {}
+        Pin &operator=(Pin &&other) noexcept {
+            std::swap(device_, other.device_);
+            std::swap(block_, other.block_);
+            std::swap(data_, other.data_);
+            return *this;
+        }
+        ~Pin() {
+            if (device_)
+                device_->Unpin(block_);
+        }
+
+        uint8_t *Data() const { return data_; }
+    };
+
+    // the image open as `fd`, read and written the way `options` ask;
+    // nullptr with errno set on failure
+    static std::unique_ptr<BlockDevice> Open(int fd, uint64_t size,
+                                             const FATOptions &options);
+
+    virtual ~BlockDevice() = default;
+
+    uint64_t Size() const { return size_; }
+
+    // read bytes of the image before Load, as the BPB is
+    virtual bool Read(uint64_t offset, void *buffer, uint64_t bytes) = 0;
+
+    // bring the first `metadata_bytes` of the image into memory, the data
+    // region after them being cut into blocks of `block_bytes`; returns the
+    // metadata, which stays put until the device is closed
+    virtual uint8_t *Load(uint64_t metadata_bytes, uint64_t block_bytes) = 0;
+
+    // `bytes` of the image at `offset`, which lie within the metadata or
+    // within one block
+    virtual Pin Access(uint64_t offset, uint64_t bytes) = 0;
+
+    // the most bytes of the data region one pin can hold
+    virtual uint64_t SpanLimit() const = 0;
+
+    // record a write to `bytes` of the image at `offset`, which are pinned
+    // or in the metadata
+    virtual void MarkDirty(Region region, uint64_t offset, uint64_t bytes) = 0;
+
+    // queue on `engine` a read of `bytes` of `fd` at `fd_offset` into the
+    // data region at `offset`, the rest of the `span` bytes there cleared;
+    // the range must not be pinned
+    virtual void Import(IOEngine &engine, int fd, uint64_t fd_offset,
+                        uint64_t offset, uint64_t bytes, uint64_t span,
+                        IOEngine::Done done) = 0;
+
+    // queue on `engine` a write of `bytes` of the data region at `offset`
+    // to `fd` at `fd_offset`
+    virtual void Export(IOEngine &engine, uint64_t offset, uint64_t bytes,
+                        int fd, uint64_t fd_offset, IOEngine::Done done) = 0;
+
+    // write back everything marked, region by region; with `durable` each
+    // region is on disk before the next is written
+    virtual bool Flush(bool durable) = 0;
+
+    // pass on to the kernel how `bytes` of the image at `offset` are about
+    // to be used; only a hint, so failures are ignored
+    virtual void Advise(uint64_t, uint64_t, Advice) {}
+
+  protected:
+    int fd_;
+    uint64_t size_;
+
+    BlockDevice(int fd, uint64_t size) : fd_(fd), size_(size) {}
+
+    virtual void Unpin(uint64_t) {}
+};
+
+/*
+ * The whole image mapped MAP_SHARED: pins are plain pointers into the
+ * mapping, and a flush only has to msync the marked pages. Images opened
+ * read-only are mapped PROT_READ.
+ */
+class MmapDevice : public BlockDevice {
+  private:
+    uint8_t *image_ = nullptr;
+    DirtyPages dirty_pages_;
+    // whether advice reaches madvise
+    bool advise_;
+
+  public:
+    MmapDevice(int fd, uint64_t size, uint8_t *image, bool advise)
+        : BlockDevice(fd, size), image_(image), advise_(advise) {}
+    ~MmapDevice() override;
+
+    bool Read(uint64_t offset, void *buffer, uint64_t bytes) override;
+    uint8_t *Load(uint64_t, uint64_t) override { return image_; }
+    Pin Access(uint64_t offset, uint64_t) override {
+        return Pin(image_ + offset);
+    }
+    uint64_t SpanLimit() const override { return UINT64_MAX; }
+    void MarkDirty(Region region, uint64_t offset, uint64_t bytes) override {
+        dirty_pages_.Mark(region, offset, bytes);
+    }
+    void Import(IOEngine &engine, int fd, uint64_t fd_offset, uint64_t offset,
+                uint64_t bytes, uint64_t span, IOEngine::Done done) override;
+    void Export(IOEngine &engine, uint64_t offset, uint64_t bytes, int fd,
+                uint64_t fd_offset, IOEngine::Done done) override;
+    bool Flush(bool durable) override;
+    void Advise(uint64_t offset, uint64_t bytes, Advice advice) override;
+};
+
+/*
+ * The image read and written with pread/pwrite, for images too large to
+ * map or on files that cannot be mapped.
+ *
+ * The data region goes through a bounded cache of blocks evicted least
+ * recently used first, dirty ones written back as they leave; pinned
+ * blocks are never evicted, and the cache grows past its bound rather than
+ * fail while all of them are. File data is imported and exported in large
+ * runs straight between the files, around the cache.
+ */
+class PreadDevice : public BlockDevice {
+  private:
+    struct Block {
+        std::unique_ptr<uint8_t[]> data;
+        unsigned pins = 0;
+        bool loaded = false;
+        bool failed = false;
+        // the earliest region written into the block since its last write
+        // back, so that it goes out with that region
+        std::optional<Region> dirty;
+        // its place in lru_ while unpinned
+        std::list<uint64_t>::iterator unpinned;
+    };
+
+    std::unique_ptr<uint8_t[]> metadata_;
+    // a block of zeros, written as the slack of imported files
+    std::unique_ptr<uint8_t[]> zeros_;
+    uint64_t metadata_bytes_ = 0;
+    uint64_t block_bytes_ = 0;
+    uint64_t cache_bytes_;
+    // the bound on cached blocks
+    size_t capacity_ = 0;
+    DirtyPages dirty_metadata_;
+    // imported data not yet made durable
+    std::atomic<bool> unsynced_data_{false};
+    // a dirty block failed to be written back on eviction, which the next
+    // flush reports
+    bool write_back_failed_ = false;
+    // whether advice reaches posix_fadvise
+    bool advise_;
+
+    std::mutex mutex_;
+    std::condition_variable loaded_;
+    std::unordered_map<uint64_t, Block> blocks_;
+    // unpinned blocks, least recently used first
+    std::list<uint64_t> lru_;
+
+    uint64_t OffsetOfBlock(uint64_t block) const {
+        return metadata_bytes_ + block * block_bytes_;
+    }
+
+    // the bytes of `block` that lie within the image
+    uint64_t BytesOfBlock(uint64_t block) const;
+
+    bool WriteBack(uint64_t block, Block &cached);
+
+    // drop blocks until the cache is within its bound, with mutex_ held;
+    // hands back the buffer of the last one dropped for reuse
+    std::unique_ptr<uint8_t[]> Evict();
+
+  protected:
+    void Unpin(uint64_t block) override;
+
+  public:
+    PreadDevice(int fd, uint64_t size, uint64_t cache_bytes, bool advise)
+        : BlockDevice(fd, size), cache_bytes_(cache_bytes), advise_(advise) {}
+
+    bool Read(uint64_t offset, void *buffer, uint64_t bytes) override;
+    uint8_t *Load(uint64_t metadata_bytes, uint64_t block_bytes) override;
+    Pin Access(uint64_t offset, uint64_t bytes) override;
+    uint64_t SpanLimit() const override { return block_bytes_; }
+    void MarkDirty(Region region, uint64_t offset, uint64_t bytes) override;
+    void Import(IOEngine &engine, int fd, uint64_t fd_offset, uint64_t offset,
+                uint64_t bytes, uint64_t span, IOEngine::Done done) override;
+    void Export(IOEngine &engine, uint64_t offset, uint64_t bytes, int fd,
+                uint64_t fd_offset, IOEngine::Done done) override;
+    bool Flush(bool durable) override;
+    void Advise(uint64_t offset, uint64_t bytes, Advice advice) override;
+};
+
+} // namespace cs5250
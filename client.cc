@@ -0,0 +1,65 @@
+// Small client for `fat serve`: sends the command given on the command
+// line, or every line of stdin, and prints the responses.
+#include "socket_protocol.h"
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// send one request and print its response; false on failure
+static bool Request(int fd, const std::string &request) {
+    std::string response;
+    if (!cs5250::WriteMessage(fd, request) ||
+        !cs5250::ReadMessage(fd, response) || response.empty()) {
+        fprintf(stderr, "connection to the server lost\n");
+        exit(1);
+    }
+    if (response[0] != cs5250::kStatusOk) {
+        std::cerr << response.substr(1) << std::endl;
+        return false;
+    }
+    std::cout << response.substr(1);
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s [socket] [image command...]\n", argv[0]);
+        exit(1);
+    }
+
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, argv[1], sizeof(address.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1 || connect(fd, reinterpret_cast<sockaddr *>(&address),
+                            sizeof(address)) == -1) {
+        perror("connect");
+        exit(1);
+    }
+
+    bool ok = true;
+    if (argc > 2) {
+        // words with blanks are quoted again for the server to split
+        std::string request;
+        for (int i = 2; i < argc; ++i) {
+            std::string word = argv[i];
+            if (i > 2)
+                request += ' ';
+            if (word.find_first_of(" \t") != std::string::npos)
+                request += '"' + word + '"';
+            else
+                request += word;
+        }
+        ok = Request(fd, request);
+    } else {
+        for (std::string line; std::getline(std::cin, line);)
+            if (!line.empty())
+                ok = Request(fd, line) && ok;
+    }
+    close(fd);
+    return ok ? 0 : 1;
+}
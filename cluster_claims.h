@@ -0,0 +1,32 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+namespace cs5250 {
+
+// a bit per cluster, set by the first chain found to use it
+class ClusterClaims {
+  private:
+    std::vector<std::atomic<uint64_t>> words_;
+
+  public:
+    explicit ClusterClaims(uint32_t cluster_end)
+        : words_((cluster_end + 63) / 64) {}
+
+    // false when another chain has already claimed `cluster`
+    bool Claim(uint32_t cluster) {
+        auto bit = uint64_t(1) << (cluster % 64);
+        return !(words_[cluster / 64].fetch_or(bit,
+                                               std::memory_order_relaxed) &
+                 bit);
+    }
+
+    bool IsClaimed(uint32_t cluster) const {
+        return words_[cluster / 64].load(std::memory_order_relaxed) &
+               (uint64_t(1) << (cluster % 64));
+    }
+};
+
+} // namespace cs5250
@@ -0,0 +1,166 @@
+#include "commands.h"
+#include "image_builder.h"
+#include <chrono>
+
+namespace cs5250 {
+
+uint64_t ParseBytes(const std::string &value) {
+    char *end = nullptr;
+    auto bytes = strtoull(value.c_str(), &end, 10);
+    if (end == value.c_str())
+        throw FATError("invalid byte count " + value);
+    switch (*end) {
+    case 'G':
+        bytes <<= 10;
+        [[fallthrough]];
+    case 'M':
+        bytes <<= 10;
+        [[fallthrough]];
+    case 'K':
+        bytes <<= 10;
+        ++end;
+        break;
+    }
+    if (*end != '\0')
+        throw FATError("invalid byte count " + value);
+    return bytes;
+}
+
+static void Dispatch(FATManager &mgr, const std::vector<std::string> &args,
+                     std::ostream &out) {
+    auto &command = args[0];
+
+    // a read-only image is mapped without write access
+    if (mgr.ReadOnly() && IsMutatingCommand(args))
+        throw FATError("the image is open read-only");
+
+    if (command == "ck") {
+        mgr.Ck(out);
+    } else if (command == "ls") {
+        mgr.Ls(out);
+    } else if (command == "mem") {
+        mgr.Mem(out);
+    } else if (command == "verify") {
+        if (auto count = mgr.Verify(out); count != 0)
+            throw FATError("verify found " + std::to_string(count) +
+                           " problems");
+    } else if (command == "defrag") {
+        mgr.Defrag(args.size() > 1 ? ParseBytes(args[1]) : 0, out);
+    } else if (command == "stat") {
+        if (args.size() < 2)
+            throw FATError("usage: stat [path]");
+        mgr.Stat(args[1], out);
+    } else if (command == "cp") {
+        const std::string usage = "usage: cp [-r] local:[path] image:[path] "
+                                  "or cp [-r] image:[path] local:[path]";
+        // -r copies a whole directory
+        auto recursive = args.size() > 1 && args[1] == "-r";
+        if (args.size() < (recursive ? 4u : 3u))
+            throw FATError(usage);
+        // the arguments should be in the format of "image:/path/to/file"
+        // and "local:/path/to/file" try to read the first 6 characters
+        auto &src = args[recursive ? 2 : 1];
+        auto &dst = args[recursive ? 3 : 2];
+
+        if (src.substr(0, 6) == "image:" && dst.substr(0, 6) == "local:") {
+            if (recursive)
+                mgr.CopyDirTo(src.substr(6), dst.substr(6), out);
+            else
+                mgr.CopyFileTo(src.substr(6), dst.substr(6));
+        } else if (src.substr(0, 6) == "local:" &&
+                   dst.substr(0, 6) == "image:") {
+            if (recursive)
+                mgr.CopyDirFrom(src.substr(6), dst.substr(6), out);
+            else
+                mgr.CopyFileFrom(src.substr(6), dst.substr(6), out);
+        } else {
+            throw FATError(usage);
+        }
+    } else if (command == "mkimage") {
+        throw FATError("mkimage makes a new image, it cannot run on one that "
+                       "is open");
+    } else if (command == "rm") {
+        if (args.size() < 2)
+            throw FATError("usage: rm [path]");
+        mgr.Delete(args[1]);
+    } else {
+        throw FATError("Unknown command: " + command);
+    }
+}
+
+void RunCommand(FATManager &mgr, const std::vector<std::string> &args,
+                std::ostream &out) {
+    auto timer = mgr.Statistics().Time(Phase::Command);
+    try {
+        Dispatch(mgr, args, out);
+    } catch (const FATError &) {
+        // what the command changed before it failed is committed all the
+        // same
+        mgr.EndCommand();
+        throw;
+    }
+    mgr.EndCommand();
+}
+
+void MakeImage(const std::string &image, const std::vector<std::string> &args,
+               std::ostream &out) {
+    if (args.size() < 2 || args.size() > 4 ||
+        args[1].substr(0, 6) != "local:")
+        throw FATError("usage: mkimage local:[path] [size] [cluster size]");
+
+    auto start = std::chrono::steady_clock::now();
+    ImageBuilder builder;
+    builder.AddLocalDir(ImageBuilder::kRoot, args[1].substr(6));
+    ImageLayout layout;
+    layout.bytes_per_cluster = args.size() > 3 ? ParseBytes(args[3])
+                                               : builder.DefaultClusterBytes();
+    if (args.size() > 2)
+        layout.image_bytes = ParseBytes(args[2]);
+    auto image_bytes = builder.Write(image, layout);
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+
+    out << "Files = " << builder.FileCount() << std::endl;
+    out << "Directories = " << builder.DirCount() << std::endl;
+    out << "ClusterBytes = " << layout.bytes_per_cluster << std::endl;
+    out << "ImageBytes = " << image_bytes << std::endl;
+    out << "Seconds = " << elapsed.count() << std::endl;
+}
+
+bool IsMutatingCommand(const std::vector<std::string> &args) {
+    if (args.empty())
+        return false;
+    if (args[0] == "rm" || args[0] == "defrag" || args[0] == "mkimage")
+        return true;
+    // cp writes the image unless its destination is local
+    return args[0] == "cp" &&
+           args.back().substr(0, 6) != "local:";
+}
+
+std::vector<std::string> SplitLine(const std::string &line) {
+    std::vector<std::string> words;
+    std::string word;
+    bool in_word = false, quoted = false;
+    for (auto c : line) {
+        if (c == '"') {
+            quoted = !quoted;
+            in_word = true;
+        } else if (!quoted && (c == ' ' || c == '\t' || c == '\r')) {
+            if (in_word)
+                words.push_back(std::move(word));
+            word.clear();
+            in_word = false;
+        } else {
+            word += c;
+            in_word = true;
+        }
+    }
+    if (quoted)
+        throw FATError("unterminated quote");
+    if (in_word)
+        words.push_back(std::move(word));
+    return words;
+}
+
+
+} // namespace cs5250
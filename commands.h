@@ -0,0 +1,32 @@
+#pragma once
+
+#include "fat_manager.h"
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace cs5250 {
+
+// run one command (`ls`, `stat`, `cp`, `rm`, ...) against an opened image,
+// `args[0]` being the command; failures are thrown as FATError
+void RunCommand(FATManager &mgr, const std::vector<std::string> &args,
+                std::ostream &out = std::cout);
+
+// build a new FAT32 image at `image` from a local directory, `args` being
+// `mkimage local:[path] [size] [cluster size]`; failures are thrown as
+// FATError
+void MakeImage(const std::string &image, const std::vector<std::string> &args,
+               std::ostream &out = std::cout);
+
+// whether a command changes the image rather than only reading it
+bool IsMutatingCommand(const std::vector<std::string> &args);
+
+// a byte count with an optional K, M or G suffix, thrown as FATError when
+// malformed
+uint64_t ParseBytes(const std::string &value);
+
+// split a script line into words at blanks; a word may be double quoted to
+// keep blanks in it
+std::vector<std::string> SplitLine(const std::string &line);
+
+} // namespace cs5250
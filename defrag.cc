@@ -0,0 +1,228 @@
+#include "cluster_claims.h"
+#include "fat_manager.h"
+#include <algorithm>
+#include <functional>
+#include <tuple>
+#include <vector>
+
+namespace cs5250 {
+
+namespace {
+
+// how scattered the chains of the tree are
+struct Fragmentation {
+    uint64_t chains = 0;
+    uint64_t fragmented = 0;
+    uint64_t extents = 0;
+};
+
+} // namespace
+
+void FATManager::RelocateChain(NodeId node,
+                               const std::vector<uint32_t> &clusters) {
+    // a chain moved is a copy within the image
+    auto timer = stats_.Time(Phase::Copy);
+    auto old_first = tree_.FirstCluster(node);
+    auto old_clusters = ClustersOfFile(old_first);
+    ASSERT(old_clusters.size() == clusters.size());
+    uint64_t bytes_per_cluster =
+        uint64_t(bytes_per_sector_) * sectors_per_cluster_;
+    // as many clusters as the device can hold pinned at once
+    auto span_bytes = std::max(
+        device_->SpanLimit() / bytes_per_cluster * bytes_per_cluster,
+        bytes_per_cluster);
+
+    // the new chain is complete before anything points at it, and the old
+    // one is only freed once nothing does
+    for (size_t i = 0; i + 1 < clusters.size(); ++i)
+        fat_map_->Set(clusters[i], clusters[i + 1]);
+    fat_map_->Set(clusters.back(), fat_map_->EndOfChain());
+    DecreaseFreeClusterCount(clusters.size());
+    stats_.Add(Counter::ClustersAllocated, clusters.size());
+    stats_.Add(Counter::BytesCopied, clusters.size() * bytes_per_cluster);
+    for (size_t i = 0; i < clusters.size();) {
+        // copy whole runs that are consecutive on both sides at once
+        auto run = i + 1;
+        while (run < clusters.size() &&
+               clusters[run] == clusters[run - 1] + 1 &&
+               old_clusters[run] == old_clusters[run - 1] + 1)
+            ++run;
+        auto from = OffsetOfCluster(old_clusters[i]);
+        auto to = OffsetOfCluster(clusters[i]);
+        auto run_bytes = (run - i) * bytes_per_cluster;
+        for (uint64_t done = 0; done < run_bytes; done += span_bytes) {
+            auto bytes = std::min(span_bytes, run_bytes - done);
+            auto source = device_->Access(from + done, bytes);
+            auto dest = device_->Access(to + done, bytes);
+            memcpy(dest.Data(), source.Data(), bytes);
+            device_->MarkDirty(Region::Data, to + done, bytes);
+        }
+        i = run;
+    }
+
+    auto new_first = clusters.front();
+    auto point_at = [this, new_first](uint64_t offset) {
+        auto pin = device_->Access(offset, sizeof(FATDirectory));
+        auto entry = reinterpret_cast<FATDirectory *>(pin.Data());
+        entry->DIR_FstClusHI = new_first >> 16;
+        entry->DIR_FstClusLO = new_first & 0xffff;
+        device_->MarkDirty(Region::Dirent, offset, sizeof(FATDirectory));
+    };
+    point_at(tree_.DirentOffset(node));
+
+    if (tree_.IsDir(node)) {
+        // "." names the directory itself, and ".." of every subdirectory
+        // names it as the parent
+        point_at(OffsetOfCluster(new_first));
+        auto data_start = uint64_t(FirstSectorNumberOfDataCluster(2)) *
+                          bytes_per_sector_;
+        tree_.ForEachChild(node, [&](NodeId child) {
+            // the child's entry moved along with the cluster holding it
+            auto offset = tree_.DirentOffset(child);
+            auto cluster =
+                static_cast<uint32_t>((offset - data_start) /
+                                      bytes_per_cluster) +
+                2;
+            auto it = std::find(old_clusters.begin(), old_clusters.end(),
+                                cluster);
+            ASSERT(it != old_clusters.end());
+            auto moved = clusters[it - old_clusters.begin()];
+            tree_.SetDirentOffset(
+                child, offset + (int64_t(moved) - cluster) *
+                                    int64_t(bytes_per_cluster));
+            if (tree_.IsDir(child))
+                point_at(OffsetOfCluster(tree_.FirstCluster(child)) +
+                         sizeof(FATDirectory));
+        });
+    }
+
+    tree_.SetFirstCluster(node, new_first);
+    extents_.Invalidate(old_first);
+    FreeClusters(old_clusters);
+    UpdateNextFreeCluster(clusters.back());
+}
+
+void FATManager::Defrag(uint64_t budget, std::ostream &out) {
+    LoadTree(DirTree::kRoot);
+
+    // the root is left where it is: its cluster is recorded in the BPB
+    struct Chain {
+        NodeId node;
+        uint32_t clusters;
+        uint32_t extents;
+        // shares clusters with another chain
+        bool cross_linked = false;
+    };
+    std::vector<Chain> chains;
+    std::function<void(NodeId)> collect = [&](NodeId dir) {
+        tree_.ForEachChild(dir, [&](NodeId child) {
+            // an empty file has no chain
+            if (tree_.FirstCluster(child) == 0)
+                return;
+            uint32_t clusters = 0, extents = 0;
+            for (auto &extent : ExtentsOfFile(tree_.FirstCluster(child))) {
+                clusters += extent.cluster_count;
+                ++extents;
+            }
+            chains.push_back({child, clusters, extents});
+            if (tree_.IsDir(child))
+                collect(child);
+        });
+    };
+    collect(DirTree::kRoot);
+
+    // moving either of two chains that share clusters would free them
+    // under the other, so such chains are left where they are
+    auto cluster_end = count_of_clusters_ + 2;
+    ClusterClaims claimed(cluster_end), shared(cluster_end);
+    auto claim = [&](uint32_t cluster) {
+        if (!claimed.Claim(cluster))
+            shared.Claim(cluster);
+    };
+    auto root_cluster = tree_.FirstCluster(DirTree::kRoot);
+    if (!IsFixedRoot(root_cluster))
+        ForEveryClusterOfFile(root_cluster, claim);
+    for (auto &chain : chains)
+        if (tree_.FirstCluster(chain.node) >= 2)
+            ForEveryClusterOfFile(tree_.FirstCluster(chain.node), claim);
+    uint64_t cross_linked = 0;
+    for (auto &chain : chains) {
+        if (tree_.FirstCluster(chain.node) < 2)
+            continue;
+        ForEveryClusterOfFile(tree_.FirstCluster(chain.node),
+                              [&](uint32_t cluster) {
+                                  if (shared.IsClaimed(cluster))
+                                      chain.cross_linked = true;
+                              });
+        if (chain.cross_linked) {
+            out << "cross-linked " << tree_.Name(chain.node)
+                << ": left in place, see verify" << std::endl;
+            ++cross_linked;
+        }
+    }
+
+    auto measure = [&] {
+        Fragmentation fragmentation;
+        for (auto &chain : chains) {
+            ++fragmentation.chains;
+            fragmentation.fragmented += chain.extents > 1;
+            fragmentation.extents += chain.extents;
+        }
+        return fragmentation;
+    };
+    auto before = measure();
+
+    // small chains first: they fit the most holes, and the holes they
+    // leave behind join up for the larger ones
+    std::vector<Chain *> fragmented;
+    for (auto &chain : chains)
+        if (chain.extents > 1 && !chain.cross_linked)
+            fragmented.push_back(&chain);
+    std::sort(fragmented.begin(), fragmented.end(),
+              [this](const Chain *a, const Chain *b) {
+                  return std::make_tuple(a->clusters,
+                                         tree_.FirstCluster(a->node)) <
+                         std::make_tuple(b->clusters,
+                                         tree_.FirstCluster(b->node));
+              });
+
+    uint64_t bytes_per_cluster =
+        uint64_t(bytes_per_sector_) * sectors_per_cluster_;
+    uint64_t moved_bytes = 0, moved_chains = 0;
+    for (auto chain : fragmented) {
+        auto bytes = chain->clusters * bytes_per_cluster;
+        if (budget != 0 && moved_bytes + bytes > budget)
+            break;
+        // only move a chain to where it ends up in fewer pieces
+        auto target = fat_map_->FindContiguous(chain->clusters,
+                                               tree_.FirstCluster(chain->node));
+        if (!target)
+            continue;
+        auto extents = FATMap::CountExtents(*target);
+        if (extents >= chain->extents)
+            continue;
+
+        MarkTreeModified();
+        RelocateChain(chain->node, *target);
+        if (options_.verbose)
+            out << "moved " << tree_.Name(chain->node) << ": "
+                << chain->clusters << " clusters from "
+                << chain->extents << " to " << extents << " extents"
+                << std::endl;
+        chain->extents = extents;
+        moved_bytes += bytes;
+        ++moved_chains;
+    }
+
+    auto after = measure();
+    out << "Chains = " << before.chains << std::endl;
+    out << "FragmentedBefore = " << before.fragmented << std::endl;
+    out << "ExtentsBefore = " << before.extents << std::endl;
+    out << "FragmentedAfter = " << after.fragmented << std::endl;
+    out << "ExtentsAfter = " << after.extents << std::endl;
+    out << "MovedChains = " << moved_chains << std::endl;
+    out << "MovedBytes = " << moved_bytes << std::endl;
+    out << "CrossLinked = " << cross_linked << std::endl;
+}
+
+} // namespace cs5250
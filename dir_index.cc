@@ -0,0 +1,104 @@
+#include "dir_index.h"
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace cs5250 {
+
+uint64_t HashBytes(const uint8_t *data, size_t size, uint64_t seed) {
+    constexpr uint64_t kMul = 0x9E3779B97F4A7C15ULL;
+    auto h = seed ^ (size * kMul);
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        h = (h ^ word) * kMul;
+        h ^= h >> 29;
+    }
+    for (; i < size; ++i) {
+        h = (h ^ data[i]) * kMul;
+    }
+    return h ^ (h >> 32);
+}
+
+std::unique_ptr<DirIndex> DirIndex::Open(const std::string &path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return nullptr;
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 ||
+        static_cast<size_t>(st.st_size) < sizeof(DirIndexHeader)) {
+        close(fd);
+        return nullptr;
+    }
+    size_t size = st.st_size;
+
+    auto data = static_cast<uint8_t *>(
+        mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0));
+    close(fd);
+    if (data == MAP_FAILED)
+        return nullptr;
+
+    std::unique_ptr<DirIndex> index(new DirIndex(data, size));
+
+    // reject anything that could make the accessors read out of bounds
+    auto &header = index->Header();
+    if (memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 ||
+        header.version != kVersion || header.node_count == 0 ||
+        sizeof(DirIndexHeader) +
+                uint64_t(header.node_count) * sizeof(DirIndexNode) +
+                header.names_size !=
+            size)
+        return nullptr;
+
+    for (uint32_t i = 0; i < header.node_count; ++i) {
+        auto &node = index->Node(i);
+        if (uint64_t(node.name_offset) + node.name_length +
+                    node.short_name_length >
+                header.names_size ||
+            (node.IsDir() && uint64_t(node.first_child) + node.child_count >
+                                header.node_count))
+            return nullptr;
+    }
+    if (!index->Node(0).IsDir())
+        return nullptr;
+
+    return index;
+}
+
+bool DirIndex::Write(const std::string &path, DirIndexHeader header,
+                     const std::vector<DirIndexNode> &nodes,
+                     const std::string &names) {
+    memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.version = kVersion;
+    header.node_count = nodes.size();
+    header.names_size = names.size();
+
+    auto tmp_path = path + ".tmp";
+    auto file = fopen(tmp_path.c_str(), "wb");
+    if (file == nullptr)
+        return false;
+
+    auto ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+              fwrite(nodes.data(), sizeof(DirIndexNode), nodes.size(),
+                     file) == nodes.size() &&
+              fwrite(names.data(), 1, names.size(), file) == names.size();
+    ok = (fclose(file) == 0) && ok;
+
+    if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+        unlink(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+DirIndex::~DirIndex() {
+    if (data_ != nullptr)
+        munmap(data_, size_);
+}
+
+} // namespace cs5250
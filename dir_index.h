@@ -0,0 +1,115 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace cs5250 {
+
+/*
+ * Sidecar index of the directory tree.
+ *
+ * The file is a header followed by a flat array of nodes and a pool of
+ * names. Node 0 is the root directory, and the children of a directory are
+ * stored contiguously in the order they appear in the directory, so the
+ * mapped file can be walked without building anything in memory.
+ *
+ * Every directory node carries a hash of the clusters it was listed from,
+ * checked when the directory is first needed, so opening the index costs
+ * the same however large the tree is.
+ */
+struct DirIndexHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t node_count;
+    uint64_t names_size;
+
+    // identity of the volume the index was built from
+    uint8_t vol_id[4];
+    uint16_t bytes_per_sector;
+    uint8_t sectors_per_cluster;
+    uint8_t number_of_fats;
+    uint32_t reserved_sector_count;
+    uint32_t sector_count_per_fat;
+    uint32_t root_cluster;
+    uint64_t image_size;
+} __attribute__((packed));
+
+struct DirIndexNode {
+    uint32_t first_cluster;
+    uint32_t size;
+    uint32_t first_child;
+    uint32_t child_count;
+    // the 8.3 name follows the long name in the pool
+    uint32_t name_offset;
+    uint16_t name_length;
+    uint8_t short_name_length;
+    uint8_t attr;
+    // byte offset of the short directory entry in the image
+    uint64_t dirent_offset;
+    // of a directory: hash of its clusters and their numbers when it was
+    // indexed
+    uint64_t dir_hash;
+
+    bool IsDir() const { return attr == 0x10; }
+} __attribute__((packed));
+
+static_assert(sizeof(DirIndexNode) == 40);
+
+// 64-bit hash of a byte range, chained through `seed`
+uint64_t HashBytes(const uint8_t *data, size_t size, uint64_t seed);
+
+class DirIndex {
+  private:
+    uint8_t *data_ = nullptr;
+    size_t size_ = 0;
+
+    DirIndex(uint8_t *data, size_t size) : data_(data), size_(size) {}
+
+  public:
+    static constexpr char kMagic[8] = {'F', 'A', 'T', 'I', 'D', 'X', 0, 1};
+    static constexpr uint32_t kVersion = 4;
+
+    // map an index file, nullptr if it is missing or malformed
+    static std::unique_ptr<DirIndex> Open(const std::string &path);
+
+    // atomically replace the index file at `path`
+    static bool Write(const std::string &path, DirIndexHeader header,
+                      const std::vector<DirIndexNode> &nodes,
+                      const std::string &names);
+
+    DirIndex(const DirIndex &) = delete;
+    DirIndex &operator=(const DirIndex &) = delete;
+
+    ~DirIndex();
+
+    const DirIndexHeader &Header() const {
+        return *reinterpret_cast<const DirIndexHeader *>(data_);
+    }
+
+    uint32_t NodeCount() const { return Header().node_count; }
+
+    const DirIndexNode &Node(uint32_t id) const {
+        return reinterpret_cast<const DirIndexNode *>(
+            data_ + sizeof(DirIndexHeader))[id];
+    }
+
+    std::string_view NameOf(const DirIndexNode &node) const {
+        auto names = reinterpret_cast<const char *>(
+            data_ + sizeof(DirIndexHeader) +
+            NodeCount() * sizeof(DirIndexNode));
+        return {names + node.name_offset, node.name_length};
+    }
+
+    std::string_view ShortNameOf(const DirIndexNode &node) const {
+        auto names = reinterpret_cast<const char *>(
+            data_ + sizeof(DirIndexHeader) +
+            NodeCount() * sizeof(DirIndexNode));
+        return {names + node.name_offset + node.name_length,
+                node.short_name_length};
+    }
+};
+
+} // namespace cs5250
@@ -0,0 +1,142 @@
+#include "dir_tree.h"
+
+namespace cs5250 {
+
+void DirTree::Reset(uint32_t root_cluster) {
+    *this = DirTree();
+    NewNode(kNoNode, SimpleStruct{"", root_cluster, true, 0});
+}
+
+NodeId DirTree::NewNode(NodeId parent, const SimpleStruct &entry) {
+    NodeId id = parent_.size();
+    parent_.push_back(parent);
+    first_cluster_.push_back(entry.first_cluster);
+    size_.push_back(entry.size);
+    attr_.push_back(entry.attr);
+    flags_.push_back(entry.is_dir ? kDir : 0);
+    name_offset_.push_back(names_.size());
+    name_length_.push_back(entry.name.size());
+    // a short name equal to the long one is not stored twice
+    auto short_name =
+        entry.short_name == entry.name ? std::string() : entry.short_name;
+    short_name_length_.push_back(short_name.size());
+    names_ += entry.name;
+    names_ += short_name;
+    dirent_offset_.push_back(entry.dirent_offset);
+    next_sibling_.push_back(kNoNode);
+    first_child_.push_back(kNoNode);
+    last_child_.push_back(kNoNode);
+    ++live_count_;
+    return id;
+}
+
+void DirTree::IndexNode(NodeId id) {
+    index_.Insert(HashInDir(parent_[id], Name(id)), id);
+    IndexShortName(id);
+}
+
+void DirTree::IndexShortName(NodeId id) {
+    // files written by this tool share one short name, index it once
+    auto dir = parent_[id];
+    auto short_name = ShortName(id);
+    if (!short_name.empty() && !FoldedNameEqual(short_name, Name(id)) &&
+        Find(dir, short_name) == kNoNode) {
+        index_.Insert(HashInDir(dir, short_name), id);
+        flags_[id] |= kShortIndexed;
+    }
+}
+
+void DirTree::RebuildIndex() {
+    index_.Clear();
+    dead_slots_ = 0;
+    for (NodeId id = 1; id < parent_.size(); ++id) {
+        flags_[id] &= ~kShortIndexed;
+        if (!(flags_[id] & kRemoved))
+            IndexNode(id);
+    }
+}
+
+void DirTree::SetChildren(NodeId dir, std::vector<SimpleStruct> &&entries) {
+    flags_[dir] |= kLoaded;
+    for (auto &entry : entries)
+        AddChild(dir, entry);
+}
+
+NodeId DirTree::AddChild(NodeId dir, const SimpleStruct &entry) {
+    auto id = NewNode(dir, entry);
+    if (last_child_[dir] == kNoNode)
+        first_child_[dir] = id;
+    else
+        next_sibling_[last_child_[dir]] = id;
+    last_child_[dir] = id;
+    IndexNode(id);
+    return id;
+}
+
+void DirTree::Remove(NodeId id) {
+    auto dir = parent_[id];
+
+    // unlink from the parent's list of children
+    NodeId prev = kNoNode;
+    for (auto cur = first_child_[dir]; cur != id; cur = next_sibling_[cur])
+        prev = cur;
+    if (prev == kNoNode)
+        first_child_[dir] = next_sibling_[id];
+    else
+        next_sibling_[prev] = next_sibling_[id];
+    if (last_child_[dir] == id)
+        last_child_[dir] = prev;
+
+    // the index keeps stale slots until they outnumber the live ones
+    std::vector<NodeId> stack{id};
+    while (!stack.empty()) {
+        auto cur = stack.back();
+        stack.pop_back();
+        flags_[cur] |= kRemoved;
+        --live_count_;
+        dead_slots_ += flags_[cur] & kShortIndexed ? 2 : 1;
+        ForEachChild(cur, [&stack](NodeId child) { stack.push_back(child); });
+    }
+
+    // a sibling that shares the short name takes over its slot
+    if (flags_[id] & kShortIndexed) {
+        auto short_name = ShortName(id);
+        for (auto cur = first_child_[dir]; cur != kNoNode;
+             cur = next_sibling_[cur]) {
+            if (FoldedNameEqual(ShortName(cur), short_name)) {
+                IndexShortName(cur);
+                break;
+            }
+        }
+    }
+    if (dead_slots_ * 2 > index_.Size())
+        RebuildIndex();
+}
+
+NodeId DirTree::Find(NodeId dir, std::string_view name) const {
+    auto position =
+        index_.Find(HashInDir(dir, name), [this, dir, name](uint32_t id) {
+            return parent_[id] == dir && !(flags_[id] & kRemoved) &&
+                   (FoldedNameEqual(Name(id), name) ||
+                    FoldedNameEqual(ShortName(id), name));
+        });
+    return position ? *position : kNoNode;
+}
+
+size_t DirTree::MemoryUsage() const {
+    return parent_.capacity() * sizeof(NodeId) +
+           first_cluster_.capacity() * sizeof(uint32_t) +
+           size_.capacity() * sizeof(uint32_t) +
+           attr_.capacity() * sizeof(uint8_t) +
+           flags_.capacity() * sizeof(uint8_t) +
+           name_offset_.capacity() * sizeof(uint32_t) +
+           name_length_.capacity() * sizeof(uint16_t) +
+           short_name_length_.capacity() * sizeof(uint8_t) +
+           dirent_offset_.capacity() * sizeof(uint64_t) +
+           next_sibling_.capacity() * sizeof(NodeId) +
+           first_child_.capacity() * sizeof(NodeId) +
+           last_child_.capacity() * sizeof(NodeId) + names_.capacity() +
+           index_.MemoryUsage();
+}
+
+} // namespace cs5250
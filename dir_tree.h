@@ -0,0 +1,134 @@
+#pragma once
+
+#include "fat.h"
+#include "name_index.h"
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace cs5250 {
+
+using NodeId = uint32_t;
+
+constexpr NodeId kNoNode = UINT32_MAX;
+
+// dirent location of a node that has no directory entry (the root)
+constexpr uint64_t kNoDirent = UINT64_MAX;
+
+/*
+ * In-memory directory tree, stored as a struct of arrays indexed by NodeId.
+ *
+ * Names live in a single pool (the long name immediately followed by the 8.3
+ * name), the children of a directory form a singly linked list in directory
+ * order, and one hash table over (parent, folded name) serves lookups in
+ * every directory. A directory's children are only present once it has been
+ * loaded; removed nodes stay in the arrays but are unlinked and never match.
+ */
+class DirTree {
+  private:
+    // per node
+    std::vector<NodeId> parent_;
+    std::vector<uint32_t> first_cluster_;
+    std::vector<uint32_t> size_;
+    std::vector<uint8_t> attr_;
+    std::vector<uint8_t> flags_;
+    std::vector<uint32_t> name_offset_;
+    std::vector<uint16_t> name_length_;
+    std::vector<uint8_t> short_name_length_;
+    // byte offset of the node's short directory entry in the image
+    std::vector<uint64_t> dirent_offset_;
+    std::vector<NodeId> next_sibling_;
+    // only meaningful for directories
+    std::vector<NodeId> first_child_;
+    std::vector<NodeId> last_child_;
+
+    std::string names_;
+    NameIndex index_;
+    size_t live_count_ = 0;
+    size_t dead_slots_ = 0;
+
+    // kShortIndexed: the node's 8.3 name has a slot in the index
+    enum Flags : uint8_t {
+        kLoaded = 1,
+        kRemoved = 2,
+        kDir = 4,
+        kShortIndexed = 8,
+    };
+
+    static uint32_t HashInDir(NodeId dir, std::string_view name) {
+        return FoldedNameHash(name) ^ (dir * 0x9E3779B1u);
+    }
+
+    NodeId NewNode(NodeId parent, const SimpleStruct &entry);
+
+    void IndexNode(NodeId id);
+
+    // index the 8.3 name of `id` unless another child of its directory
+    // already answers to it
+    void IndexShortName(NodeId id);
+
+    void RebuildIndex();
+
+  public:
+    static constexpr NodeId kRoot = 0;
+
+    // forget everything and start over with an unloaded root directory
+    void Reset(uint32_t root_cluster);
+
+    bool IsLoaded(NodeId dir) const { return flags_[dir] & kLoaded; }
+
+    // install the entries of a directory read from the image
+    void SetChildren(NodeId dir, std::vector<SimpleStruct> &&entries);
+
+    // append one entry to a loaded directory
+    NodeId AddChild(NodeId dir, const SimpleStruct &entry);
+
+    // unlink a node and everything under it
+    void Remove(NodeId id);
+
+    // child of `dir` called `name` (long or 8.3, any case), or kNoNode
+    NodeId Find(NodeId dir, std::string_view name) const;
+
+    template <typename F> void ForEachChild(NodeId dir, F &&function) const {
+        for (auto id = first_child_[dir]; id != kNoNode; id = next_sibling_[id])
+            function(id);
+    }
+
+    NodeId Parent(NodeId id) const { return parent_[id]; }
+
+    uint32_t FirstCluster(NodeId id) const { return first_cluster_[id]; }
+
+    // after the node's chain was moved elsewhere
+    void SetFirstCluster(NodeId id, uint32_t cluster) {
+        first_cluster_[id] = cluster;
+    }
+
+    uint32_t Size(NodeId id) const { return size_[id]; }
+
+    uint8_t Attr(NodeId id) const { return attr_[id]; }
+
+    bool IsDir(NodeId id) const { return flags_[id] & kDir; }
+
+    uint64_t DirentOffset(NodeId id) const { return dirent_offset_[id]; }
+
+    void SetDirentOffset(NodeId id, uint64_t offset) {
+        dirent_offset_[id] = offset;
+    }
+
+    std::string_view Name(NodeId id) const {
+        return {names_.data() + name_offset_[id], name_length_[id]};
+    }
+
+    std::string_view ShortName(NodeId id) const {
+        return {names_.data() + name_offset_[id] + name_length_[id],
+                short_name_length_[id]};
+    }
+
+    size_t NodeCount() const { return live_count_; }
+
+    // bytes held by the tree, counting reserved capacity
+    size_t MemoryUsage() const;
+};
+
+} // namespace cs5250
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <mutex>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+namespace cs5250 {
+
+// what a written range of the image holds, in the order it is flushed
+enum class Region { Data, FAT, Dirent, FSInfo, Count };
+
+/*
+ * Pages of the image written since the last flush, by region.
+ *
+ * A flush goes one region at a time: file data before the FAT that links
+ * it, the FAT before the directory entries that point into it, and FSInfo
+ * last, as it only summarizes the FAT. Writes may be marked from several
+ * threads.
+ */
+class DirtyPages {
+  private:
+    uint64_t page_size_ = sysconf(_SC_PAGESIZE);
+    // [begin, end) byte offsets of the image, page aligned
+    std::vector<std::pair<uint64_t, uint64_t>>
+        ranges_[static_cast<size_t>(Region::Count)];
+    std::mutex mutex_;
+
+  public:
+    void Mark(Region region, uint64_t offset, uint64_t bytes) {
+        if (bytes == 0)
+            return;
+        uint64_t begin = offset & ~(page_size_ - 1);
+        uint64_t end = (offset + bytes + page_size_ - 1) & ~(page_size_ - 1);
+        std::lock_guard lock(mutex_);
+        auto &ranges = ranges_[static_cast<size_t>(region)];
+        // consecutive writes mostly extend the last range
+        if (!ranges.empty() && ranges.back().first <= begin &&
+            begin <= ranges.back().second)
+            ranges.back().second = std::max(ranges.back().second, end);
+        else
+            ranges.push_back({begin, end});
+    }
+
+    // the marked ranges of `region`, sorted and merged, which are no longer
+    // marked afterwards
+    std::vector<std::pair<uint64_t, uint64_t>> Take(Region region) {
+        std::lock_guard lock(mutex_);
+        auto ranges = std::move(ranges_[static_cast<size_t>(region)]);
+        ranges_[static_cast<size_t>(region)].clear();
+        std::sort(ranges.begin(), ranges.end());
+        size_t kept = 0;
+        for (size_t i = 0; i < ranges.size(); ++i) {
+            if (kept != 0 && ranges[i].first <= ranges[kept - 1].second)
+                ranges[kept - 1].second =
+                    std::max(ranges[kept - 1].second, ranges[i].second);
+            else
+                ranges[kept++] = ranges[i];
+        }
+        ranges.resize(kept);
+        return ranges;
+    }
+
+    // msync every marked page of the image mapped at `base`, region by
+    // region; false if one failed
+    bool Flush(uint8_t *base) {
+        bool ok = true;
+        for (size_t region = 0; region < size_t(Region::Count); ++region)
+            for (auto [begin, end] : Take(static_cast<Region>(region)))
+                if (msync(base + begin, end - begin, MS_SYNC) == -1)
+                    ok = false;
+        return ok;
+    }
+};
+
+} // namespace cs5250
@@ -0,0 +1,92 @@
+#pragma once
+
+#include "fat_error.h"
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace cs5250 {
+
+// a run of consecutive clusters in a cluster chain
+struct Extent {
+    uint32_t first_cluster;
+    uint32_t cluster_count;
+};
+
+/*
+ * Cluster chains of files as lists of extents, keyed by the first cluster.
+ *
+ * A chain is followed through the FAT once and then served from here until
+ * it changes, so walking a file costs one step per extent rather than one
+ * FAT lookup per cluster. Lookups may come from several threads.
+ */
+class ExtentMap {
+  private:
+    std::unordered_map<uint32_t, std::vector<Extent>> chains_;
+    std::mutex mutex_;
+
+  public:
+    // `next(cluster)` is the FAT entry of `cluster`, `is_end(entry)` tells
+    // whether an entry ends the chain; a chain that leaves clusters 2 up to
+    // `cluster_end` (a bad cluster marker included) or is longer than there
+    // are clusters, and so loops, is thrown as FATError; cluster 0 is the
+    // empty chain of an empty file
+    template <typename Next, typename IsEnd>
+    static std::vector<Extent> Build(uint32_t first_cluster,
+                                     uint32_t cluster_end, Next &&next,
+                                     IsEnd &&is_end) {
+        if (first_cluster == 0)
+            return {};
+        if (first_cluster < 2 || first_cluster >= cluster_end)
+            throw FATError("corrupt cluster chain: cluster " +
+                           std::to_string(first_cluster) + " out of range");
+        std::vector<Extent> extents{{first_cluster, 1}};
+        uint32_t length = 1;
+        for (auto cluster = next(first_cluster); !is_end(cluster);
+             cluster = next(cluster)) {
+            if (cluster < 2 || cluster >= cluster_end)
+                throw FATError("corrupt cluster chain from " +
+                               std::to_string(first_cluster) + ": entry " +
+                               std::to_string(cluster) + " out of range");
+            if (++length > cluster_end)
+                throw FATError("corrupt cluster chain from " +
+                               std::to_string(first_cluster) + ": loops");
+            auto &last = extents.back();
+            if (cluster == last.first_cluster + last.cluster_count)
+                ++last.cluster_count;
+            else
+                extents.push_back({cluster, 1});
+        }
+        return extents;
+    }
+
+    // `build(first_cluster)` follows a chain that is not cached yet
+    template <typename Build>
+    std::vector<Extent> Get(uint32_t first_cluster, Build &&build) {
+        {
+            std::lock_guard lock(mutex_);
+            if (auto it = chains_.find(first_cluster); it != chains_.end())
+                return it->second;
+        }
+        // the FAT is not written while chains are being read
+        auto extents = build(first_cluster);
+        std::lock_guard lock(mutex_);
+        chains_.emplace(first_cluster, extents);
+        return extents;
+    }
+
+    // forget the chain starting at `first_cluster` after it changed
+    void Invalidate(uint32_t first_cluster) {
+        std::lock_guard lock(mutex_);
+        chains_.erase(first_cluster);
+    }
+
+    void Clear() {
+        std::lock_guard lock(mutex_);
+        chains_.clear();
+    }
+};
+
+} // namespace cs5250
@@ -0,0 +1,319 @@
+// Benchmark suite over synthetic FAT32 images: builds an image per scale
+// with ImageBuilder, then times opening it, ls, path lookups, copying a
+// file out of and into it and removing a directory tree, a fresh
+// FATManager per measurement. Results are printed as JSON.
+#include "commands.h"
+#include "fat_manager.h"
+#include "image_builder.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <limits>
+#include <ostream>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+using namespace cs5250;
+
+namespace {
+
+struct Config {
+    // files per image, one image each
+    std::vector<unsigned> scales = {1000, 10000};
+    ImageLayout layout;
+    uint64_t file_bytes = 4096;
+    // the file copied out of and into the image
+    uint64_t copy_bytes = uint64_t(16) << 20;
+    // subdirectories per directory, and levels of them below the root
+    unsigned fanout = 8;
+    unsigned depth = 2;
+    unsigned name_length = 12;
+    unsigned lookups = 1000;
+    int rounds = 3;
+    std::string dir = std::filesystem::temp_directory_path().string();
+    FATOptions options;
+};
+
+struct Result {
+    double best = std::numeric_limits<double>::max();
+    double total = 0;
+
+    template <typename F> void Time(F &&function) {
+        auto start = std::chrono::steady_clock::now();
+        function();
+        std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - start;
+        best = std::min(best, elapsed.count());
+        total += elapsed.count();
+    }
+};
+
+// `prefix` and a number, padded to `length` so that names are as long as
+// asked for
+std::string NameOf(char prefix, size_t number, unsigned length) {
+    auto name = prefix + std::to_string(number);
+    if (name.size() < length)
+        name += std::string(length - name.size(), 'x');
+    return name;
+}
+
+// a file whose every byte is `fill`, as cheap to produce as can be
+ImageBuilder::Source FilledWith(uint8_t fill) {
+    return [fill](uint64_t, uint8_t *data, uint64_t bytes) {
+        memset(data, fill, bytes);
+        return true;
+    };
+}
+
+struct Image {
+    std::string path;
+    size_t dirs;
+    size_t files;
+    uint64_t bytes;
+    double generate_seconds;
+    // files spread over the tree, to be looked up
+    std::vector<std::string> lookups;
+    // the directory removed, empty when the tree has none
+    std::string subtree;
+};
+
+// a tree of `fanout` directories per directory `depth` levels deep, with
+// `files` files dealt out over all of its directories and the copied file
+// in the root
+Image Generate(const Config &config, unsigned files,
+               const std::string &path) {
+    ImageBuilder builder;
+    std::vector<std::pair<uint32_t, std::string>> dirs = {
+        {ImageBuilder::kRoot, ""}};
+    size_t level_begin = 0;
+    for (unsigned level = 0; level < config.depth; ++level) {
+        auto level_end = dirs.size();
+        for (auto parent = level_begin; parent < level_end; ++parent)
+            for (unsigned i = 0; i < config.fanout; ++i) {
+                auto name = NameOf('d', dirs.size(), config.name_length);
+                auto id = builder.AddDir(dirs[parent].first, name);
+                dirs.push_back({id, dirs[parent].second + "/" + name});
+            }
+        level_begin = level_end;
+    }
+
+    Image image;
+    image.path = path;
+    auto every = std::max<size_t>(files / std::max(config.lookups, 1u), 1);
+    for (unsigned i = 0; i < files; ++i) {
+        auto &[dir, dir_path] = dirs[i % dirs.size()];
+        auto name = NameOf('f', i, config.name_length);
+        builder.AddFile(dir, name, config.file_bytes, FilledWith('a' + i % 26));
+        if (i % every == 0 && image.lookups.size() < config.lookups)
+            image.lookups.push_back(dir_path + "/" + name);
+    }
+    builder.AddFile(ImageBuilder::kRoot, "copy.bin", config.copy_bytes,
+                    FilledWith('c'));
+    if (dirs.size() > 1)
+        image.subtree = dirs[1].second;
+
+    // room is left for the file copied in, and for directories to grow
+    auto layout = config.layout;
+    if (layout.image_bytes == 0)
+        layout.image_bytes = builder.MinimumBytes(layout.bytes_per_cluster) +
+                             config.copy_bytes + (uint64_t(1) << 20);
+    Result generate;
+    generate.Time([&] { image.bytes = builder.Write(path, layout); });
+    image.dirs = builder.DirCount();
+    image.files = builder.FileCount();
+    image.generate_seconds = generate.total;
+    return image;
+}
+
+void PrintResult(const char *name, const Result &result, int rounds,
+                 bool last = false) {
+    printf("      \"%s\": {\"best_s\": %.6f, \"mean_s\": %.6f}%s\n", name,
+           result.best, result.total / rounds, last ? "" : ",");
+}
+
+// files of a run, removed however it ends
+struct Scratch {
+    std::string base;
+    std::string image = base + ".img";
+    std::string work = base + ".work.img";
+    std::string local_in = base + ".in";
+    std::string local_out = base + ".out";
+
+    ~Scratch() {
+        for (auto &path : {image, work, local_in, local_out})
+            std::filesystem::remove(path);
+    }
+};
+
+void Bench(const Config &config, unsigned files, bool last) {
+    Scratch scratch{config.dir + "/fat_bench." + std::to_string(getpid())};
+    auto image = Generate(config, files, scratch.image);
+    auto &work = scratch.work;
+    auto &local_in = scratch.local_in, &local_out = scratch.local_out;
+    {
+        std::vector<uint8_t> data(config.copy_bytes, 'i');
+        FILE *file = fopen(local_in.c_str(), "wb");
+        if (!file || fwrite(data.data(), 1, data.size(), file) != data.size())
+            throw FATError("failed to write " + local_in);
+        fclose(file);
+    }
+
+    // output of the commands themselves is thrown away
+    std::ostream null(nullptr);
+    auto read_only = config.options;
+    read_only.read_only = true;
+    // the commands that change the image get a copy of it each round
+    auto fresh_copy = [&] {
+        std::filesystem::copy_file(
+            image.path, work,
+            std::filesystem::copy_options::overwrite_existing);
+        return std::make_unique<FATManager>(work, config.options);
+    };
+
+    Result startup, ls, lookup, copy_to, copy_from, remove;
+    for (int round = 0; round < config.rounds; ++round) {
+        std::unique_ptr<FATManager> mgr;
+        startup.Time(
+            [&] { mgr = std::make_unique<FATManager>(image.path, read_only); });
+        ls.Time([&] { mgr->Ls(null); });
+
+        mgr = std::make_unique<FATManager>(image.path, read_only);
+        lookup.Time([&] {
+            for (auto &path : image.lookups)
+                mgr->Stat(path, null);
+        });
+
+        mgr = std::make_unique<FATManager>(image.path, read_only);
+        copy_to.Time([&] { mgr->CopyFileTo("/copy.bin", local_out); });
+        std::filesystem::remove(local_out);
+
+        mgr = fresh_copy();
+        copy_from.Time([&] { mgr->CopyFileFrom(local_in, "/in.bin", null); });
+
+        if (!image.subtree.empty()) {
+            mgr = fresh_copy();
+            remove.Time([&] { mgr->Delete(image.subtree); });
+        }
+        mgr.reset();
+    }
+
+    printf("    {\n");
+    printf("      \"files\": %zu,\n", image.files);
+    printf("      \"dirs\": %zu,\n", image.dirs);
+    printf("      \"image_bytes\": %llu,\n",
+           static_cast<unsigned long long>(image.bytes));
+    printf("      \"generate_s\": %.6f,\n", image.generate_seconds);
+    printf("      \"lookups\": %zu,\n", image.lookups.size());
+    PrintResult("startup", startup, config.rounds);
+    PrintResult("ls", ls, config.rounds);
+    PrintResult("lookup", lookup, config.rounds);
+    PrintResult("copy_to", copy_to, config.rounds);
+    PrintResult("copy_from", copy_from, config.rounds, image.subtree.empty());
+    if (!image.subtree.empty())
+        PrintResult("delete", remove, config.rounds, true);
+    printf("    }%s\n", last ? "" : ",");
+}
+
+[[noreturn]] void Usage(const char *program) {
+    fprintf(stderr,
+            "Usage: %s [--files=N,N,...] [--size=SIZE] [--cluster=SIZE] "
+            "[--file-size=SIZE] [--copy-size=SIZE] [--fanout=N] "
+            "[--depth=N] [--name-len=N] [--fragment=N] [--lookups=N] "
+            "[--rounds=N] [--io=mmap|pread] [--threads=N] [--dir=PATH]\n",
+            program);
+    exit(1);
+}
+
+Config ParseConfig(int argc, char *argv[]) {
+    Config config;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        auto eq = arg.find('=');
+        if (arg.substr(0, 2) != "--" || eq == std::string::npos)
+            Usage(argv[0]);
+        auto name = arg.substr(2, eq - 2), value = arg.substr(eq + 1);
+        auto count = [&] { return unsigned(ParseBytes(value)); };
+        if (name == "files") {
+            config.scales.clear();
+            for (size_t at = 0; at <= value.size();) {
+                auto comma = std::min(value.find(',', at), value.size());
+                config.scales.push_back(
+                    ParseBytes(value.substr(at, comma - at)));
+                at = comma + 1;
+            }
+        } else if (name == "size") {
+            config.layout.image_bytes = ParseBytes(value);
+        } else if (name == "cluster") {
+            config.layout.bytes_per_cluster = ParseBytes(value);
+        } else if (name == "file-size") {
+            config.file_bytes = ParseBytes(value);
+        } else if (name == "copy-size") {
+            config.copy_bytes = ParseBytes(value);
+        } else if (name == "fanout") {
+            config.fanout = count();
+        } else if (name == "depth") {
+            config.depth = count();
+        } else if (name == "name-len") {
+            config.name_length = count();
+        } else if (name == "fragment") {
+            config.layout.fragment_clusters = count();
+        } else if (name == "lookups") {
+            config.lookups = count();
+        } else if (name == "rounds") {
+            config.rounds = count();
+        } else if (name == "io" && (value == "mmap" || value == "pread")) {
+            config.options.io =
+                value == "mmap" ? IOBackend::Mmap : IOBackend::Pread;
+        } else if (name == "threads") {
+            config.options.threads = count();
+        } else if (name == "dir") {
+            config.dir = value;
+        } else {
+            Usage(argv[0]);
+        }
+    }
+    if (config.rounds <= 0 || config.scales.empty())
+        Usage(argv[0]);
+    return config;
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+    Config config;
+    try {
+        config = ParseConfig(argc, argv);
+    } catch (const FATError &e) {
+        fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
+
+    printf("{\n");
+    printf("  \"benchmark\": \"fat_bench\",\n");
+    printf("  \"config\": {\"cluster_bytes\": %u, \"image_bytes\": %llu, "
+           "\"file_bytes\": %llu, \"copy_bytes\": %llu, \"fanout\": %u, "
+           "\"depth\": %u, \"name_length\": %u, \"fragment_clusters\": %u, "
+           "\"lookups\": %u, \"rounds\": %d, \"io\": \"%s\", "
+           "\"threads\": %u},\n",
+           config.layout.bytes_per_cluster,
+           static_cast<unsigned long long>(config.layout.image_bytes),
+           static_cast<unsigned long long>(config.file_bytes),
+           static_cast<unsigned long long>(config.copy_bytes), config.fanout,
+           config.depth, config.name_length,
+           config.layout.fragment_clusters, config.lookups, config.rounds,
+           config.options.io == IOBackend::Mmap ? "mmap" : "pread",
+           ThreadPool::ThreadCountFor(config.options.threads));
+    printf("  \"results\": [\n");
+    try {
+        for (size_t i = 0; i < config.scales.size(); ++i)
+            Bench(config, config.scales[i], i + 1 == config.scales.size());
+    } catch (const FATError &e) {
+        fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
+    printf("  ]\n");
+    printf("}\n");
+    return 0;
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <stdexcept>
+
+namespace cs5250 {
+
+// a command could not be carried out; the manager stays usable for the next
+// one
+class FATError : public std::runtime_error {
+  public:
+    using std::runtime_error::runtime_error;
+};
+
+} // namespace cs5250
@@ -0,0 +1,122 @@
+// Benchmark of the I/O backends: runs the same read-only workloads on an
+// image through the shared mapping, with and without madvise hints and
+// MAP_POPULATE, and through pread with the cluster cache, a fresh
+// FATManager per round. Page faults are counted alongside the times.
+#include "fat_manager.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <limits>
+#include <ostream>
+#include <string>
+#include <sys/resource.h>
+#include <unistd.h>
+
+using namespace cs5250;
+
+namespace {
+
+// minor and major page faults of the process so far
+std::pair<long, long> Faults() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return {usage.ru_minflt, usage.ru_majflt};
+}
+
+struct Result {
+    double best = std::numeric_limits<double>::max();
+    double total = 0;
+    long minor_faults = 0;
+    long major_faults = 0;
+
+    template <typename F> void Time(F &&function) {
+        auto [minor, major] = Faults();
+        auto start = std::chrono::steady_clock::now();
+        function();
+        std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - start;
+        auto [minor_after, major_after] = Faults();
+        best = std::min(best, elapsed.count());
+        total += elapsed.count();
+        minor_faults += minor_after - minor;
+        major_faults += major_after - major;
+    }
+};
+
+void Report(const char *backend, const char *workload, const Result &result,
+            int rounds) {
+    printf("%-8s %-8s %9.3f ms best %9.3f ms mean %8ld minflt %6ld majflt\n",
+           backend, workload, result.best * 1e3, result.total * 1e3 / rounds,
+           result.minor_faults / rounds, result.major_faults / rounds);
+}
+
+void Bench(const char *backend, const std::string &image, FATOptions options,
+           int rounds, const std::string &scratch) {
+    // output of the commands themselves is thrown away
+    std::ostream null(nullptr);
+    options.read_only = true;
+    Result open, walk, verify, export_all;
+    for (int round = 0; round < rounds; ++round) {
+        // opening covers reading the FAT in, or populating the mapping
+        std::unique_ptr<FATManager> mgr;
+        open.Time([&] { mgr = std::make_unique<FATManager>(image, options); });
+        walk.Time([&] { mgr->LoadAll(); });
+        mgr = std::make_unique<FATManager>(image, options);
+        verify.Time([&] { mgr->Verify(null); });
+        mgr = std::make_unique<FATManager>(image, options);
+        export_all.Time([&] { mgr->CopyDirTo("/", scratch, null); });
+        mgr.reset();
+        std::filesystem::remove_all(scratch);
+    }
+    Report(backend, "open", open, rounds);
+    Report(backend, "walk", walk, rounds);
+    Report(backend, "verify", verify, rounds);
+    Report(backend, "export", export_all, rounds);
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s image [rounds] [cache bytes] [threads]\n",
+                argv[0]);
+        return 1;
+    }
+    std::string image = argv[1];
+    int rounds = argc > 2 ? atoi(argv[2]) : 5;
+    FATOptions options;
+    if (argc > 3)
+        options.cache_bytes = strtoull(argv[3], nullptr, 10);
+    if (argc > 4)
+        options.threads = atoi(argv[4]);
+    if (rounds <= 0) {
+        fprintf(stderr, "rounds must be positive\n");
+        return 1;
+    }
+
+    auto scratch = (std::filesystem::temp_directory_path() /
+                    ("fat_io_bench." + std::to_string(getpid())))
+                       .string();
+    printf("%s, %d rounds, %llu byte cache, %u threads\n", image.c_str(),
+           rounds, static_cast<unsigned long long>(options.cache_bytes),
+           ThreadPool::ThreadCountFor(options.threads));
+
+    try {
+        options.io = IOBackend::Mmap;
+        options.advise = false;
+        Bench("plain", image, options, rounds, scratch);
+        options.advise = true;
+        Bench("mmap", image, options, rounds, scratch);
+        options.populate = true;
+        Bench("populate", image, options, rounds, scratch);
+        options.populate = false;
+        options.io = IOBackend::Pread;
+        Bench("pread", image, options, rounds, scratch);
+    } catch (const FATError &e) {
+        fprintf(stderr, "%s\n", e.what());
+        std::filesystem::remove_all(scratch);
+        return 1;
+    }
+    return 0;
+}
@@ -1,9 +1,16 @@
 #include "fat_manager.h"
+#include "path_tokenizer.h"
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
 #include <cstring>
 #include <deque>
-#include <fstream>
+#include <filesystem>
 #include <functional>
+#include <iomanip>
 #include <iostream>
+#include <mutex>
 #include <optional>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -13,17 +20,6 @@
 
 namespace cs5250 {
 
-template <typename T> bool IsOneOfVector(T &input, const std::vector<T> &args) {
-    for (auto arg : args) {
-
-        if (reinterpret_cast<uint64_t>(input) ==
-            reinterpret_cast<uint64_t>(arg)) {
-            return true;
-        }
-    }
-    return false;
-}
-
 std::pair<std::string, bool>
 NameOfLongNameEntry(const LongNameDirectory &entry) {
     std::string ret = "";
@@ -45,6 +41,25 @@ NameOfLongNameEntry(const LongNameDirectory &entry) {
     return {ret, false};
 }
 
+// the first error reported by any worker of a tree walk or recursive copy
+class FirstError {
+  private:
+    std::mutex mutex_;
+    std::optional<std::string> message_;
+
+  public:
+    void Set(const std::string &message) {
+        std::lock_guard lock(mutex_);
+        if (!message_)
+            message_ = message;
+    }
+
+    void ThrowIfSet() {
+        if (message_)
+            throw FATError(*message_);
+    }
+};
+
 static std::string ShortNameOf(const char name[11]) {
     std::string ret = "";
     for (auto i = 0; i < 8; ++i) {
@@ -65,7 +80,7 @@ static std::string ShortNameOf(const char name[11]) {
     return ret;
 }
 
-void FATManager::Ck() { std::cout << Info() << std::endl; }
+void FATManager::Ck(std::ostream &out) { out << Info() << std::endl; }
 
 void FATManager::InitBPB(const BPB &bpb) {
     auto root_dir_sector_count =
@@ -112,341 +127,628 @@ void FATManager::InitBPB(const BPB &bpb) {
     reserved_sector_count_ = bpb.BPB_RsvdSecCnt;
     fat_sector_count_ = bpb.BPB_NumFATs * fat_size;
     this->root_dir_sector_count_ = root_dir_sector_count;
-    this->root_dir_ = SimpleStruct{"", this->root_cluster_number_, true, 0};
+    this->tree_.Reset(this->root_cluster_number_);
     this->data_sector_count_ = data_sector_count;
     this->number_of_fats_ = bpb.BPB_NumFATs;
 
-    if (fat_type_ != FATType::FAT32) {
-        return;
+    // everything up to the first data cluster stays in memory, the clusters
+    // are read as needed
+    image_ = device_->Load(OffsetOfCluster(2),
+                           uint64_t(bytes_per_sector_) * sectors_per_cluster_);
+    if (image_ == nullptr) {
+        perror("read");
+        exit(1);
     }
 
     // use all the FATs
-    std::vector<uint32_t *> fat_start_addresses;
+    std::vector<uint8_t *> fat_start_addresses;
     for (auto i = 0; i < bpb.BPB_NumFATs; ++i) {
-        fat_start_addresses.push_back(reinterpret_cast<uint32_t *>(
-            reinterpret_cast<uint64_t>(image_) +
-            (bpb.BPB_RsvdSecCnt * bytes_per_sector_) +
-            (i * fat_size * bytes_per_sector_)));
-    }
-    this->fat_map_ = std::make_unique<FATMap>(this->number_of_fats_,
-                                              this->sector_count_per_fat_ *
-                                                  bytes_per_sector_ / 4,
-                                              std::move(fat_start_addresses));
-
-    auto files_under_dir =
-        [this](const SimpleStruct &file,
-               const SimpleStruct &parent) -> std::vector<SimpleStruct> {
-        std::vector<SimpleStruct> ret;
-        auto seen_long_name = false;
-        std::string long_name = "";
-        std::vector<const LongNameDirectory *> long_name_dirs;
-
-        auto sector_function = [this, &ret, &seen_long_name, &long_name, &file,
-                                &parent,
-                                &long_name_dirs](auto sector_data_address) {
-            auto entry_parser = [this, &ret, &seen_long_name, &long_name, &file,
-                                 &parent,
-                                 &long_name_dirs](const FATDirectory *dir) {
-                if (dir->DIR_Attr == ToIntegral(FATDirectory::Attr::LongName)) {
-                    if (!seen_long_name) {
-                        seen_long_name = true;
-                        long_name = "";
-                    }
-                    const LongNameDirectory *long_dir =
-                        reinterpret_cast<const LongNameDirectory *>(dir);
-
-                    auto [name, end] = NameOfLongNameEntry(*long_dir);
-                    long_name = name + long_name;
-                    long_name_dirs.push_back(long_dir);
-                } else {
-                    std::string name;
-                    std::vector<const LongNameDirectory *> this_long_name_dirs;
-                    if (!seen_long_name) {
-                        name = ShortNameOf(
-                            reinterpret_cast<const char *>(dir->DIR_Name.name));
-                    } else {
-                        name = std::move(long_name);
-                        seen_long_name = false;
-                        this_long_name_dirs = std::move(long_name_dirs);
-                    }
-                    bool is_dir = false;
-
-                    if (dir->DIR_Attr ==
-                        ToIntegral(FATDirectory::Attr::Directory)) {
-                        is_dir = true;
-                    } else {
-                        is_dir = false;
-                    }
-                    uint32_t cluster =
-                        dir->DIR_FstClusLO | (dir->DIR_FstClusHI << 16);
-                    if (cluster == file.first_cluster ||
-                        cluster == parent.first_cluster || cluster == 0) {
-                    } else {
-                        if (this_long_name_dirs.size() > 0)
-                            ret.push_back({name, cluster, is_dir,
-                                           dir->DIR_FileSize,
-                                           std::move(this_long_name_dirs)});
-                        else
-                            ret.push_back(
-                                {name, cluster, is_dir, dir->DIR_FileSize});
-                    }
-                }
-            };
-            ForEveryDirEntryInDirSector(sector_data_address, entry_parser);
-        };
-
-        ForEverySectorOfFile(file, sector_function);
-        return ret;
-    };
-
-    std::deque<std::pair<SimpleStruct, SimpleStruct>> q;
-    q.push_back({root_dir_, root_dir_});
+        fat_start_addresses.push_back(
+            image_ + (bpb.BPB_RsvdSecCnt * bytes_per_sector_) +
+            (uint64_t(i) * fat_size * bytes_per_sector_));
+    }
+    // FAT32 can turn mirroring off and keep all its entries in one active
+    // FAT, numbered in the low bits of BPB_ExtFlags
+    auto mirrored = true;
+    unsigned primary = 0;
+    if (fat_type_ == FATType::FAT32 && (bpb.fat32.BPB_ExtFlags & 0x80)) {
+        mirrored = false;
+        primary = bpb.fat32.BPB_ExtFlags & 0x0F;
+        if (primary >= bpb.BPB_NumFATs)
+            primary = 0;
+    }
+    // the entry width is settled here once, rather than per entry
+    uint64_t fat_bytes = uint64_t(sector_count_per_fat_) * bytes_per_sector_;
+    auto cluster_end = this->count_of_clusters_ + 2;
+    switch (fat_type_) {
+    case FATType::FAT12:
+        this->fat_map_ = std::make_unique<FATMapOf<FAT12Format>>(
+            std::move(fat_start_addresses), fat_bytes, cluster_end, mirrored,
+            primary);
+        break;
+    case FATType::FAT16:
+        this->fat_map_ = std::make_unique<FATMapOf<FAT16Format>>(
+            std::move(fat_start_addresses), fat_bytes, cluster_end, mirrored,
+            primary);
+        break;
+    case FATType::FAT32:
+        this->fat_map_ = std::make_unique<FATMapOf<FAT32Format>>(
+            std::move(fat_start_addresses), fat_bytes, cluster_end, mirrored,
+            primary);
+        break;
+    }
+    if (stats_.Enabled())
+        fat_map_->SetStats(&stats_);
 
-    while (!q.empty()) {
-        auto cur = q.front();
-        q.pop_front();
+    // every command looks entries up all over the FAT in use
+    device_->Advise(fat_map_->Primary() - image_, fat_bytes, Advice::WillNeed);
+    device_->Advise(fat_map_->Primary() - image_, fat_bytes,
+                    Advice::HugePages);
 
-        if (cur.first.is_dir) {
-            auto sub_lists = files_under_dir(cur.first, cur.second);
-            for (auto &list : sub_lists) {
-                q.push_back({list, cur.first});
-            }
-            dir_map_[cur.first] = std::move(sub_lists);
-        }
+    if (fat_type_ != FATType::FAT32) {
+        this->fs_info_manager_ =
+            std::make_unique<FSInfoManager>(this->fat_map_->FreeCount());
+        return;
     }
 
     auto fs_info_sector_number = bpb.fat32.BPB_FSInfo;
+    this->fs_info_sector_ =
+        this->image_ + fs_info_sector_number * bytes_per_sector_;
     this->fs_info_manager_ =
-        std::make_unique<FSInfoManager>(reinterpret_cast<uint8_t *>(
-            this->image_ + fs_info_sector_number * bytes_per_sector_));
+        std::make_unique<FSInfoManager>(this->fs_info_sector_);
 }
 
-void FATManager::Ls() {
-
-    ASSERT(fat_type_ == FATType::FAT32);
+std::vector<SimpleStruct> FATManager::ReadDirEntries(uint32_t first_cluster) {
+    auto timer = stats_.Time(Phase::TreeScan);
+    stats_.Add(Counter::DirsParsed);
+    std::vector<SimpleStruct> ret;
+    auto seen_long_name = false;
+    std::string long_name = "";
+    // where the span being parsed sits in the image
+    uint64_t span_offset = 0;
+    const uint8_t *span_data = nullptr;
+
+    auto entry_parser = [this, &ret, &seen_long_name, &long_name, &span_offset,
+                         &span_data, first_cluster](const FATDirectory *entry) {
+        stats_.Add(Counter::EntriesParsed);
+        if (entry->DIR_Attr == ToIntegral(FATDirectory::Attr::LongName)) {
+            if (!seen_long_name) {
+                seen_long_name = true;
+                long_name = "";
+            }
+            const LongNameDirectory *long_dir =
+                reinterpret_cast<const LongNameDirectory *>(entry);
 
-    // recursively print the map
-    std::function<void(const SimpleStruct &, std::string prefix)> print_map =
-        [&](const SimpleStruct &cur, std::string prefix) {
-            if (dir_map_.find(cur) != dir_map_.end())
-                for (auto &sub : dir_map_[cur])
-                    print_map(sub, prefix + cur.name + "/");
-            else
-                std::cout << prefix << cur.name << std::endl;
-        };
+            auto [name, end] = NameOfLongNameEntry(*long_dir);
+            long_name = name + long_name;
+        } else {
+            auto short_name =
+                ShortNameOf(reinterpret_cast<const char *>(entry->DIR_Name.name));
+            std::string name;
+            if (!seen_long_name) {
+                name = short_name;
+            } else {
+                name = std::move(long_name);
+                seen_long_name = false;
+            }
+            bool is_dir = entry->DIR_Attr ==
+                          ToIntegral(FATDirectory::Attr::Directory);
+
+            uint32_t cluster =
+                entry->DIR_FstClusLO | (entry->DIR_FstClusHI << 16);
+            // "." and ".." are recognized by name, since the parent of a
+            // lazily loaded directory is not known here; a file without a
+            // cluster is empty, but a directory always has one
+            bool is_label =
+                entry->DIR_Attr & ToIntegral(FATDirectory::Attr::VolumeID);
+            if (IsDotEntry(entry) || is_label || cluster == first_cluster ||
+                (is_dir && cluster == 0)) {
+            } else {
+                ret.push_back({name, cluster, is_dir, entry->DIR_FileSize,
+                               std::move(short_name), entry->DIR_Attr,
+                               span_offset +
+                                   (reinterpret_cast<const uint8_t *>(entry) -
+                                    span_data)});
+            }
+        }
+    };
 
-    print_map(root_dir_, "");
+    ForEverySpanOfFile(first_cluster, [&](uint32_t, uint64_t offset,
+                                          const uint8_t *data,
+                                          uint64_t bytes) {
+        span_offset = offset;
+        span_data = data;
+        return ForEveryDirEntryInSpan(data, bytes, entry_parser);
+    });
+    return ret;
 }
 
-OptionalRef<SimpleStruct> FATManager::FindFile(const std::string &path) {
-    std::vector<cs5250::SimpleStruct> *current_dir = &dir_map_[root_dir_];
+void FATManager::LoadDir(NodeId dir) {
+    ASSERT(tree_.IsDir(dir));
+    if (tree_.IsLoaded(dir))
+        return;
 
-    // split the path by '/'
-    std::vector<std::string> path_list;
-    std::string cur = "";
-    for (auto c : path) {
-        if (c == '/') {
-            if (cur != "") {
-                path_list.push_back(cur);
-                cur = "";
-            }
-        } else {
-            cur = cur + c;
+    EnsureIndex();
+    if (index_state_ == IndexState::Valid) {
+        if (auto node = index_dir_nodes_.find(tree_.FirstCluster(dir));
+            node != index_dir_nodes_.end() &&
+            IndexNodeIsCurrent(node->second)) {
+            tree_.SetChildren(dir, ListingFromIndex(node->second));
+            return;
         }
     }
-    if (cur != "") {
-        path_list.push_back(cur);
+    tree_.SetChildren(dir, ReadDirEntries(tree_.FirstCluster(dir)));
+}
+
+void FATManager::PrefetchDir(uint32_t first_cluster) {
+    // directories listed in the index are read all the same, to be hashed
+    if (IsFixedRoot(first_cluster))
+        return;
+    uint64_t bytes_per_cluster =
+        uint64_t(bytes_per_sector_) * sectors_per_cluster_;
+    // only a hint: a corrupt chain is reported when the directory is read
+    std::vector<Extent> extents;
+    try {
+        extents = ExtentsOfFile(first_cluster);
+    } catch (const FATError &) {
+        return;
     }
+    for (auto &extent : extents)
+        device_->Advise(OffsetOfCluster(extent.first_cluster),
+                        extent.cluster_count * bytes_per_cluster,
+                        Advice::WillNeed);
+}
 
-    auto find_dir = [&](std::string name) -> OptionalRef<SimpleStruct> {
-        for (auto &dir : *current_dir) {
-            if (dir.name == name && dir.is_dir) {
-                return dir;
+void FATManager::LoadTree(NodeId root) {
+    // the subdirectories of each directory are read ahead as soon as they
+    // are known, so the walk seldom waits on the disk
+    EnsureIndex();
+    if (!tree_.IsLoaded(root))
+        PrefetchDir(tree_.FirstCluster(root));
+
+    auto thread_count = ThreadPool::ThreadCountFor(options_.threads);
+    if (thread_count <= 1) {
+        std::function<void(NodeId)> load = [&](NodeId dir) {
+            LoadDir(dir);
+            tree_.ForEachChild(dir, [&](NodeId sub) {
+                if (tree_.IsDir(sub) && !tree_.IsLoaded(sub))
+                    PrefetchDir(tree_.FirstCluster(sub));
+            });
+            tree_.ForEachChild(dir, [&](NodeId sub) {
+                if (tree_.IsDir(sub))
+                    load(sub);
+            });
+        };
+        load(root);
+        tree_complete_ = tree_complete_ || root == DirTree::kRoot;
+        return;
+    }
+
+    ThreadPool pool(thread_count);
+    std::mutex tree_mutex;
+    // a corrupt chain ends the walk of its directory, and the load
+    FirstError error;
+
+    // every directory's cluster chain is parsed by its own task; only the
+    // tree itself is touched under the lock
+    std::function<void(NodeId, uint32_t)> load = [&](NodeId dir,
+                                                     uint32_t cluster) {
+        std::vector<std::pair<NodeId, uint32_t>> subdirs;
+        auto collect_subdirs = [&] {
+            tree_.ForEachChild(dir, [&](NodeId sub) {
+                if (tree_.IsDir(sub))
+                    subdirs.push_back({sub, tree_.FirstCluster(sub)});
+            });
+        };
+
+        bool loaded = false;
+        std::optional<uint32_t> index_node;
+        {
+            std::lock_guard<std::mutex> lock(tree_mutex);
+            if (tree_.IsLoaded(dir)) {
+                collect_subdirs();
+                loaded = true;
+            } else if (index_state_ == IndexState::Valid) {
+                if (auto node = index_dir_nodes_.find(cluster);
+                    node != index_dir_nodes_.end())
+                    index_node = node->second;
             }
         }
-        return std::nullopt;
-    };
-
-    auto find_file = [&](std::string name) -> OptionalRef<SimpleStruct> {
-        for (auto &dir : *current_dir) {
-            if (dir.name == name && !dir.is_dir) {
-                return dir;
+        if (!loaded) {
+            // the hash is checked outside the lock, like a parse
+            std::vector<SimpleStruct> entries;
+            bool from_index = false;
+            try {
+                from_index = index_node && IndexNodeIsCurrent(*index_node);
+                if (!from_index)
+                    entries = ReadDirEntries(cluster);
+            } catch (const FATError &e) {
+                error.Set(e.what());
+                return;
             }
+            std::lock_guard<std::mutex> lock(tree_mutex);
+            tree_.SetChildren(dir, from_index ? ListingFromIndex(*index_node)
+                                              : std::move(entries));
+            collect_subdirs();
+        }
+        for (auto [sub, sub_cluster] : subdirs) {
+            PrefetchDir(sub_cluster);
+            pool.Submit([&load, sub, sub_cluster] { load(sub, sub_cluster); });
         }
-        return std::nullopt;
     };
 
-    for (auto &p : path_list) {
-        if (p == path_list.back()) {
-            auto file = find_file(p);
-            if (file) {
-                return file;
-            } else {
-                return std::nullopt;
-            }
-        } else {
-            auto dir = find_dir(p);
-            if (dir) {
-                current_dir = &dir_map_[*dir];
-            } else {
-                return std::nullopt;
-            }
+    auto root_cluster = tree_.FirstCluster(root);
+    pool.Submit([&load, root, root_cluster] { load(root, root_cluster); });
+    pool.Wait();
+    error.ThrowIfSet();
+    tree_complete_ = tree_complete_ || root == DirTree::kRoot;
+}
+
+void FATManager::EnsureIndex() {
+    if (index_state_ != IndexState::Unchecked)
+        return;
+
+    index_ = DirIndex::Open(options_.index_path);
+    if (index_ && IndexMatchesImage(*index_)) {
+        index_state_ = IndexState::Valid;
+        index_dir_nodes_[root_cluster_number_] = 0;
+    } else {
+        index_.reset();
+        index_state_ = IndexState::Stale;
+    }
+}
+
+DirIndexHeader FATManager::IndexHeaderOfImage() {
+    auto bpb = reinterpret_cast<const BPB *>(image_);
+
+    DirIndexHeader header{};
+    memcpy(header.vol_id,
+           fat_type_ == FATType::FAT32 ? bpb->fat32.BS_VolID
+                                       : bpb->fat16.BS_VolID,
+           sizeof(header.vol_id));
+    header.bytes_per_sector = bytes_per_sector_;
+    header.sectors_per_cluster = sectors_per_cluster_;
+    header.number_of_fats = number_of_fats_;
+    header.reserved_sector_count = reserved_sector_count_;
+    header.sector_count_per_fat = sector_count_per_fat_;
+    header.root_cluster = root_cluster_number_;
+    header.image_size = image_size_;
+    return header;
+}
+
+uint64_t FATManager::HashDirClusters(uint32_t first_cluster) {
+    // a cluster at a time, so that the hash does not depend on how the
+    // device cuts the chain into spans; the numbers of the clusters go in
+    // too, since the entries' offsets in the image follow from them
+    uint64_t bytes_per_cluster =
+        uint64_t(bytes_per_sector_) * sectors_per_cluster_;
+    uint64_t seed = 0;
+    ForEverySpanOfFile(first_cluster, [&](uint32_t cluster, uint64_t,
+                                          const uint8_t *data, uint64_t bytes) {
+        for (uint64_t done = 0; done < bytes;
+             done += bytes_per_cluster, ++cluster) {
+            seed = HashBytes(reinterpret_cast<const uint8_t *>(&cluster),
+                             sizeof(cluster), seed);
+            seed = HashBytes(data + done,
+                             std::min(bytes_per_cluster, bytes - done), seed);
         }
+    });
+    return seed;
+}
+
+bool FATManager::IndexMatchesImage(const DirIndex &index) {
+    auto expected = IndexHeaderOfImage();
+    auto &header = index.Header();
+
+    // everything after the magic and counts must be identical; whether
+    // each directory is still the same is checked on its first use
+    auto begin = offsetof(DirIndexHeader, vol_id);
+    auto end = sizeof(DirIndexHeader);
+    return memcmp(reinterpret_cast<const uint8_t *>(&header) + begin,
+                  reinterpret_cast<const uint8_t *>(&expected) + begin,
+                  end - begin) == 0;
+}
+
+bool FATManager::IndexNodeIsCurrent(uint32_t node_id) {
+    auto &node = index_->Node(node_id);
+    // only the root can sit outside the data region
+    bool current = (node_id == 0 || (node.first_cluster >= 2 &&
+                                     node.first_cluster <=
+                                         MaximumValidClusterNumber())) &&
+                   HashDirClusters(node.first_cluster) == node.dir_hash;
+    if (!current)
+        index_outdated_ = true;
+    return current;
+}
+
+std::vector<SimpleStruct> FATManager::ListingFromIndex(uint32_t node_id) {
+    auto &node = index_->Node(node_id);
+
+    std::vector<SimpleStruct> ret;
+    ret.reserve(node.child_count);
+    for (auto id = node.first_child; id < node.first_child + node.child_count;
+         ++id) {
+        auto &child = index_->Node(id);
+        ret.push_back({std::string(index_->NameOf(child)), child.first_cluster,
+                       child.IsDir(), child.size,
+                       std::string(index_->ShortNameOf(child)), child.attr,
+                       child.dirent_offset});
+        if (child.IsDir())
+            index_dir_nodes_[child.first_cluster] = id;
     }
+    return ret;
+}
 
-    return std::nullopt;
+void FATManager::MarkTreeModified() {
+    EnsureIndex();
+    if (index_state_ != IndexState::Disabled && !tree_modified_)
+        unlink(options_.index_path.c_str());
+    tree_modified_ = true;
 }
 
-OptionalRef<SimpleStruct> FATManager::FindParentDir(const std::string &path) {
+void FATManager::SaveIndex() {
+    auto header = IndexHeaderOfImage();
+    std::vector<DirIndexNode> nodes;
+    std::string names;
 
-    auto current_dir = &root_dir_;
+    nodes.push_back({root_cluster_number_, 0, 0, 0, 0, 0, 0,
+                     ToIntegral(FATDirectory::Attr::Directory), kNoDirent, 0});
 
-    // split the path by '/'
-    std::vector<std::string> path_list;
-    std::string cur = "";
-    for (auto c : path) {
-        if (c == '/') {
-            if (cur != "") {
-                path_list.push_back(cur);
-                cur = "";
-            }
-        } else {
-            cur = cur + c;
-        }
+    // breadth first, so that the children of a directory are contiguous
+    std::deque<std::pair<uint32_t, NodeId>> q;
+    q.push_back({0, DirTree::kRoot});
+
+    while (!q.empty()) {
+        auto [id, dir] = q.front();
+        q.pop_front();
+
+        nodes[id].dir_hash = HashDirClusters(tree_.FirstCluster(dir));
+        nodes[id].first_child = nodes.size();
+        tree_.ForEachChild(dir, [&](NodeId child) {
+            if (tree_.IsDir(child))
+                q.push_back({static_cast<uint32_t>(nodes.size()), child});
+            auto name = tree_.Name(child);
+            auto short_name = tree_.ShortName(child);
+            if (short_name.empty())
+                short_name = name;
+            nodes.push_back({tree_.FirstCluster(child), tree_.Size(child), 0, 0,
+                             static_cast<uint32_t>(names.size()),
+                             static_cast<uint16_t>(name.size()),
+                             static_cast<uint8_t>(short_name.size()),
+                             tree_.Attr(child), tree_.DirentOffset(child), 0});
+            names += name;
+            names += short_name;
+        });
+        nodes[id].child_count = nodes.size() - nodes[id].first_child;
+    }
+
+    if (!DirIndex::Write(options_.index_path, header, nodes, names))
+        std::cerr << "failed to write index " << options_.index_path
+                  << std::endl;
+}
+
+void FATManager::Ls(std::ostream &out) {
+    EnsureIndex();
+    // the whole tree is listed, so every directory of the index is checked
+    auto index_current = [this] {
+        for (uint32_t i = 0; i < index_->NodeCount(); ++i)
+            if (index_->Node(i).IsDir() && !IndexNodeIsCurrent(i))
+                return false;
+        return true;
+    };
+    if (index_state_ == IndexState::Valid && !tree_modified_ &&
+        index_current()) {
+        // walk the mapped index without building any listing
+        std::function<void(uint32_t, const std::string &)> print_index =
+            [&](uint32_t id, const std::string &prefix) {
+                auto &node = index_->Node(id);
+                for (auto child = node.first_child;
+                     child < node.first_child + node.child_count; ++child) {
+                    auto &sub = index_->Node(child);
+                    auto name = index_->NameOf(sub);
+                    if (sub.IsDir())
+                        print_index(child, prefix + std::string(name) + "/");
+                    else
+                        out << prefix << name << std::endl;
+                }
+            };
+        print_index(0, "/");
+        return;
     }
-    if (cur != "") {
-        path_list.push_back(cur);
+
+    LoadTree(DirTree::kRoot);
+
+    // recursively print the tree in directory order
+    std::function<void(NodeId, const std::string &)> print_tree =
+        [&](NodeId dir, const std::string &prefix) {
+            tree_.ForEachChild(dir, [&](NodeId sub) {
+                if (tree_.IsDir(sub))
+                    print_tree(sub, prefix + std::string(tree_.Name(sub)) + "/");
+                else
+                    out << prefix << tree_.Name(sub) << std::endl;
+            });
+        };
+
+    print_tree(DirTree::kRoot, "/");
+}
+
+void FATManager::Mem(std::ostream &out) {
+    LoadTree(DirTree::kRoot);
+
+    auto entries = tree_.NodeCount();
+    auto bytes = tree_.MemoryUsage();
+    out << "Entries = " << entries << std::endl;
+    out << "TreeBytes = " << bytes << std::endl;
+    out << "BytesPerEntry = " << (entries ? bytes / entries : 0)
+              << std::endl;
+}
+
+void FATManager::Stat(const std::string &path, std::ostream &out) {
+    NodeId node = DirTree::kRoot;
+    if (!PathTokenizer(path).AtEnd()) {
+        auto dirs = FindFileWithDirs(path);
+        if (!dirs)
+            throw FATError("file " + path + " not found");
+        node = dirs->back();
     }
 
-    auto find_dir = [&](std::string name) -> OptionalRef<SimpleStruct> {
-        for (auto &dir : dir_map_[*current_dir]) {
-            // std::cout << dir.name << std::endl;
-            if (dir.name == name && dir.is_dir) {
-                return dir;
-            }
+    uint32_t clusters = 0, extents = 0;
+    if (tree_.FirstCluster(node) != 0)
+        for (auto &extent : ExtentsOfFile(tree_.FirstCluster(node))) {
+            clusters += extent.cluster_count;
+            ++extents;
         }
-        return std::nullopt;
-    };
+    out << "Name = " << (node == DirTree::kRoot ? "/" : tree_.Name(node))
+        << std::endl;
+    out << "Type = " << (tree_.IsDir(node) ? "directory" : "file")
+        << std::endl;
+    out << "Size = " << tree_.Size(node) << std::endl;
+    out << "FirstCluster = " << tree_.FirstCluster(node) << std::endl;
+    out << "Clusters = " << clusters << std::endl;
+    out << "Extents = " << extents << std::endl;
+}
 
-    for (auto &p : path_list) {
-        if (p == path_list.back()) {
-            return *current_dir;
-        } else {
-            auto dir = find_dir(p);
-            if (dir) {
-                current_dir = &(dir->get());
-            } else {
-                return std::nullopt;
-            }
+std::optional<NodeId> FATManager::FindFile(const std::string &path) {
+    NodeId current_dir = DirTree::kRoot;
+
+    PathTokenizer tokens(path);
+    for (std::string_view name; tokens.Next(name);) {
+        LoadDir(current_dir);
+        auto entry = tree_.Find(current_dir, name);
+        if (tokens.AtEnd()) {
+            if (entry != kNoNode && !tree_.IsDir(entry))
+                return entry;
+            return std::nullopt;
         }
+        if (entry == kNoNode || !tree_.IsDir(entry))
+            return std::nullopt;
+        current_dir = entry;
     }
 
     return std::nullopt;
 }
 
-std::optional<std::vector<std::reference_wrapper<SimpleStruct>>>
-FATManager::FindFileWithDirs(const std::string &path) {
-    auto current_dir = &dir_map_[root_dir_];
-
-    // split the path by '/'
-    std::vector<std::string> path_list;
-    std::string cur = "";
-    for (auto c : path) {
-        if (c == '/') {
-            if (cur != "") {
-                path_list.push_back(cur);
-                cur = "";
-            }
-        } else {
-            cur = cur + c;
-        }
-    }
-    if (cur != "") {
-        path_list.push_back(cur);
+std::optional<NodeId> FATManager::FindParentDir(const std::string &path) {
+    NodeId current_dir = DirTree::kRoot;
+
+    PathTokenizer tokens(path);
+    for (std::string_view name; tokens.Next(name);) {
+        LoadDir(current_dir);
+        if (tokens.AtEnd())
+            return current_dir;
+        auto entry = tree_.Find(current_dir, name);
+        if (entry == kNoNode || !tree_.IsDir(entry))
+            return std::nullopt;
+        current_dir = entry;
     }
 
-    auto find = [&](std::string name) -> OptionalRef<SimpleStruct> {
-        for (auto &dir : *current_dir) {
-            if (dir.name == name) {
-                return dir;
-            }
-        }
-        return std::nullopt;
-    };
+    return std::nullopt;
+}
 
-    std::vector<std::reference_wrapper<SimpleStruct>> ret;
-    for (auto &p : path_list) {
-        if (auto file = find(p); file) {
-            ret.push_back(*file);
-            if (p == path_list.back()) {
-                return ret;
-            } else if (file->get().is_dir) {
-                current_dir = &(dir_map_[*file]);
-            } else {
-                return std::nullopt;
-            }
-        } else {
+std::optional<std::vector<NodeId>>
+FATManager::FindFileWithDirs(const std::string &path) {
+    NodeId current_dir = DirTree::kRoot;
+
+    std::vector<NodeId> ret;
+    PathTokenizer tokens(path);
+    for (std::string_view name; tokens.Next(name);) {
+        LoadDir(current_dir);
+        auto entry = tree_.Find(current_dir, name);
+        if (entry == kNoNode)
             return std::nullopt;
-        }
+        ret.push_back(entry);
+        if (tokens.AtEnd())
+            return ret;
+        if (!tree_.IsDir(entry))
+            return std::nullopt;
+        current_dir = entry;
     }
     return std::nullopt;
 }
 
+bool FATManager::ExportFile(IOEngine &engine, NodeId file,
+                            const std::string &dest, IOEngine::Done done) {
+    // one copy per extent, the last one cut at the file size
+    std::vector<std::pair<uint64_t, uint64_t>> copies;
+    uint64_t left_size = tree_.Size(file);
+    uint64_t bytes_per_cluster =
+        uint64_t(bytes_per_sector_) * sectors_per_cluster_;
+    if (left_size != 0)
+        for (auto &extent : ExtentsOfFile(tree_.FirstCluster(file))) {
+            auto copy_size = std::min<uint64_t>(
+                left_size, extent.cluster_count * bytes_per_cluster);
+            copies.push_back({OffsetOfCluster(extent.first_cluster),
+                              copy_size});
+            left_size -= copy_size;
+            if (left_size == 0)
+                break;
+        }
+
+    // open a file for creating or writing, once its chain is known to be
+    // sound
+    auto dest_fd = open(dest.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (dest_fd == -1)
+        return false;
+
+    // the file is closed once its last copy is done
+    auto joined = IOEngine::Join(
+        copies.size(),
+        [this, dest_fd, bytes = tree_.Size(file), start = stats_.Start(),
+         done = std::move(done)](bool ok) {
+            ok = close(dest_fd) != -1 && ok;
+            if (ok)
+                stats_.Add(Counter::BytesCopied, bytes);
+            stats_.Finish(Phase::Copy, start);
+            done(ok);
+        });
+    uint64_t written = 0;
+    for (auto [offset, bytes] : copies) {
+        if (bytes >= kSequentialBytes)
+            device_->Advise(offset, bytes, Advice::Sequential);
+        device_->Export(engine, offset, bytes, dest_fd, written, joined);
+        written += bytes;
+    }
+    return true;
+}
+
 void FATManager::CopyFileTo(const std::string &path, const std::string &dest) {
     auto file_op = FindFile(path);
     if (!file_op) {
-        std::cerr << "file " << path << " not found" << std::endl;
-        std::exit(1);
+        throw FATError("file " + path + " not found");
     }
 
-    // open a file for creating or writing
-    auto file_ptr = std::make_unique<std::ofstream>(dest, std::ios::binary);
-    if (!file_ptr->is_open()) {
-        std::cerr << "failed to open file " << dest << std::endl;
-        std::exit(1);
+    auto engine = IOEngine::Create(options_, image_fd_);
+    bool written = false;
+    auto queued = ExportFile(*engine, file_op.value(), dest,
+                             [&written](bool ok) { written = ok; });
+    engine->Wait();
+    if (!queued || !written) {
+        throw FATError("failed to write file " + dest);
     }
-
-    auto &&file = file_op.value().get();
-    auto left_size = file.size;
-
-    ForEverySectorOfFile(
-        file, [this, &file_ptr, &left_size](const uint8_t *data) {
-            if (left_size == 0) {
-                return;
-            }
-            // write the data to the file
-            auto copy_size = left_size < this->bytes_per_sector_
-                                 ? left_size
-                                 : this->bytes_per_sector_;
-            file_ptr->write(reinterpret_cast<const char *>(data), copy_size);
-            left_size -= copy_size;
-        });
 }
 
 void FATManager::Delete(const std::string &path) {
     auto detailed_file_option = FindFileWithDirs(path);
     if (!detailed_file_option) {
-        std::cerr << "file " << path << " not found" << std::endl;
-        std::exit(1);
+        throw FATError("file " + path + " not found");
     }
 
-    auto &detailed_file = detailed_file_option.value();
-    auto file = detailed_file.back().get();
-    auto is_dir = file.is_dir;
+    MarkTreeModified();
+    DeleteNode(detailed_file_option.value().back());
+}
+
+void FATManager::DeleteNode(NodeId file) {
+    auto is_dir = tree_.IsDir(file);
 
     if (is_dir) {
+        LoadTree(file);
         DeleteSingleDir(file);
     } else {
         DeleteSingleFile(file);
     }
 
-    auto is_under_root = detailed_file.size() == 1;
-    if (is_under_root) {
-        RemoveEntryInDir(root_dir_, file);
-    } else {
-        auto parent = detailed_file.at(detailed_file.size() - 2).get();
-        RemoveEntryInDir(parent, file);
-    }
+    RemoveEntryInDir(file);
+    tree_.Remove(file);
 }
 
 #define UNIMPLEMENTED()                                                        \
@@ -455,59 +757,93 @@ void FATManager::Delete(const std::string &path) {
         std::exit(1);                                                          \
     }
 
-void FATManager::DeleteSingleDir(const SimpleStruct &dir) {
-    auto inner_files = dir_map_[dir];
-    for (auto &file : inner_files) {
-        if (file.is_dir) {
+void FATManager::DeleteSingleDir(NodeId dir) {
+    tree_.ForEachChild(dir, [this](NodeId file) {
+        if (tree_.IsDir(file)) {
             DeleteSingleDir(file);
         } else {
             DeleteSingleFile(file);
         }
-    }
+    });
     DeleteSingleFile(dir);
 }
 
-void FATManager::DeleteSingleFile(const SimpleStruct &file) {
-    auto cluster_entries = ClustersOfFile(file);
+void FATManager::DeleteSingleFile(NodeId file) {
+    auto first_cluster = tree_.FirstCluster(file);
+    auto cluster_entries = ClustersOfFile(first_cluster);
 
     for (auto cluster : cluster_entries) {
         this->fat_map_->SetFree(cluster);
         this->IncreaseFreeClusterCount(1);
     }
+    stats_.Add(Counter::ClustersFreed, cluster_entries.size());
+    extents_.Invalidate(first_cluster);
 }
 
-void FATManager::RemoveEntryInDir(const SimpleStruct &dir,
-                                  const SimpleStruct &file) {
+void FATManager::RemoveEntryInDir(NodeId file) {
+    auto offset = tree_.DirentOffset(file);
+    ASSERT(offset != kNoDirent);
 
-    ForEverySectorOfFile(dir, [this, &file](const uint8_t *sector_address) {
-        ForEveryDirEntryInDirSector(
-            sector_address, [this, &file](const FATDirectory *entry) {
-                if (entry->DIR_Attr ==
-                    ToIntegral(FATDirectory::Attr::LongName)) {
-                    const LongNameDirectory *long_dir =
-                        reinterpret_cast<const LongNameDirectory *>(entry);
-
-                    if (file.long_name_entries &&
-                        IsOneOfVector(long_dir,
-                                      file.long_name_entries.value())) {
-
-                        ASSERT(entry->DIR_Name.name[0] != 0xE5);
-                        memset((void *)(&(entry->DIR_Name.name[0])), 0xE5, 1);
-                        ASSERT(entry->DIR_Name.name[0] == 0xE5);
-                    }
-                } else {
-                    uint32_t cluster =
-                        entry->DIR_FstClusLO | (entry->DIR_FstClusHI << 16);
-                    if (cluster == file.first_cluster) {
-                        memset((void *)(&entry->DIR_Name.name[0]), 0xE5, 1);
-                    }
-                }
-            });
-    });
+    auto mark_deleted = [this](uint64_t offset) {
+        auto pin = device_->Access(offset, 1);
+        ASSERT(*pin.Data() != 0xE5);
+        *pin.Data() = 0xE5;
+        device_->MarkDirty(Region::Dirent, offset, 1);
+    };
+    mark_deleted(offset);
+
+    // the long name entries are the run directly in front of the short
+    // entry, the first of them flagged with 0x40; the run may start in an
+    // earlier cluster of the directory
+    auto bytes_per_cluster = bytes_per_sector_ * sectors_per_cluster_;
+    auto cluster_start = [this, bytes_per_cluster](uint64_t offset) {
+        auto data_start =
+            uint64_t(FirstSectorNumberOfDataCluster(2)) * bytes_per_sector_;
+        return offset - (offset - data_start) % bytes_per_cluster;
+    };
+    std::vector<uint32_t> dir_clusters;
+    // the fixed root directory of FAT12/16 is a single run of sectors
+    auto fixed_root = IsFixedRoot(tree_.FirstCluster(tree_.Parent(file)));
+    auto root_start = uint64_t(FirstRootDirSector()) * bytes_per_sector_;
+
+    while (true) {
+        if (fixed_root) {
+            if (offset == root_start)
+                return;
+        } else if (offset == cluster_start(offset)) {
+            if (dir_clusters.empty())
+                dir_clusters =
+                    ClustersOfFile(tree_.FirstCluster(tree_.Parent(file)));
+            auto cluster = static_cast<uint32_t>(
+                (offset / bytes_per_sector_ -
+                 FirstSectorNumberOfDataCluster(2)) /
+                    sectors_per_cluster_ +
+                2);
+            auto it = std::find(dir_clusters.begin(), dir_clusters.end(),
+                                cluster);
+            if (it == dir_clusters.begin() || it == dir_clusters.end())
+                return;
+            offset = uint64_t(FirstSectorNumberOfDataCluster(*(it - 1))) *
+                         bytes_per_sector_ +
+                     bytes_per_cluster;
+        }
+        offset -= sizeof(FATDirectory);
+
+        LongNameDirectory entry;
+        memcpy(&entry, device_->Access(offset, sizeof(entry)).Data(),
+               sizeof(entry));
+        auto ord = entry.LDIR_Ord;
+        if (entry.LDIR_Attr != ToIntegral(FATDirectory::Attr::LongName) ||
+            ord == 0xE5)
+            return;
+        mark_deleted(offset);
+        if (ord & 0x40)
+            return;
+    }
 }
 
 void FATManager::CopyFileFrom(const std::string &path,
-                              const std::string &dest) {
+                              const std::string &dest, std::ostream &out) {
     auto get_file_name = [](const std::string path) -> std::string {
         auto pos = path.find_last_of('/');
         if (pos == std::string::npos) {
@@ -520,154 +856,391 @@ void FATManager::CopyFileFrom(const std::string &path,
     auto file_name = get_file_name(dest);
 
     if (file_name.size() > 255) {
-        std::cerr << "file name too long (more than 255 bytes)" << std::endl;
-        std::exit(1);
+        throw FATError("file name too long (more than 255 bytes)");
     }
 
-    auto file = FindFile(dest);
-    if (file) {
-        Delete(dest);
-    }
     // open path for reading
     auto c_file_fd = open(path.c_str(), O_RDONLY);
     if (c_file_fd == -1) {
-        std::cerr << "failed to open file " << path << std::endl;
-        std::exit(1);
+        throw FATError("failed to open file " + path);
     }
 
     // get the size of the file
     struct stat file_stat;
     if (fstat(c_file_fd, &file_stat) == -1) {
-        std::cerr << "failed to get file stat" << std::endl;
         close(c_file_fd);
-        std::exit(1);
+        throw FATError("failed to get file stat");
     }
     auto size = file_stat.st_size;
 
+    // DIR_FileSize is 32 bits wide
+    if (static_cast<uint64_t>(size) > UINT32_MAX) {
+        close(c_file_fd);
+        throw FATError("file too large (more than 4 GiB - 1 bytes)");
+    }
+
     // get the parent dir of the file
     // std::cout << "dest: " << dest << std::endl;
     auto parent_dir_op = FindParentDir(dest);
 
     if (!parent_dir_op) {
-        std::cerr << "parent dir not found" << std::endl;
         close(c_file_fd);
-        std::exit(1);
+        throw FATError("parent dir not found");
     }
 
-    auto &&parent_dir = parent_dir_op.value().get();
+    auto parent_dir = parent_dir_op.value();
+    MarkTreeModified();
+
+    // the new data is in its own clusters before an existing file is
+    // replaced, so a failed read or a full image leaves that file as it was
+    std::vector<uint32_t> clusters_claimed;
+    if (size != 0) {
+        try {
+            clusters_claimed = AllocateClusters(ClustersForBytes(size));
+        } catch (const FATError &) {
+            close(c_file_fd);
+            throw;
+        }
 
-    if (size == 0) {
-        auto empty_file = SimpleStruct{file_name, 0, false};
-        WriteFileToDir(parent_dir, empty_file, 0);
-        close(c_file_fd);
-        return;
+        auto engine = IOEngine::Create(options_, image_fd_);
+        bool read = false;
+        ReadIntoClusters(*engine, c_file_fd, clusters_claimed, size,
+                         [&read](bool ok) { read = ok; });
+        engine->Wait();
+        if (!read) {
+            // give the clusters back, nothing refers to them yet
+            FreeClusters(clusters_claimed);
+            close(c_file_fd);
+            throw FATError("failed to read file " + path);
+        }
     }
+    close(c_file_fd);
 
-    // calculate the number of clusters needed
-    uint32_t sector_count_per_cluster = sectors_per_cluster_;
-    uint32_t bytes_per_cluster = bytes_per_sector_ * sector_count_per_cluster;
-    uint32_t cluster_count_needed =
-        (size + bytes_per_cluster - 1) / bytes_per_cluster;
+    auto created_file = SimpleStruct{
+        file_name, clusters_claimed.empty() ? 0 : clusters_claimed[0], false};
+    try {
+        if (FindFile(dest))
+            Delete(dest);
+        WriteFileToDir(parent_dir, created_file, size);
+    } catch (const FATError &) {
+        FreeClusters(clusters_claimed);
+        throw;
+    }
 
-    // if the file is too large, exit
+    if (options_.verbose && size != 0)
+        out << dest << ": " << clusters_claimed.size()
+            << " clusters in " << FATMap::CountExtents(clusters_claimed)
+            << " extents" << std::endl;
+}
 
-    if (cluster_count_needed > this->fs_info_manager_->GetFreeClusterCount()) {
-        std::cerr << "file too large" << std::endl;
-        close(c_file_fd);
-        std::exit(1);
-    }
+std::vector<uint32_t> FATManager::AllocateClusters(uint32_t count) {
+    auto timer = stats_.Time(Phase::Allocate);
+    if (count > this->fs_info_manager_->GetFreeClusterCount())
+        throw FATError("file too large");
 
-    auto clusters_claimed_op = this->fat_map_->FindFree(cluster_count_needed);
+    auto hint = this->fs_info_manager_->GetNextFreeCluster();
+    auto clusters_claimed_op =
+        options_.alloc == AllocPolicy::Contiguous
+            ? this->fat_map_->FindContiguous(count, hint)
+            : this->fat_map_->FindFree(count, hint);
 
-    if (!clusters_claimed_op) {
-        std::cerr << "failed to find free clusters" << std::endl;
-        close(c_file_fd);
-        std::exit(1);
-    }
+    if (!clusters_claimed_op)
+        throw FATError("failed to find free clusters");
 
     auto &&clusters_claimed = clusters_claimed_op.value();
 
-    this->fs_info_manager_->SetFreeClusterCount(
-        this->fs_info_manager_->GetFreeClusterCount() - cluster_count_needed);
-
-    this->fs_info_manager_->SetNextFreeCluster(
-        this->fat_map_->FindFree(1).value()[0]);
+    DecreaseFreeClusterCount(count);
 
     // set the chain of clusters
     for (size_t i = 0; i < clusters_claimed.size() - 1; i++) {
         this->fat_map_->Set(clusters_claimed[i], clusters_claimed[i + 1]);
     }
-    this->fat_map_->Set(clusters_claimed[cluster_count_needed - 1], 0x0FFFFFFF);
-
-    char buffer[bytes_per_sector_];
-    auto size_read_totally = 0;
-
-    // clean the cluster allocated, all 0
-    for (decltype(cluster_count_needed) i = 0; i < cluster_count_needed; i++) {
-        auto first_sector = FirstSectorNumberOfDataCluster(clusters_claimed[i]);
-        for (decltype(sector_count_per_cluster) j = 0;
-             j < sector_count_per_cluster; j++) {
-            auto data = StartAddressOfSector(first_sector + j);
-            memset((void *)data, 0, bytes_per_sector_);
-        }
-    }
-
-    // write the file to the cluster allocated
-    for (decltype(cluster_count_needed) i = 0; i < cluster_count_needed; i++) {
-        // if not the last cluster, write the whole cluster
-        if (i != cluster_count_needed - 1) {
-            auto first_sector =
-                FirstSectorNumberOfDataCluster(clusters_claimed[i]);
-            for (decltype(sector_count_per_cluster) j = 0;
-                 j < sector_count_per_cluster; j++) {
-                auto data = StartAddressOfSector(first_sector + j);
-                auto size_read = read(c_file_fd, buffer, bytes_per_sector_);
-                if (size_read == -1) {
-                    std::cerr << "failed to read file" << std::endl;
-                    close(c_file_fd);
-                    std::exit(1);
-                }
+    this->fat_map_->Set(clusters_claimed[count - 1],
+                        this->fat_map_->EndOfChain());
+
+    UpdateNextFreeCluster(clusters_claimed.back());
+    stats_.Add(Counter::ClustersAllocated, count);
+    return std::move(clusters_claimed);
+}
 
-                ASSERT(size_read == bytes_per_sector_);
+void FATManager::FreeClusters(const std::vector<uint32_t> &clusters) {
+    for (auto cluster : clusters)
+        this->fat_map_->SetFree(cluster);
+    IncreaseFreeClusterCount(clusters.size());
+    stats_.Add(Counter::ClustersFreed, clusters.size());
+}
+
+void FATManager::ReadIntoClusters(IOEngine &engine, int fd,
+                                  const std::vector<uint32_t> &clusters,
+                                  uint64_t size, IOEngine::Done done) {
+    uint64_t bytes_per_cluster =
+        uint64_t(bytes_per_sector_) * sectors_per_cluster_;
+
+    // each run of consecutive clusters is one read, only the slack after
+    // the end of the file being cleared
+    std::vector<std::pair<size_t, size_t>> runs;
+    for (size_t i = 0; i < clusters.size();) {
+        auto run = i + 1;
+        while (run < clusters.size() && clusters[run] == clusters[run - 1] + 1)
+            ++run;
+        runs.push_back({i, run});
+        i = run;
+    }
+
+    auto joined = IOEngine::Join(
+        runs.size(), [this, size, start = stats_.Start(),
+                      done = std::move(done)](bool ok) {
+            if (ok)
+                stats_.Add(Counter::BytesCopied, size);
+            stats_.Finish(Phase::Copy, start);
+            done(ok);
+        });
+    uint64_t read = 0;
+    for (auto [first, end] : runs) {
+        auto run_size = uint64_t(end - first) * bytes_per_cluster;
+        auto span_size = std::min<uint64_t>(size - read, run_size);
+        if (run_size >= kSequentialBytes)
+            device_->Advise(OffsetOfCluster(clusters[first]), run_size,
+                            Advice::Sequential);
+        device_->Import(engine, fd, read, OffsetOfCluster(clusters[first]),
+                        span_size, run_size, joined);
+        read += span_size;
+    }
+}
+
+// totals of a recursive copy, printed once it is done
+struct CopyTotals {
+    std::atomic<uint64_t> files{0};
+    std::atomic<uint64_t> bytes{0};
+    std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+
+    void Print(std::ostream &out) const {
+        auto seconds = std::chrono::duration<double>(
+                           std::chrono::steady_clock::now() - start)
+                           .count();
+        auto megabytes = bytes / 1e6;
+        out << files << " files, " << std::fixed << std::setprecision(1)
+            << megabytes << " MB in " << std::setprecision(3) << seconds
+            << " s (" << std::setprecision(1)
+            << (seconds > 0 ? megabytes / seconds : 0) << " MB/s, "
+            << (seconds > 0 ? files / seconds : 0) << " files/s)"
+            << std::defaultfloat << std::endl;
+    }
+};
+
+void FATManager::CopyDirTo(const std::string &path, const std::string &dest,
+                           std::ostream &out) {
+    NodeId root = DirTree::kRoot;
+    if (!PathTokenizer(path).AtEnd()) {
+        auto dirs = FindFileWithDirs(path);
+        if (!dirs || !tree_.IsDir(dirs->back()))
+            throw FATError("directory " + path + " not found");
+        root = dirs->back();
+    }
+    LoadTree(root);
+
+    // create the local directories first, then hand the files to workers
+    std::vector<std::pair<NodeId, std::string>> files;
+    std::function<void(NodeId, const std::string &)> walk =
+        [&](NodeId dir, const std::string &local) {
+            if (mkdir(local.c_str(), 0755) == -1 && errno != EEXIST)
+                throw FATError("failed to create directory " + local);
+            tree_.ForEachChild(dir, [&](NodeId sub) {
+                auto sub_local = local + "/" + std::string(tree_.Name(sub));
+                if (tree_.IsDir(sub))
+                    walk(sub, sub_local);
+                else
+                    files.push_back({sub, std::move(sub_local)});
+            });
+        };
+    walk(root, dest);
 
-                size_read_totally += size_read;
-                memmove((void *)data, buffer, bytes_per_sector_);
+    // the engine keeps the chunks of many files in flight at once
+    CopyTotals totals;
+    FirstError error;
+    {
+        auto engine = IOEngine::Create(options_, image_fd_);
+        for (auto &[file, local] : files) {
+            bool queued = false;
+            try {
+                queued = ExportFile(
+                    *engine, file, local,
+                    [&, file = file, &local = local](bool ok) {
+                        if (!ok) {
+                            error.Set("failed to write file " + local);
+                            return;
+                        }
+                        ++totals.files;
+                        totals.bytes += tree_.Size(file);
+                    });
+            } catch (const FATError &e) {
+                // a corrupt chain fails its file only
+                error.Set(local + ": " + e.what());
+                continue;
             }
+            if (!queued)
+                error.Set("failed to write file " + local);
+        }
+        engine->Wait();
+    }
+    error.ThrowIfSet();
+    totals.Print(out);
+}
+
+void FATManager::CopyDirFrom(const std::string &path,
+                             const std::string &dest, std::ostream &out) {
+    namespace fs = std::filesystem;
+    std::error_code ec;
+    if (!fs::is_directory(path, ec))
+        throw FATError("directory " + path + " not found");
+
+    MarkTreeModified();
+
+    // the destination directory is created unless it exists already
+    NodeId root = DirTree::kRoot;
+    if (!PathTokenizer(dest).AtEnd()) {
+        auto dirs = FindFileWithDirs(dest);
+        if (dirs && tree_.IsDir(dirs->back())) {
+            root = dirs->back();
+        } else if (dirs) {
+            throw FATError(dest + " is not a directory");
         } else {
-            auto first_sector =
-                FirstSectorNumberOfDataCluster(clusters_claimed[i]);
-            // if the last cluster, write the remaining bytes
-            for (decltype(sector_count_per_cluster) j = 0;
-                 j < sector_count_per_cluster; j++) {
-                auto size_read = read(c_file_fd, buffer, bytes_per_sector_);
-                if (size_read == -1) {
-                    std::cerr << "failed to read file" << std::endl;
-                    close(c_file_fd);
-                    std::exit(1);
-                }
-                if (size_read == 0) {
-                    break;
-                }
-                size_read_totally += size_read;
+            auto parent = FindParentDir(dest);
+            if (!parent)
+                throw FATError("parent dir not found");
+            root = MakeDir(*parent, fs::path(dest).filename().string());
+        }
+    }
 
-                auto data = StartAddressOfSector(first_sector + j);
-                memmove((void *)data, buffer, size_read);
+    struct Job {
+        NodeId dir;
+        std::string name;
+        std::string local;
+    };
+    std::vector<Job> files;
+
+    // directories are created and replaced files removed up front, so that
+    // the workers only add entries
+    std::function<void(NodeId, const fs::path &)> walk =
+        [&](NodeId dir, const fs::path &local) {
+            LoadDir(dir);
+            for (auto &item : fs::directory_iterator(local)) {
+                auto name = item.path().filename().string();
+                if (name.size() > 255)
+                    throw FATError("file name too long (more than 255 bytes)");
+                auto is_dir = item.is_directory();
+                if (!is_dir && !item.is_regular_file())
+                    continue;
+
+                auto existing = tree_.Find(dir, name);
+                if (existing != kNoNode &&
+                    (!is_dir || !tree_.IsDir(existing))) {
+                    DeleteNode(existing);
+                    existing = kNoNode;
+                }
+                if (is_dir)
+                    walk(existing != kNoNode ? existing : MakeDir(dir, name),
+                         item.path());
+                else
+                    files.push_back({dir, name, item.path().string()});
             }
-        }
+        };
+    try {
+        walk(root, path);
+    } catch (const fs::filesystem_error &e) {
+        throw FATError(e.what());
     }
 
-    ASSERT(size_read_totally == size);
+    // clusters are allocated and entries written on this thread, in the
+    // order of the files; only the data goes through the engine, which keeps
+    // the reads of many files in flight at once
+    struct Import {
+        int fd = -1;
+        std::vector<uint32_t> clusters;
+        uint64_t size = 0;
+        // opened and given its clusters, and then read in full
+        bool queued = false;
+        bool read = false;
+    };
+    std::vector<Import> imports(files.size());
+    CopyTotals totals;
+    FirstError error;
+    {
+        auto engine = IOEngine::Create(options_, image_fd_);
+        for (size_t i = 0; i < files.size(); ++i) {
+            auto &job = files[i];
+            auto &import = imports[i];
+            auto fd = open(job.local.c_str(), O_RDONLY);
+            struct stat file_stat;
+            if (fd == -1 || fstat(fd, &file_stat) == -1) {
+                if (fd != -1)
+                    close(fd);
+                error.Set("failed to open file " + job.local);
+                continue;
+            }
+            import.size = file_stat.st_size;
+            if (import.size > UINT32_MAX) {
+                close(fd);
+                error.Set("file too large (more than 4 GiB - 1 bytes)");
+                continue;
+            }
+            if (import.size == 0) {
+                close(fd);
+                import.queued = import.read = true;
+                continue;
+            }
 
-    auto created_file = SimpleStruct{file_name, clusters_claimed[0], false};
-    WriteFileToDir(parent_dir, created_file, size);
+            try {
+                import.clusters =
+                    AllocateClusters(ClustersForBytes(import.size));
+            } catch (const FATError &e) {
+                close(fd);
+                error.Set(e.what());
+                continue;
+            }
+            import.fd = fd;
+            import.queued = true;
+            ReadIntoClusters(*engine, fd, import.clusters, import.size,
+                             [&import](bool ok) {
+                                 import.read = ok;
+                                 close(import.fd);
+                             });
+        }
+        engine->Wait();
+    }
 
-    // close the file
-    close(c_file_fd);
+    for (size_t i = 0; i < files.size(); ++i) {
+        auto &job = files[i];
+        auto &import = imports[i];
+        if (!import.queued)
+            continue;
+        if (!import.read) {
+            FreeClusters(import.clusters);
+            error.Set("failed to read file " + job.local);
+            continue;
+        }
+        try {
+            WriteFileToDir(
+                job.dir,
+                SimpleStruct{job.name,
+                             import.clusters.empty() ? 0 : import.clusters[0],
+                             false},
+                import.size);
+        } catch (const FATError &e) {
+            FreeClusters(import.clusters);
+            error.Set(e.what());
+            continue;
+        }
+        ++totals.files;
+        totals.bytes += import.size;
+    }
+    error.ThrowIfSet();
+    totals.Print(out);
 }
 
-inline void FATManager::WriteFileToDir(const SimpleStruct &dir,
-                                       const SimpleStruct &file,
-                                       uint32_t size) {
+NodeId FATManager::WriteFileToDir(NodeId dir, const SimpleStruct &file,
+                                  uint32_t size) {
 
     auto long_name_entries = LongNameEntriesOfName(file.name);
     {
@@ -679,10 +1252,16 @@ inline void FATManager::WriteFileToDir(const SimpleStruct &dir,
         ASSERT_EQ(name, file.name);
     }
     auto dir_entry = FATDirectory();
+    auto write_entry = [this](uint64_t offset, const void *entry) {
+        auto pin = device_->Access(offset, sizeof(FATDirectory));
+        memmove(pin.Data(), entry, sizeof(FATDirectory));
+        device_->MarkDirty(Region::Dirent, offset, sizeof(FATDirectory));
+    };
 
     memset(&dir_entry.DIR_Name, 'a', sizeof(dir_entry.DIR_Name));
     dir_entry.DIR_NTRes = 0;
-    dir_entry.DIR_Attr = 0;
+    dir_entry.DIR_Attr =
+        file.is_dir ? ToIntegral(FATDirectory::Attr::Directory) : 0;
 
     dir_entry.DIR_CrtTimeTenth = 0;
     dir_entry.DIR_CrtTime = 0;
@@ -695,171 +1274,150 @@ inline void FATManager::WriteFileToDir(const SimpleStruct &dir,
     dir_entry.DIR_FstClusLO = file.first_cluster & 0xffff;
     dir_entry.DIR_FileSize = size;
 
-    // write this entries to the dir data block
-    // first, find the first empty entry
-    std::optional<std::tuple<uint8_t *, uint8_t *, uint32_t>>
-        first_empty_entry_and_its_sector_and_cluster;
-
-    ForEverySectorOfFileWithClusterNumber(
-        dir, [this, &first_empty_entry_and_its_sector_and_cluster](
-                 uint32_t cluster_number, uint8_t *data) {
-            auto dir_entry_count_per_sector =
-                this->bytes_per_sector_ / sizeof(FATDirectory);
-
-            if (first_empty_entry_and_its_sector_and_cluster.has_value()) {
-                return;
-            }
-
-            for (decltype(dir_entry_count_per_sector) i = 0;
-                 i < dir_entry_count_per_sector; i++) {
-                auto dir_entry = reinterpret_cast<FATDirectory *>(
-                    data + i * sizeof(FATDirectory));
-
-                if (IsFreeDirEntry(dir_entry)) {
-                    first_empty_entry_and_its_sector_and_cluster =
-                        std::make_tuple(data,
-                                        reinterpret_cast<uint8_t *>(dir_entry),
-                                        cluster_number);
-                    return;
+    // the free entry that ends the directory, as an offset in the image,
+    // and the cluster holding it
+    std::optional<std::pair<uint64_t, uint32_t>> first_free;
+    uint64_t bytes_per_cluster =
+        uint64_t(bytes_per_sector_) * sectors_per_cluster_;
+
+    ForEverySpanOfFile(
+        tree_.FirstCluster(dir),
+        [this, &first_free, bytes_per_cluster](uint32_t first_cluster,
+                                               uint64_t span_offset,
+                                               const uint8_t *data,
+                                               uint64_t bytes) {
+            for (uint64_t offset = 0; offset < bytes;
+                 offset += sizeof(FATDirectory)) {
+                auto entry =
+                    reinterpret_cast<const FATDirectory *>(data + offset);
+                if (IsFreeDirEntry(entry)) {
+                    first_free = {span_offset + offset,
+                                  static_cast<uint32_t>(
+                                      first_cluster +
+                                      offset / bytes_per_cluster)};
+                    return false;
                 }
             }
+            return true;
         });
 
-    ASSERT(first_empty_entry_and_its_sector_and_cluster.has_value());
-    // calculate whether there is enough space to write the long name entries
-
-    auto tuple = first_empty_entry_and_its_sector_and_cluster.value();
-    auto first_empty_entry_address = std::get<1>(tuple);
-    auto first_empty_sector_address = std::get<0>(tuple);
-    auto current_cluster = std::get<2>(tuple);
-
-    auto bytes_left_in_sector =
-        bytes_per_sector_ -
-        (first_empty_entry_address - first_empty_sector_address);
-    auto entry_count_left_in_sector =
-        bytes_left_in_sector / sizeof(FATDirectory);
-
-    if (entry_count_left_in_sector < long_name_entries.size() + 1) {
-
-        auto entry_count_needed_extra =
-            long_name_entries.size() + 1 - entry_count_left_in_sector;
-
-        auto sector_needed_extra =
-            (entry_count_needed_extra * sizeof(FATDirectory) +
-             bytes_per_sector_ - 1) /
-            bytes_per_sector_;
-
-        // whether we need to allocate a new cluster
-        auto current_sector_number =
-            SectorNumberOfAddress(first_empty_sector_address);
-        auto first_sector_number_of_current_cluster =
-            FirstSectorNumberOfDataCluster(current_cluster);
-
-        auto cluster_needed_number =
-            [](uint32_t current_sector_number, uint32_t sector_needed_extra,
-               uint32_t sectors_per_cluster,
-               uint32_t first_sector_number_of_current_cluster) -> uint32_t {
-            auto sectors_left_in_current_cluster =
-                sectors_per_cluster - (current_sector_number + 1 -
-                                       first_sector_number_of_current_cluster);
-            if (sector_needed_extra <= sectors_left_in_current_cluster)
-                return 0;
-            else
-                return (sector_needed_extra - sectors_left_in_current_cluster +
-                        sectors_per_cluster - 1) /
-                       sectors_per_cluster;
-        };
+    // the node of the new entry, once its short entry has been written
+    auto add_to_tree = [&](uint64_t short_entry_offset) -> NodeId {
+        if (tree_.IsLoaded(dir) && file.first_cluster != 0)
+            return tree_.AddChild(
+                dir,
+                {file.name, file.first_cluster, file.is_dir, size,
+                 ShortNameOf(reinterpret_cast<const char *>(&dir_entry.DIR_Name)),
+                 dir_entry.DIR_Attr, short_entry_offset});
+        return kNoNode;
+    };
 
-        auto sectors_left_in_current_cluster =
-            sectors_per_cluster_ - (current_sector_number + 1 -
-                                    first_sector_number_of_current_cluster);
+    // the entries go one after another from the free entry on, the long
+    // name entries first
+    uint64_t offset, end;
+    uint32_t cluster;
+    if (IsFixedRoot(tree_.FirstCluster(dir))) {
+        // the fixed root directory of FAT12/16 cannot grow, so the entries
+        // go into the rest of its region or nowhere
+        end = (uint64_t(FirstRootDirSector()) + root_dir_sector_count_) *
+              bytes_per_sector_;
+        offset = first_free ? first_free->first : end;
+        if (offset + (long_name_entries.size() + 1) * sizeof(FATDirectory) >
+            end)
+            throw FATError("root directory is full");
+        cluster = 0;
+    } else {
+        // a directory whose last cluster is full has no free entry left
+        if (!first_free) {
+            auto last = ExtentsOfFile(tree_.FirstCluster(dir)).back();
+            auto new_cluster = ExtendDir(
+                dir, last.first_cluster + last.cluster_count - 1);
+            first_free = {OffsetOfCluster(new_cluster), new_cluster};
+        }
+        std::tie(offset, cluster) = *first_free;
+        end = OffsetOfCluster(cluster) + bytes_per_cluster;
+    }
 
-        auto cluster_needed_extra = cluster_needed_number(
-            current_sector_number, sector_needed_extra, sectors_per_cluster_,
-            first_sector_number_of_current_cluster);
+    auto place = [&](const void *entry) {
+        // run on into the next cluster of the chain, or a new one
+        if (offset == end) {
+            auto next_cluster = this->fat_map_->Lookup(cluster);
+            if (this->fat_map_->IsEndOfFile(next_cluster))
+                cluster = ExtendDir(dir, cluster);
+            else
+                cluster = next_cluster;
+            offset = OffsetOfCluster(cluster);
+            end = offset + bytes_per_cluster;
+        }
+        write_entry(offset, entry);
+        offset += sizeof(FATDirectory);
+    };
+    for (auto &entry : long_name_entries)
+        place(&entry);
+    place(&dir_entry);
 
-        if (cluster_needed_extra > 0) {
-            // first, write to the current cluster to full
-            auto entries_can_be_written_in_current_cluster =
-                entry_count_left_in_sector + sectors_left_in_current_cluster *
-                                                 bytes_per_sector_ /
-                                                 sizeof(FATDirectory);
+    return add_to_tree(offset - sizeof(FATDirectory));
+}
 
-            decltype(long_name_entries.size()) entries_written = 0;
+NodeId FATManager::MakeDir(NodeId parent, const std::string &name) {
+    auto cluster = AllocateClusters(1)[0];
+    auto bytes_per_cluster =
+        uint64_t(bytes_per_sector_) * sectors_per_cluster_;
+    {
+        auto pin = device_->Access(OffsetOfCluster(cluster), bytes_per_cluster);
+        memset(pin.Data(), 0, bytes_per_cluster);
+
+        // "." and "..", the latter with cluster 0 when the parent is the root
+        auto dots = reinterpret_cast<FATDirectory *>(pin.Data());
+        uint32_t dot_clusters[2] = {
+            cluster, parent == DirTree::kRoot ? 0 : tree_.FirstCluster(parent)};
+        for (auto i = 0; i < 2; ++i) {
+            memset(&dots[i].DIR_Name, ' ', sizeof(dots[i].DIR_Name));
+            memset(dots[i].DIR_Name.name, '.', i + 1);
+            dots[i].DIR_Attr = ToIntegral(FATDirectory::Attr::Directory);
+            dots[i].DIR_FstClusHI = dot_clusters[i] >> 16;
+            dots[i].DIR_FstClusLO = dot_clusters[i] & 0xffff;
+        }
+        device_->MarkDirty(Region::Data, OffsetOfCluster(cluster),
+                           bytes_per_cluster);
+    }
 
-            for (decltype(entries_can_be_written_in_current_cluster) i = 0;
-                 i < entries_can_be_written_in_current_cluster; i++) {
-                if (entries_written == long_name_entries.size())
-                    memmove(first_empty_entry_address, &dir_entry,
-                            sizeof(FATDirectory));
-                else
-                    memmove(first_empty_entry_address,
-                            &long_name_entries[entries_written],
-                            sizeof(FATDirectory));
-                entries_written++;
-                first_empty_entry_address += sizeof(FATDirectory);
-            }
+    NodeId dir;
+    try {
+        dir = WriteFileToDir(parent, SimpleStruct{name, cluster, true}, 0);
+    } catch (const FATError &) {
+        FreeClusters({cluster});
+        throw;
+    }
+    ASSERT(dir != kNoNode);
+    tree_.SetChildren(dir, {});
+    return dir;
+}
 
-            auto written_entries_in_current_cluster = 0;
-            auto max_entries_per_cluster =
-                bytes_per_sector_ * sectors_per_cluster_ / sizeof(FATDirectory);
-            uint8_t *data = nullptr;
-
-            while (entries_written < long_name_entries.size() + 1) {
-                if (written_entries_in_current_cluster %
-                        max_entries_per_cluster ==
-                    0) {
-                    // switch to the next cluster
-                    auto next_cluster = this->fat_map_->Lookup(current_cluster);
-                    if (IsEndOfFile(next_cluster)) {
-                        auto new_cluster_op = this->fat_map_->FindFree(1);
-                        if (!new_cluster_op.has_value()) {
-                            std::cerr << "no free cluster" << std::endl;
-                            return;
-                        }
-                        auto &&new_cluster = new_cluster_op.value();
-                        this->fat_map_->Set<false>(current_cluster,
-                                                   new_cluster[0]);
-                        this->fat_map_->Set(new_cluster[0], 0x0FFFFFFF);
-                        this->fs_info_manager_->SetFreeClusterCount(
-                            this->fs_info_manager_->GetFreeClusterCount() - 1);
-                        current_cluster = new_cluster[0];
-                        data = StartAddressOfSector(
-                            FirstSectorNumberOfDataCluster(current_cluster));
-                    }
-                }
-                if (entries_written == long_name_entries.size())
-                    memmove(data, &dir_entry, sizeof(FATDirectory));
-                else
-                    memmove(data, &long_name_entries[entries_written],
-                            sizeof(FATDirectory));
-                entries_written++;
-                written_entries_in_current_cluster++;
-                data += sizeof(FATDirectory);
-            }
-        } else {
-            decltype(long_name_entries.size()) entries_written = 0;
+uint32_t FATManager::ExtendDir(NodeId dir, uint32_t last_cluster) {
+    auto new_cluster_op = this->fat_map_->FindFree(
+        1, this->fs_info_manager_->GetNextFreeCluster());
+    if (!new_cluster_op.has_value())
+        throw FATError("no free cluster");
+    auto new_cluster = new_cluster_op.value()[0];
 
-            for (decltype(long_name_entries.size()) i = 0;
-                 i < long_name_entries.size() + 1; i++) {
-                if (entries_written == long_name_entries.size())
-                    memmove(first_empty_entry_address, &dir_entry,
-                            sizeof(FATDirectory));
-                else
-                    memmove(first_empty_entry_address,
-                            &long_name_entries[entries_written],
-                            sizeof(FATDirectory));
-                entries_written++;
-                first_empty_entry_address += sizeof(FATDirectory);
-            }
-        }
-    } else {
-        for (auto &entry : long_name_entries) {
-            memmove(first_empty_entry_address, &entry, sizeof(FATDirectory));
-            first_empty_entry_address += sizeof(FATDirectory);
-        }
-        memmove(first_empty_entry_address, &dir_entry, sizeof(FATDirectory));
+    // a zeroed cluster reads as free entries up to its end
+    auto bytes_per_cluster =
+        uint64_t(bytes_per_sector_) * sectors_per_cluster_;
+    {
+        auto pin =
+            device_->Access(OffsetOfCluster(new_cluster), bytes_per_cluster);
+        memset(pin.Data(), 0, bytes_per_cluster);
+        device_->MarkDirty(Region::Data, OffsetOfCluster(new_cluster),
+                           bytes_per_cluster);
     }
+    this->fat_map_->Set<false>(last_cluster, new_cluster);
+    this->fat_map_->Set(new_cluster, this->fat_map_->EndOfChain());
+    extents_.Invalidate(tree_.FirstCluster(dir));
+    DecreaseFreeClusterCount(1);
+    stats_.Add(Counter::ClustersAllocated);
+    UpdateNextFreeCluster(new_cluster);
+    return new_cluster;
 }
 
 inline const std::string FATManager::Info() const {
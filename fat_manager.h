@@ -1,18 +1,30 @@
 #pragma once
 
+#include "block_device.h"
+#include "dir_index.h"
+#include "dir_tree.h"
+#include "extent_map.h"
+#include "fat_error.h"
 #include "fat.h"
 #include "fat_map.h"
+#include "fat_options.h"
 #include "fs_info_manager.h"
+#include "io_engine.h"
+#include "stats.h"
+#include "thread_pool.h"
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cstdint>
 #include <cstring>
 #include <fcntl.h>
 #include <functional>
+#include <iostream>
 #include <memory>
 #include <optional>
 #include <string>
 #include <sys/mman.h>
+#include <type_traits>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
@@ -51,13 +63,34 @@ using OptionalRef = std::optional<std::reference_wrapper<T>>;
 class FATManager {
   private:
     const std::string file_path_;
+    // everything in front of the data region, in memory while the image is
+    // open; the data region itself is reached through device_
     uint8_t *image_ = nullptr;
     off_t image_size_ = 0;
+    int image_fd_ = -1;
+    std::unique_ptr<BlockDevice> device_;
     uint32_t root_cluster_number_ = 0;
     std::unique_ptr<FATMap> fat_map_;
-    std::unordered_map<SimpleStruct, std::vector<SimpleStruct>> dir_map_;
-    SimpleStruct root_dir_;
+    ExtentMap extents_;
+    DirTree tree_;
     std::unique_ptr<FSInfoManager> fs_info_manager_;
+    // the FSInfo sector of FAT32, nullptr for FAT12/16
+    uint8_t *fs_info_sector_ = nullptr;
+    const FATOptions options_;
+    // recorded only with --stats
+    Stats stats_{options_.stats};
+
+    // the sidecar index is only opened once the tree is first needed
+    enum class IndexState { Disabled, Unchecked, Valid, Stale };
+    IndexState index_state_ = IndexState::Disabled;
+    std::unique_ptr<DirIndex> index_;
+    // index node of every directory reachable through the index so far
+    std::unordered_map<uint32_t, uint32_t> index_dir_nodes_;
+    bool tree_modified_ = false;
+    // a directory no longer matched its node in the index
+    std::atomic<bool> index_outdated_{false};
+    // every directory is loaded, as after a walk of the whole tree
+    bool tree_complete_ = false;
 
     bool IsFreeDirEntry(const FATDirectory *dir) {
         return dir->DIR_Name.name[0] == 0x00;
@@ -67,69 +100,94 @@ class FATManager {
         return dir->DIR_Name.name[0] == 0xE5; // deleted
     }
 
-    template <typename F>
-    void ForEverySectorOfCluster(uint32_t cluster_number,
-                                 F &&function_for_sector) {
-        auto first_sector_number =
-            FirstSectorNumberOfDataCluster(cluster_number);
-
-        for (int i = 0; i < sectors_per_cluster_; ++i) {
-            auto start_address = StartAddressOfSector(first_sector_number + i);
-            function_for_sector(start_address);
-        }
+    bool IsDotEntry(const FATDirectory *dir) {
+        auto &name = dir->DIR_Name.name;
+        return name[0] == '.' &&
+               (name[1] == ' ' || (name[1] == '.' && name[2] == ' '));
     }
 
-    template <typename F>
-    void ForEverySectorOfFile(const SimpleStruct &dir, F &&function) {
+    // the extents of the chain starting at `first_cluster`
+    std::vector<Extent> ExtentsOfFile(uint32_t first_cluster) {
+        return extents_.Get(first_cluster, [this](uint32_t first_cluster) {
+            auto timer = stats_.Time(Phase::FATWalk);
+            return fat_map_->Extents(first_cluster);
+        });
+    }
 
-        auto cluster_number = dir.first_cluster;
+    // cluster 0 stands for the root directory of FAT12/16, which sits in a
+    // fixed region before the data region instead of in clusters
+    bool IsFixedRoot(uint32_t first_cluster) const {
+        return first_cluster == 0 && root_dir_sector_count_ != 0;
+    }
 
-        do {
-            ForEverySectorOfCluster(cluster_number, function);
-            cluster_number = fat_map_->Lookup(cluster_number);
-        } while (!IsEndOfFile(cluster_number));
+    uint32_t FirstRootDirSector() const {
+        return reserved_sector_count_ + number_of_fats_ * sector_count_per_fat_;
     }
 
+    // calls `function(first_cluster, offset, data, bytes)` once per extent
+    // of a file with the extent's offset and bytes in the image, and stops
+    // early if it returns false; an extent longer than the device can pin
+    // at once comes in pieces, and the fixed root directory is a single span
     template <typename F>
-    void ForEverySectorOfFileWithClusterNumber(const SimpleStruct &dir,
-                                               F &&function) {
-
-        auto cluster_number = dir.first_cluster;
-
-        do {
-            // bind the cluster number as the first argument
-            auto function_with_cluster_number =
-                std::bind(function, cluster_number, std::placeholders::_1);
-            ForEverySectorOfCluster(cluster_number,
-                                    function_with_cluster_number);
-            cluster_number = fat_map_->Lookup(cluster_number);
-        } while (!IsEndOfFile(cluster_number));
+    void ForEverySpanOfFile(uint32_t first_cluster, F &&function) {
+        auto call = [&function](uint32_t cluster, uint64_t offset,
+                                uint8_t *data, uint64_t bytes) {
+            if constexpr (std::is_same_v<
+                              std::invoke_result_t<F, uint32_t, uint64_t,
+                                                   uint8_t *, uint64_t>,
+                              bool>)
+                return function(cluster, offset, data, bytes);
+            function(cluster, offset, data, bytes);
+            return true;
+        };
+        if (IsFixedRoot(first_cluster)) {
+            auto offset = uint64_t(FirstRootDirSector()) * bytes_per_sector_;
+            auto bytes = uint64_t(root_dir_sector_count_) * bytes_per_sector_;
+            auto pin = device_->Access(offset, bytes);
+            call(0, offset, pin.Data(), bytes);
+            return;
+        }
+        uint64_t bytes_per_cluster =
+            uint64_t(bytes_per_sector_) * sectors_per_cluster_;
+        auto clusters_per_span =
+            std::max<uint64_t>(device_->SpanLimit() / bytes_per_cluster, 1);
+        for (auto &extent : ExtentsOfFile(first_cluster)) {
+            for (uint32_t i = 0; i < extent.cluster_count;) {
+                auto count = static_cast<uint32_t>(std::min<uint64_t>(
+                    clusters_per_span, extent.cluster_count - i));
+                auto offset = OffsetOfCluster(extent.first_cluster + i);
+                auto bytes = count * bytes_per_cluster;
+                auto pin = device_->Access(offset, bytes);
+                if (!call(extent.first_cluster + i, offset, pin.Data(), bytes))
+                    return;
+                i += count;
+            }
+        }
     }
 
     template <typename F>
-    void ForEveryClusterOfFile(const SimpleStruct &dir, F &&function) {
-        auto cluster_number = dir.first_cluster;
-
-        do {
-            function(cluster_number);
-            cluster_number = fat_map_->Lookup(cluster_number);
-        } while (!IsEndOfFile(cluster_number));
+    void ForEveryClusterOfFile(uint32_t first_cluster, F &&function) {
+        for (auto &extent : ExtentsOfFile(first_cluster))
+            for (uint32_t i = 0; i < extent.cluster_count; ++i)
+                function(extent.first_cluster + i);
     }
 
+    // calls `func` on every live entry of a span of directory entries;
+    // returns false once the free entry that ends the directory is reached
     template <typename Func>
-    void ForEveryDirEntryInDirSector(const uint8_t *data, Func &&func) {
-        auto dirs_per_sector = bytes_per_sector_ / sizeof(FATDirectory);
-        for (decltype(dirs_per_sector) index = 0; index < dirs_per_sector;
-             ++index) {
-            auto dir = reinterpret_cast<const FATDirectory *>(
-                data + index * sizeof(FATDirectory));
+    bool ForEveryDirEntryInSpan(const uint8_t *data, uint64_t bytes,
+                                Func &&func) {
+        for (uint64_t offset = 0; offset < bytes;
+             offset += sizeof(FATDirectory)) {
+            auto dir = reinterpret_cast<const FATDirectory *>(data + offset);
             if (IsFreeDirEntry(dir)) {
-                break;
+                return false;
             } else if (IsDeletedDirEntry(dir)) {
                 continue;
             } else
                 func(dir);
         }
+        return true;
     }
 
   protected:
@@ -147,10 +205,14 @@ class FATManager {
 
   public:
     template <StringConvertible T>
-    FATManager(T &&file_path) : file_path_(std::forward<T>(file_path)) {
-        auto diskimg = file_path.c_str();
-        // open the disk image as read-write
-        int fd = open(diskimg, O_RDWR);
+    FATManager(T &&file_path, FATOptions options = {})
+        : file_path_(std::forward<T>(file_path)), options_(std::move(options)) {
+        if (!options_.index_path.empty())
+            index_state_ = IndexState::Unchecked;
+
+        auto diskimg = file_path_.c_str();
+        // open the disk image as read-write, unless only read
+        int fd = open(diskimg, options_.read_only ? O_RDONLY : O_RDWR);
         if (fd < 0) {
             perror("open");
             exit(1);
@@ -161,49 +223,178 @@ class FATManager {
             exit(1);
         }
         this->image_size_ = size;
+        image_fd_ = fd;
 
-        // mmap in READ-WRITE mode
-        // image_ = static_cast<uint8_t *>(
-        //     mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0));
-        image_ =
-            static_cast<uint8_t *>(mmap(NULL, size, O_RDWR, MAP_SHARED, fd, 0));
-        if (image_ == (void *)-1) {
+        // mapped, or read and written through a cache, per --io
+        device_ = BlockDevice::Open(fd, size, options_);
+        if (!device_) {
             perror("mmap");
             exit(1);
         }
-        close(fd);
 
-        auto hdr = reinterpret_cast<const struct BPB *>(image_);
-        InitBPB(*hdr);
+        struct BPB hdr;
+        if (!device_->Read(0, &hdr, sizeof(hdr))) {
+            perror("read");
+            exit(1);
+        }
+        InitBPB(hdr);
     }
 
     ~FATManager() {
-        if (image_ != nullptr) {
-            munmap((void *)image_, image_size_);
+        // the index is only written when this run walked the whole tree
+        // anyway; a change to the tree removed it, and it is written again
+        // by the next run that walks the whole tree
+        if (tree_complete_ && !tree_modified_ &&
+            (index_state_ == IndexState::Stale ||
+             (index_state_ == IndexState::Valid && index_outdated_))) {
+            try {
+                SaveIndex();
+            } catch (const FATError &e) {
+                std::cerr << e.what() << std::endl;
+            }
+        }
+        try {
+            WriteBack();
+        } catch (const FATError &e) {
+            std::cerr << e.what() << std::endl;
         }
+        device_.reset();
+        if (image_fd_ != -1)
+            close(image_fd_);
     }
 
-    void Ls();
+    // commands print their results to `out`
+
+    void Ls(std::ostream &out = std::cout);
+
+    // memory held by the directory tree once fully loaded
+    void Mem(std::ostream &out = std::cout);
+
+    void Ck(std::ostream &out = std::cout);
 
-    void Ck();
+    // size, first cluster and extents of a file or directory
+    void Stat(const std::string &path, std::ostream &out = std::cout);
+
+    // check the image for cross-linked and lost clusters, broken chains,
+    // sizes that disagree with chains, differing FAT copies and a wrong
+    // FSInfo; prints a line per problem, then totals, and returns the
+    // number of problems
+    size_t Verify(std::ostream &out = std::cout);
+
+    // move fragmented chains into contiguous free runs, smallest first,
+    // until `budget` bytes have been moved (0 for no limit)
+    void Defrag(uint64_t budget, std::ostream &out = std::cout);
 
     void CopyFileTo(const std::string &path, const std::string &dest);
 
-    void CopyFileFrom(const std::string &path, const std::string &dest);
+    void CopyFileFrom(const std::string &path, const std::string &dest,
+                      std::ostream &out = std::cout);
 
     void Delete(const std::string &path);
 
+    // copy a directory tree out of or into the image, the file data moved
+    // by an IOEngine
+    void CopyDirTo(const std::string &path, const std::string &dest,
+                   std::ostream &out = std::cout);
+
+    void CopyDirFrom(const std::string &path, const std::string &dest,
+                     std::ostream &out = std::cout);
+
+    // load the whole directory tree now, after which commands that only
+    // read the image may run concurrently
+    void LoadAll() { LoadTree(DirTree::kRoot); }
+
+    // the image was opened for commands that only read it
+    bool ReadOnly() const { return options_.read_only; }
+
+    // what the commands run so far did, with --stats
+    Stats &Statistics() { return stats_; }
+
+    // write the FAT entries changed so far to the mirror copies of the FAT;
+    // done when the image is closed, and by the server after each command
+    // that changed it
+    void SyncFATs() {
+        if (fat_map_)
+            fat_map_->SyncMirrors([this](uint8_t *address, uint64_t bytes) {
+                device_->MarkDirty(Region::FAT, address - image_, bytes);
+            });
+    }
+
+    // mirror the FAT and flush everything written since the last commit to
+    // disk, data first and FSInfo last
+    void Commit() {
+        SyncFATs();
+        auto timer = stats_.Time(Phase::Flush);
+        if (!device_->Flush(true))
+            throw FATError("failed to flush " + file_path_ + " to disk");
+    }
+
+    // the end of a command, and of a batch script, server connection or
+    // run of the tool, where --sync commits
+    void EndCommand() {
+        if (options_.sync == SyncPolicy::Command)
+            Commit();
+    }
+
+    void EndBatch() {
+        if (options_.sync == SyncPolicy::Batch)
+            Commit();
+    }
+
+    // what is done when the image is closed: with --sync=none the FAT is
+    // mirrored and the changes are left to the kernel, with --sync=batch
+    // they are committed, and with --sync=command every command already
+    // was; called early to have it count towards a command's --stats
+    void WriteBack() {
+        if (options_.sync == SyncPolicy::Command)
+            return;
+        if (options_.sync == SyncPolicy::Batch) {
+            Commit();
+            return;
+        }
+        SyncFATs();
+        auto timer = stats_.Time(Phase::Flush);
+        if (!device_->Flush(false))
+            throw FATError("failed to write back " + file_path_);
+    }
+
   private:
-    OptionalRef<SimpleStruct> FindFile(const std::string &path);
+    std::optional<NodeId> FindFile(const std::string &path);
+
+    // the nodes along `path`, the file or directory itself last
+    std::optional<std::vector<NodeId>> FindFileWithDirs(const std::string &path);
+
+    void DeleteNode(NodeId file);
+
+    void DeleteSingleFile(NodeId file);
+
+    // queue the copy of a file of the image to a local path on `engine`,
+    // `done` told whether it was written in full; false if the local file
+    // cannot be created
+    bool ExportFile(IOEngine &engine, NodeId file, const std::string &dest,
+                    IOEngine::Done done);
 
-    std::optional<std::vector<std::reference_wrapper<SimpleStruct>>>
-    FindFileWithDirs(const std::string &path);
+    // a chain of `count` free clusters under the --alloc policy, taken off
+    // the free count
+    std::vector<uint32_t> AllocateClusters(uint32_t count);
 
-    void DeleteSingleFile(const SimpleStruct &file);
+    void FreeClusters(const std::vector<uint32_t> &clusters);
 
-    void DeleteSingleDir(const SimpleStruct &dir);
+    // queue the read of `size` bytes of `fd` into a chain of clusters on
+    // `engine`, clearing the slack after them; `done` is told whether the
+    // whole file was read
+    void ReadIntoClusters(IOEngine &engine, int fd,
+                          const std::vector<uint32_t> &clusters, uint64_t size,
+                          IOEngine::Done done);
 
-    void RemoveEntryInDir(const SimpleStruct &dir, const SimpleStruct &file);
+    void DeleteSingleDir(NodeId dir);
+
+    // copy the chain of `node` into `clusters`, which are free and as many,
+    // then point its entry there and free the old chain
+    void RelocateChain(NodeId node, const std::vector<uint32_t> &clusters);
+
+    // mark the directory entries of `file` as deleted
+    void RemoveEntryInDir(NodeId file);
 
     inline const std::string Info() const;
 
@@ -211,8 +402,10 @@ class FATManager {
         return image_ + (sector_number * bytes_per_sector_);
     }
 
-    inline uint32_t SectorNumberOfAddress(uint8_t *address) const {
-        return (address - image_) / bytes_per_sector_;
+    // the offset of a data cluster in the image
+    inline uint64_t OffsetOfCluster(uint32_t cluster_number) {
+        return uint64_t(FirstSectorNumberOfDataCluster(cluster_number)) *
+               bytes_per_sector_;
     }
 
     inline uint32_t MaximumValidClusterNumber() const {
@@ -221,41 +414,103 @@ class FATManager {
 
     void InitBPB(const BPB &bpb);
 
+    // parse the entries of a directory straight from its clusters
+    std::vector<SimpleStruct> ReadDirEntries(uint32_t first_cluster);
+
+    // read the entries of a directory into the tree on first use
+    void LoadDir(NodeId dir);
+
+    // load every directory under `root`, in parallel with --threads
+    void LoadTree(NodeId root);
+
+    // have the device read the clusters of a directory ahead of its parse
+    void PrefetchDir(uint32_t first_cluster);
+
+    // extents copied in or out of the image are advised as sequential from
+    // this size on; smaller ones fit in one readahead window, and advising
+    // each would cut the mapping into an area per file
+    static constexpr uint64_t kSequentialBytes = uint64_t(1) << 20;
+
+    // open and validate the sidecar index on first use
+    void EnsureIndex();
+
+    // identity and FAT generation of the image as an index header
+    DirIndexHeader IndexHeaderOfImage();
+
+    // hash of the clusters of a directory, and of their numbers
+    uint64_t HashDirClusters(uint32_t first_cluster);
+
+    // whether the index was built from this volume
+    bool IndexMatchesImage(const DirIndex &index);
+
+    // whether a directory node of the index still lists its directory;
+    // notes that the index is outdated if not
+    bool IndexNodeIsCurrent(uint32_t node_id);
+
+    std::vector<SimpleStruct> ListingFromIndex(uint32_t node_id);
+
+    // called before the first change to the tree, invalidates the index file
+    void MarkTreeModified();
+
+    // write the whole tree, which is loaded, to the sidecar index
+    void SaveIndex();
+
     inline uint32_t FirstSectorNumberOfDataCluster(uint32_t cluster_number) {
         ASSERT(cluster_number >= 2);
         ASSERT(cluster_number <= MaximumValidClusterNumber());
 
-        auto first_data_sector =
-            reserved_sector_count_ + (number_of_fats_ * sector_count_per_fat_);
+        auto first_data_sector = FirstRootDirSector() + root_dir_sector_count_;
 
         return (cluster_number - 2) * sectors_per_cluster_ + first_data_sector;
     }
 
-    inline bool IsEndOfFile(uint32_t fat_entry_value) const {
-        ASSERT(fat_type_ == FATType::FAT32);
-        return fat_entry_value >= 0x0FFFFFF8;
+    inline void MarkFSInfoDirty() {
+        if (fs_info_sector_)
+            device_->MarkDirty(Region::FSInfo, fs_info_sector_ - image_,
+                               bytes_per_sector_);
     }
 
     inline void DecreaseFreeClusterCount(uint32_t number) {
         this->fs_info_manager_->SetFreeClusterCount(
             this->fs_info_manager_->GetFreeClusterCount() - number);
+        MarkFSInfoDirty();
     }
 
     inline void IncreaseFreeClusterCount(uint32_t number) {
         this->fs_info_manager_->SetFreeClusterCount(
             this->fs_info_manager_->GetFreeClusterCount() + number);
+        MarkFSInfoDirty();
+    }
+
+    // point FSI_Nxt_Free past the cluster just allocated
+    inline void UpdateNextFreeCluster(uint32_t last_allocated) {
+        auto next = this->fat_map_->NextFree(last_allocated + 1);
+        this->fs_info_manager_->SetNextFreeCluster(next ? *next : 0xFFFFFFFF);
+        MarkFSInfoDirty();
     }
 
-    inline std::vector<uint32_t> ClustersOfFile(const SimpleStruct &file) {
+    inline uint32_t ClustersForBytes(uint64_t size) const {
+        uint64_t bytes_per_cluster =
+            uint64_t(bytes_per_sector_) * sectors_per_cluster_;
+        return (size + bytes_per_cluster - 1) / bytes_per_cluster;
+    }
+
+    inline std::vector<uint32_t> ClustersOfFile(uint32_t first_cluster) {
         std::vector<uint32_t> cluster_entries;
-        ForEveryClusterOfFile(file, [this, &cluster_entries](uint32_t cluster) {
+        ForEveryClusterOfFile(first_cluster, [&cluster_entries](uint32_t cluster) {
             cluster_entries.push_back(cluster);
         });
         return cluster_entries;
     }
 
-    inline void WriteFileToDir(const SimpleStruct &dir,
-                               const SimpleStruct &file, uint32_t size);
+    // write the entries of `file` into `dir`; its node, if `dir` is loaded
+    NodeId WriteFileToDir(NodeId dir, const SimpleStruct &file, uint32_t size);
+
+    // create an empty directory called `name` in the loaded `parent`
+    NodeId MakeDir(NodeId parent, const std::string &name);
+
+    // append a cleared cluster to the chain of `dir` after `last_cluster`
+    uint32_t ExtendDir(NodeId dir, uint32_t last_cluster);
 
     inline uint8_t CheckSumOfShortName(FATDirectory::ShortName *name) {
         uint8_t sum = 0;
@@ -272,7 +527,7 @@ class FATManager {
     inline std::vector<LongNameDirectory>
     LongNameEntriesOfName(const std::string &name);
 
-    OptionalRef<SimpleStruct> FindParentDir(const std::string &path);
+    std::optional<NodeId> FindParentDir(const std::string &path);
 };
 
 } // namespace cs5250
@@ -1,74 +1,555 @@
 #pragma once
 
+#include "extent_map.h"
+#include "fat_scan.h"
+#include "stats.h"
+#include <algorithm>
+#include <bit>
 #include <cassert>
 #include <cstdint>
+#include <cstring>
 #include <iostream>
+#include <optional>
+#include <vector>
 
 #define ASSERT(x) assert(x)
 
 namespace cs5250 {
 
+// how the entries of one FAT width are laid out; `Get` and `Put` address
+// the entry of `cluster_number` in a single copy of the FAT
+struct FAT12Format {
+    static constexpr uint32_t kEndOfChain = 0xFFF;
+    static constexpr uint32_t kEndOfChainMin = 0xFF8;
+    static constexpr uint32_t kBad = 0xFF7;
+    static constexpr uint32_t kReservedMin = 0xFF0;
+
+    // `Put` rewrites the two bytes starting at `Offset`
+    static constexpr uint32_t kPutBytes = 2;
+
+    static uint32_t EntryCount(uint64_t fat_bytes) { return fat_bytes * 2 / 3; }
+
+    static uint64_t Offset(uint32_t cluster_number) {
+        return cluster_number + cluster_number / 2;
+    }
+
+    // two entries are packed into three bytes
+    static uint32_t Get(const uint8_t *fat, uint32_t cluster_number) {
+        uint16_t word;
+        memcpy(&word, fat + cluster_number + cluster_number / 2, 2);
+        return (cluster_number & 1) ? word >> 4 : word & 0xFFF;
+    }
+
+    static void Put(uint8_t *fat, uint32_t cluster_number, uint32_t value) {
+        auto address = fat + cluster_number + cluster_number / 2;
+        uint16_t word;
+        memcpy(&word, address, 2);
+        if (cluster_number & 1)
+            word = (word & 0x000F) | (value << 4);
+        else
+            word = (word & 0xF000) | (value & 0x0FFF);
+        memcpy(address, &word, 2);
+    }
+};
+
+struct FAT16Format {
+    // entries are plain words, so the scan kernels can read them in place
+    using Entry = uint16_t;
+
+    static constexpr uint32_t kEndOfChain = 0xFFFF;
+    static constexpr uint32_t kEndOfChainMin = 0xFFF8;
+    static constexpr uint32_t kBad = 0xFFF7;
+    static constexpr uint32_t kReservedMin = 0xFFF0;
+
+    static constexpr uint32_t kPutBytes = 2;
+
+    static uint32_t EntryCount(uint64_t fat_bytes) { return fat_bytes / 2; }
+
+    static uint64_t Offset(uint32_t cluster_number) {
+        return uint64_t(cluster_number) * 2;
+    }
+
+    static uint32_t Get(const uint8_t *fat, uint32_t cluster_number) {
+        return reinterpret_cast<const uint16_t *>(fat)[cluster_number];
+    }
+
+    static void Put(uint8_t *fat, uint32_t cluster_number, uint32_t value) {
+        reinterpret_cast<uint16_t *>(fat)[cluster_number] = value;
+    }
+};
+
+struct FAT32Format {
+    using Entry = uint32_t;
+
+    static constexpr uint32_t kEndOfChain = 0x0FFFFFFF;
+    static constexpr uint32_t kEndOfChainMin = 0x0FFFFFF8;
+    static constexpr uint32_t kBad = 0x0FFFFFF7;
+    static constexpr uint32_t kReservedMin = 0x0FFFFFF0;
+
+    static constexpr uint32_t kPutBytes = 4;
+
+    static uint32_t EntryCount(uint64_t fat_bytes) { return fat_bytes / 4; }
+
+    static uint64_t Offset(uint32_t cluster_number) {
+        return uint64_t(cluster_number) * 4;
+    }
+
+    static uint32_t Get(const uint8_t *fat, uint32_t cluster_number) {
+        return reinterpret_cast<const uint32_t *>(fat)[cluster_number] &
+               0x0FFFFFFF;
+    }
+
+    // the high 4 bits are reserved and kept as they are
+    static void Put(uint8_t *fat, uint32_t cluster_number, uint32_t value) {
+        auto &entry = reinterpret_cast<uint32_t *>(fat)[cluster_number];
+        entry = (entry & 0xF0000000) | (value & 0x0FFFFFFF);
+    }
+};
+
+/*
+ * The file allocation table and a bitmap of its free clusters.
+ *
+ * The free-cluster searches work on the bitmap and are the same for every
+ * FAT width. Reading and writing entries is left to FATMapOf, which is
+ * chosen once when the image is opened, so following a chain or building
+ * the bitmap runs a loop specialized for the width.
+ *
+ * Entries are read from and written to the primary copy of the FAT only.
+ * The blocks of it that change are marked dirty, and SyncMirrors copies
+ * them to the other copies in bulk, so a long run of updates dirties the
+ * mirrors once per block rather than once per entry. With mirroring turned
+ * off (FAT32 BPB_ExtFlags bit 7) the primary is the active FAT and the
+ * others are never written.
+ */
 class FATMap {
-  private:
-    uint8_t fat_num_;
+  protected:
     uint32_t size_;
-    std::vector<uint32_t *> cluster_starts_;
+    // one past the highest cluster number backed by the data region
+    uint32_t cluster_end_;
 
-  public:
-    FATMap(uint8_t fat_num, uint32_t size,
-           std::vector<uint32_t *> &&cluster_starts)
-        : fat_num_(fat_num), size_(size), cluster_starts_(cluster_starts) {}
+    // every copy of the FAT, and the one entries live in
+    std::vector<uint8_t *> fats_;
+    uint8_t *primary_;
+    uint64_t fat_bytes_;
+    bool mirrored_;
 
-    uint32_t Lookup(uint32_t cluster_number) {
-        if (cluster_number < 0 || cluster_number >= size_) {
-            std::cerr << "cluster number out of range" << std::endl;
-            return 0;
+    // bit i is set when block i of the primary changed since the last sync
+    static constexpr uint64_t kDirtyBlockBytes = 4096;
+    std::vector<uint64_t> dirty_blocks_;
+    bool dirty_ = false;
+
+    // where lookups and free searches are counted, if anywhere
+    Stats *stats_ = nullptr;
+
+    void MarkDirty(uint64_t offset, uint64_t bytes) {
+        for (auto block = offset / kDirtyBlockBytes;
+             block <= (offset + bytes - 1) / kDirtyBlockBytes; ++block)
+            dirty_blocks_[block / 64] |= uint64_t(1) << (block % 64);
+        dirty_ = true;
+    }
+
+    // bit i is set when cluster i is free, built on the first search
+    std::vector<uint64_t> free_bits_;
+    uint32_t free_count_ = 0;
+
+    bool HasBitmap() const { return !free_bits_.empty(); }
+
+    void MarkFree(uint32_t cluster_number, bool free) {
+        if (!HasBitmap() || cluster_number < 2 ||
+            cluster_number >= cluster_end_)
+            return;
+        auto &word = free_bits_[cluster_number / 64];
+        auto bit = uint64_t(1) << (cluster_number % 64);
+        if (free && !(word & bit)) {
+            word |= bit;
+            ++free_count_;
+        } else if (!free && (word & bit)) {
+            word &= ~bit;
+            --free_count_;
         }
-        return cluster_starts_[0][cluster_number] & 0x0FFFFFFF;
     }
 
-    void SetFree(uint32_t cluster_number) {
-        if (cluster_number < 0 || cluster_number >= size_) {
+    bool InRange(uint32_t cluster_number) const {
+        if (cluster_number >= size_) {
             std::cerr << "cluster number out of range" << std::endl;
-            return;
+            return false;
         }
+        return true;
+    }
+
+    virtual void BuildBitmap() = 0;
+
+    // write `value` into the entry of the primary copy of the FAT
+    virtual void Store(uint32_t cluster_number, uint32_t value) = 0;
+
+    FATMap(uint32_t size, uint32_t cluster_end, std::vector<uint8_t *> &&fats,
+           uint64_t fat_bytes, bool mirrored, unsigned primary)
+        : size_(size), cluster_end_(std::min(cluster_end, size)),
+          fats_(std::move(fats)), primary_(fats_[primary]),
+          fat_bytes_(fat_bytes), mirrored_(mirrored),
+          dirty_blocks_((fat_bytes / kDirtyBlockBytes + 1 + 63) / 64, 0) {}
+
+  public:
+    virtual ~FATMap() = default;
+
+    virtual uint32_t Lookup(uint32_t cluster_number) = 0;
+
+    // count lookups and free searches in `stats`
+    void SetStats(Stats *stats) { stats_ = stats; }
+
+    virtual bool IsEndOfFile(uint32_t fat_entry_value) const = 0;
+
+    // the value that ends a chain in this FAT
+    virtual uint32_t EndOfChain() const = 0;
+
+    // the value that marks a cluster as bad
+    virtual uint32_t BadCluster() const = 0;
 
-        for (auto &cluster_start : cluster_starts_)
-            cluster_start[cluster_number] = 0;
+    // the chain starting at `first_cluster` as runs of consecutive clusters
+    virtual std::vector<Extent> Extents(uint32_t first_cluster) = 0;
+
+    // the entries of clusters 2 up to the end of the data region by kind
+    virtual FATHistogram Histogram() = 0;
+
+    void SetFree(uint32_t cluster_number) {
+        if (!InRange(cluster_number))
+            return;
+        Store(cluster_number, 0);
+        MarkFree(cluster_number, true);
     }
 
     template <bool free_first = true>
     void Set(uint32_t cluster_number, uint32_t next_cluster) {
-        if (cluster_number < 0 || cluster_number >= size_) {
-            std::cerr << "cluster number out of range" << std::endl;
+        if (!InRange(cluster_number))
             return;
-        }
+        if constexpr (free_first)
+            ASSERT(Lookup(cluster_number) == 0);
+        else
+            ASSERT(IsEndOfFile(Lookup(cluster_number)));
+        Store(cluster_number, next_cluster);
+        MarkFree(cluster_number, next_cluster == 0);
+    }
 
-        for (auto &cluster_start : cluster_starts_) {
-            if constexpr (free_first)
-                ASSERT(cluster_start[cluster_number] == 0);
-            else {
-                ASSERT(IsEndOfFile(cluster_start[cluster_number]));
+    // number of entries the FAT has room for
+    uint32_t EntryCount() const { return size_; }
+
+    // the copy of the FAT that is read and written
+    const uint8_t *Primary() const { return primary_; }
+
+    // copy the blocks of the primary changed since the last call to every
+    // other copy, joining adjacent blocks into one copy; `written(address,
+    // bytes)` is told about every range changed in any copy
+    template <typename F> void SyncMirrors(F &&written) {
+        if (!dirty_)
+            return;
+        uint64_t run_start = 0, run_end = 0;
+        auto flush = [&] {
+            if (run_end == run_start)
+                return;
+            auto offset = run_start * kDirtyBlockBytes;
+            auto bytes =
+                std::min(run_end * kDirtyBlockBytes, fat_bytes_) - offset;
+            written(primary_ + offset, bytes);
+            if (!mirrored_)
+                return;
+            for (auto fat : fats_) {
+                if (fat == primary_)
+                    continue;
+                memcpy(fat + offset, primary_ + offset, bytes);
+                written(fat + offset, bytes);
+            }
+        };
+        for (size_t w = 0; w < dirty_blocks_.size(); ++w) {
+            for (auto word = dirty_blocks_[w]; word != 0; word &= word - 1) {
+                uint64_t block = w * 64 + std::countr_zero(word);
+                if (block == run_end) {
+                    ++run_end;
+                } else {
+                    flush();
+                    run_start = block;
+                    run_end = block + 1;
+                }
             }
-            cluster_start[cluster_number] = next_cluster;
+            dirty_blocks_[w] = 0;
         }
+        flush();
+        dirty_ = false;
     }
 
-    inline bool IsEndOfFile(uint32_t fat_entry_value) const {
-        return fat_entry_value >= 0x0FFFFFF8;
+    uint32_t FreeCount() {
+        if (!HasBitmap())
+            BuildBitmap();
+        return free_count_;
     }
 
-    std::optional<std::vector<uint32_t>> FindFree(uint32_t num) {
+    // the first `num` free clusters at or after `hint`, wrapping around to
+    // cluster 2; words without a free cluster are skipped whole
+    std::optional<std::vector<uint32_t>> FindFree(uint32_t num,
+                                                  uint32_t hint = 2) {
+        if (!HasBitmap())
+            BuildBitmap();
+        if (num > free_count_)
+            return std::nullopt;
+        if (hint < 2 || hint >= cluster_end_)
+            hint = 2;
+
         std::vector<uint32_t> free_clusters;
-        for (uint32_t i = 0; i < size_; i++) {
-            if (Lookup(i) == 0) {
-                free_clusters.push_back(i);
-                if (free_clusters.size() == num)
-                    return free_clusters;
+        free_clusters.reserve(num);
+        // bitmap words looked at, each standing for 64 entries
+        uint64_t words = 0;
+        auto collect = [&](uint32_t begin, uint32_t end) {
+            for (auto w = begin / 64; w * 64 < end; ++w) {
+                ++words;
+                auto word = free_bits_[w];
+                // drop the bits below `begin` in the first word
+                if (w == begin / 64)
+                    word &= ~uint64_t(0) << (begin % 64);
+                while (word != 0) {
+                    auto cluster = w * 64 + std::countr_zero(word);
+                    if (cluster >= end)
+                        return false;
+                    free_clusters.push_back(cluster);
+                    if (free_clusters.size() == num)
+                        return true;
+                    word &= word - 1;
+                }
             }
-        }
+            return false;
+        };
+
+        auto found = collect(hint, cluster_end_) || collect(2, hint);
+        if (stats_)
+            stats_->Add(Counter::FreeEntriesScanned, words * 64);
+        if (found)
+            return free_clusters;
         return std::nullopt;
     }
+
+    // the first free cluster at or after `hint`
+    std::optional<uint32_t> NextFree(uint32_t hint) {
+        auto found = FindFree(1, hint);
+        if (!found)
+            return std::nullopt;
+        return found.value()[0];
+    }
+
+    // calls `function(start, length)` for every maximal run of free clusters
+    // in ascending order
+    template <typename F> void ForEachFreeRun(F &&function) {
+        if (!HasBitmap())
+            BuildBitmap();
+        uint32_t run_start = 0, run_length = 0;
+        for (uint32_t w = 0; w * 64 < cluster_end_; ++w) {
+            auto word = free_bits_[w];
+            if (word == ~uint64_t(0) && run_length != 0 &&
+                run_start + run_length == w * 64) {
+                run_length += 64;
+                continue;
+            }
+            while (word != 0) {
+                auto low = std::countr_zero(word);
+                // length of the block of set bits starting at `low`
+                auto ones = std::countr_one(word >> low);
+                uint32_t start = w * 64 + low;
+                if (run_length != 0 && run_start + run_length == start) {
+                    run_length += ones;
+                } else {
+                    if (run_length != 0)
+                        function(run_start, run_length);
+                    run_start = start;
+                    run_length = ones;
+                }
+                if (low + ones >= 64)
+                    break;
+                word &= ~uint64_t(0) << (low + ones);
+            }
+        }
+        if (run_length != 0)
+            function(run_start, run_length);
+    }
+
+    /*
+     * `num` free clusters laid out in as few runs as possible.
+     *
+     * The smallest run that holds all of them wins, the one nearest to
+     * `hint` among equals. Otherwise the largest runs are taken until the
+     * remainder fits in one run, which is again chosen best-fit, and the
+     * runs are returned in disk order so the chain only moves forward.
+     */
+    std::optional<std::vector<uint32_t>> FindContiguous(uint32_t num,
+                                                        uint32_t hint = 2) {
+        if (!HasBitmap())
+            BuildBitmap();
+        if (num == 0 || num > free_count_)
+            return std::nullopt;
+
+        struct Run {
+            uint32_t start;
+            uint32_t length;
+        };
+        // every run is looked at
+        if (stats_)
+            stats_->Add(Counter::FreeEntriesScanned, cluster_end_);
+        std::vector<Run> runs;
+        std::optional<Run> best;
+        auto distance = [hint](uint32_t start) {
+            return start >= hint ? start - hint : hint - start + (1u << 31);
+        };
+        ForEachFreeRun([&](uint32_t start, uint32_t length) {
+            runs.push_back({start, length});
+            if (length >= num &&
+                (!best || length < best->length ||
+                 (length == best->length &&
+                  distance(start) < distance(best->start))))
+                best = Run{start, length};
+        });
+
+        std::vector<uint32_t> clusters;
+        clusters.reserve(num);
+        if (best) {
+            for (uint32_t i = 0; i < num; ++i)
+                clusters.push_back(best->start + i);
+            return clusters;
+        }
+
+        std::sort(runs.begin(), runs.end(), [](const Run &a, const Run &b) {
+            return a.length > b.length ||
+                   (a.length == b.length && a.start < b.start);
+        });
+        std::vector<Run> taken;
+        uint32_t remaining = num;
+        size_t next = 0;
+        while (remaining > runs[next].length) {
+            taken.push_back(runs[next]);
+            remaining -= runs[next].length;
+            ++next;
+        }
+        // the smallest of the rest that still holds the remainder
+        auto last = next;
+        while (last + 1 < runs.size() && runs[last + 1].length >= remaining)
+            ++last;
+        taken.push_back({runs[last].start, remaining});
+
+        std::sort(taken.begin(), taken.end(),
+                  [](const Run &a, const Run &b) { return a.start < b.start; });
+        for (auto &run : taken)
+            for (uint32_t i = 0; i < run.length; ++i)
+                clusters.push_back(run.start + i);
+        return clusters;
+    }
+
+    // number of contiguous runs in a chain of clusters
+    static uint32_t CountExtents(const std::vector<uint32_t> &clusters) {
+        uint32_t extents = clusters.empty() ? 0 : 1;
+        for (size_t i = 1; i < clusters.size(); ++i)
+            if (clusters[i] != clusters[i - 1] + 1)
+                ++extents;
+        return extents;
+    }
+};
+
+template <typename Format> class FATMapOf final : public FATMap {
+  private:
+    void BuildBitmap() override {
+        free_bits_.assign((cluster_end_ + 63) / 64 + 1, 0);
+        free_count_ = 0;
+        auto fat = primary_;
+        uint32_t base = 0;
+        // whole words come straight from the vector kernels
+        if constexpr (requires { typename Format::Entry; }) {
+            auto &kernels = BestScanKernels<typename Format::Entry>();
+            auto entries = reinterpret_cast<const Format::Entry *>(fat);
+            for (; base + 64 <= cluster_end_; base += 64) {
+                auto word = kernels.equal_mask(entries + base, 0);
+                // clusters 0 and 1 hold the media byte and flags
+                if (base == 0)
+                    word &= ~uint64_t(3);
+                free_bits_[base / 64] = word;
+                free_count_ += std::popcount(word);
+            }
+        }
+        // compose every word from 64 entries before storing it
+        for (; base < cluster_end_; base += 64) {
+            auto end = std::min<uint32_t>(base + 64, cluster_end_);
+            uint64_t word = 0;
+            for (auto i = std::max<uint32_t>(base, 2); i < end; ++i)
+                word |= uint64_t(Format::Get(fat, i) == 0) << (i - base);
+            free_bits_[base / 64] = word;
+            free_count_ += std::popcount(word);
+        }
+    }
+
+    void Store(uint32_t cluster_number, uint32_t value) override {
+        Format::Put(primary_, cluster_number, value);
+        MarkDirty(Format::Offset(cluster_number), Format::kPutBytes);
+    }
+
+  public:
+    FATMapOf(std::vector<uint8_t *> &&fats, uint64_t fat_bytes,
+             uint32_t cluster_end, bool mirrored = true, unsigned primary = 0)
+        : FATMap(Format::EntryCount(fat_bytes), cluster_end, std::move(fats),
+                 fat_bytes, mirrored, primary) {}
+
+    uint32_t Lookup(uint32_t cluster_number) override {
+        if (!InRange(cluster_number))
+            return 0;
+        if (stats_)
+            stats_->Add(Counter::FATLookups);
+        return Format::Get(primary_, cluster_number);
+    }
+
+    bool IsEndOfFile(uint32_t fat_entry_value) const override {
+        return fat_entry_value >= Format::kEndOfChainMin;
+    }
+
+    uint32_t EndOfChain() const override { return Format::kEndOfChain; }
+
+    uint32_t BadCluster() const override { return Format::kBad; }
+
+    std::vector<Extent> Extents(uint32_t first_cluster) override {
+        auto fat = primary_;
+        auto extents = ExtentMap::Build(
+            first_cluster, cluster_end_,
+            [fat](uint32_t cluster) { return Format::Get(fat, cluster); },
+            [](uint32_t entry) { return entry >= Format::kEndOfChainMin; });
+        if (stats_) {
+            // one entry read per cluster of the chain
+            uint64_t clusters = 0;
+            for (auto &extent : extents)
+                clusters += extent.cluster_count;
+            stats_->Add(Counter::FATLookups, clusters);
+        }
+        return extents;
+    }
+
+    FATHistogram Histogram() override {
+        auto fat = primary_;
+        if (cluster_end_ <= 2)
+            return {};
+        if constexpr (requires { typename Format::Entry; }) {
+            return HistogramOfEntries(
+                BestScanKernels<typename Format::Entry>(),
+                reinterpret_cast<const Format::Entry *>(fat) + 2,
+                cluster_end_ - 2,
+                {Format::kReservedMin, Format::kBad, Format::kEndOfChainMin});
+        } else {
+            FATHistogram histogram;
+            for (uint32_t i = 2; i < cluster_end_; ++i) {
+                auto entry = Format::Get(fat, i);
+                if (entry == 0)
+                    ++histogram.free;
+                else if (entry >= Format::kEndOfChainMin)
+                    ++histogram.end_of_chain;
+                else if (entry == Format::kBad)
+                    ++histogram.bad;
+                else if (entry >= Format::kReservedMin)
+                    ++histogram.reserved;
+                else
+                    ++histogram.used;
+            }
+            return histogram;
+        }
+    }
 };
 
-} // namespace cs5250
\ No newline at end of file
+} // namespace cs5250
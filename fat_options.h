@@ -0,0 +1,90 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+namespace cs5250 {
+
+// where the clusters of an imported file are taken from
+enum class AllocPolicy {
+    // the first free clusters after the FSInfo hint
+    First,
+    // as few contiguous runs as possible, best fit
+    Contiguous,
+};
+
+// when the changes to the image are flushed to disk
+enum class SyncPolicy {
+    // left to the kernel
+    None,
+    // after every command
+    Command,
+    // once per batch script, server connection or run of the tool
+    Batch,
+};
+
+// how the bytes of the image are reached
+enum class IOBackend {
+    // the whole image mapped shared
+    Mmap,
+    // pread/pwrite through a cache of clusters
+    Pread,
+};
+
+// what runs the bulk reads and writes of copies in and out of the image
+enum class IOEngineKind {
+    // io_uring when the kernel allows it, otherwise threads
+    Auto,
+    Uring,
+    // blocking calls on a thread per chunk in flight
+    Threads,
+};
+
+/*
+ * Options that tune how a FATManager works with its image, parsed from the
+ * `--name[=value]` arguments of the command line.
+ */
+struct FATOptions {
+    // path of the sidecar directory index, empty when the index is disabled
+    std::string index_path;
+
+    // threads used for whole-tree walks, 0 for one per core
+    unsigned threads = 1;
+
+    AllocPolicy alloc = AllocPolicy::First;
+
+    SyncPolicy sync = SyncPolicy::None;
+
+    IOBackend io = IOBackend::Mmap;
+
+    // open and map the image for reading only, for commands that never
+    // change it
+    bool read_only = false;
+
+    // tell the kernel which parts of the image are needed soon, which are
+    // copied front to back, and that the FAT wants huge pages
+    bool advise = true;
+
+    // fault the whole mapping in when the image is opened
+    bool populate = false;
+
+    // clusters cached by the pread backend, in bytes
+    uint64_t cache_bytes = uint64_t(64) << 20;
+
+    IOEngineKind io_engine = IOEngineKind::Auto;
+
+    // chunks of copies kept in flight at once
+    unsigned queue_depth = 32;
+
+    // batch: run the remaining lines after one fails
+    bool keep_going = false;
+
+    // report what each command did per file
+    bool verbose = false;
+
+    // count operations and time the phases of each command, printed as
+    // JSON after it
+    bool stats = false;
+};
+
+} // namespace cs5250
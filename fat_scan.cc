@@ -0,0 +1,361 @@
+#include "fat_scan.h"
+#include <bit>
+#include <type_traits>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+namespace cs5250 {
+
+const char *ScanISAName(ScanISA isa) {
+    switch (isa) {
+    case ScanISA::Scalar:
+        return "scalar";
+    case ScanISA::SSE2:
+        return "sse2";
+    case ScanISA::AVX2:
+        return "avx2";
+    case ScanISA::AVX512:
+        return "avx512";
+    }
+    return "unknown";
+}
+
+namespace {
+
+template <typename Entry> uint32_t ValueOf(Entry entry) {
+    if constexpr (std::is_same_v<Entry, uint32_t>)
+        return entry & 0x0FFFFFFF;
+    else
+        return entry;
+}
+
+template <typename Entry>
+uint64_t EqualMaskScalar(const Entry *entries, uint32_t value) {
+    uint64_t bits = 0;
+    for (int i = 0; i < 64; ++i)
+        bits |= uint64_t(ValueOf(entries[i]) == value) << i;
+    return bits;
+}
+
+template <typename Entry>
+uint64_t AtLeastMaskScalar(const Entry *entries, uint32_t value) {
+    uint64_t bits = 0;
+    for (int i = 0; i < 64; ++i)
+        bits |= uint64_t(ValueOf(entries[i]) >= value) << i;
+    return bits;
+}
+
+#if defined(__x86_64__)
+
+// 28-bit FAT32 values fit in a signed compare; 16-bit values are moved into
+// the signed range by flipping the top bit
+
+__attribute__((target("sse2"))) uint64_t
+EqualMask32SSE2(const uint32_t *entries, uint32_t value) {
+    auto mask = _mm_set1_epi32(0x0FFFFFFF);
+    auto wanted = _mm_set1_epi32(value);
+    uint64_t bits = 0;
+    for (int i = 0; i < 64; i += 4) {
+        auto x = _mm_and_si128(
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(entries + i)),
+            mask);
+        auto eq = _mm_castsi128_ps(_mm_cmpeq_epi32(x, wanted));
+        bits |= uint64_t(_mm_movemask_ps(eq)) << i;
+    }
+    return bits;
+}
+
+__attribute__((target("sse2"))) uint64_t
+AtLeastMask32SSE2(const uint32_t *entries, uint32_t value) {
+    auto mask = _mm_set1_epi32(0x0FFFFFFF);
+    auto below = _mm_set1_epi32(value - 1);
+    uint64_t bits = 0;
+    for (int i = 0; i < 64; i += 4) {
+        auto x = _mm_and_si128(
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(entries + i)),
+            mask);
+        auto ge = _mm_castsi128_ps(_mm_cmpgt_epi32(x, below));
+        bits |= uint64_t(_mm_movemask_ps(ge)) << i;
+    }
+    return bits;
+}
+
+__attribute__((target("sse2"))) uint64_t
+EqualMask16SSE2(const uint16_t *entries, uint32_t value) {
+    auto wanted = _mm_set1_epi16(static_cast<int16_t>(value));
+    uint64_t bits = 0;
+    for (int i = 0; i < 64; i += 16) {
+        auto a = _mm_cmpeq_epi16(
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(entries + i)),
+            wanted);
+        auto b = _mm_cmpeq_epi16(
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(entries + i + 8)),
+            wanted);
+        bits |= uint64_t(uint16_t(_mm_movemask_epi8(_mm_packs_epi16(a, b))))
+                << i;
+    }
+    return bits;
+}
+
+__attribute__((target("sse2"))) uint64_t
+AtLeastMask16SSE2(const uint16_t *entries, uint32_t value) {
+    auto flip = _mm_set1_epi16(static_cast<int16_t>(0x8000));
+    auto below = _mm_set1_epi16(static_cast<int16_t>((value - 1) ^ 0x8000));
+    uint64_t bits = 0;
+    for (int i = 0; i < 64; i += 16) {
+        auto a = _mm_cmpgt_epi16(
+            _mm_xor_si128(
+                _mm_loadu_si128(reinterpret_cast<const __m128i *>(entries + i)),
+                flip),
+            below);
+        auto b = _mm_cmpgt_epi16(
+            _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(
+                              entries + i + 8)),
+                          flip),
+            below);
+        bits |= uint64_t(uint16_t(_mm_movemask_epi8(_mm_packs_epi16(a, b))))
+                << i;
+    }
+    return bits;
+}
+
+__attribute__((target("avx2"))) uint64_t
+EqualMask32AVX2(const uint32_t *entries, uint32_t value) {
+    auto mask = _mm256_set1_epi32(0x0FFFFFFF);
+    auto wanted = _mm256_set1_epi32(value);
+    uint64_t bits = 0;
+    for (int i = 0; i < 64; i += 8) {
+        auto x = _mm256_and_si256(
+            _mm256_loadu_si256(reinterpret_cast<const __m256i *>(entries + i)),
+            mask);
+        auto eq = _mm256_castsi256_ps(_mm256_cmpeq_epi32(x, wanted));
+        bits |= uint64_t(_mm256_movemask_ps(eq)) << i;
+    }
+    return bits;
+}
+
+__attribute__((target("avx2"))) uint64_t
+AtLeastMask32AVX2(const uint32_t *entries, uint32_t value) {
+    auto mask = _mm256_set1_epi32(0x0FFFFFFF);
+    auto below = _mm256_set1_epi32(value - 1);
+    uint64_t bits = 0;
+    for (int i = 0; i < 64; i += 8) {
+        auto x = _mm256_and_si256(
+            _mm256_loadu_si256(reinterpret_cast<const __m256i *>(entries + i)),
+            mask);
+        auto ge = _mm256_castsi256_ps(_mm256_cmpgt_epi32(x, below));
+        bits |= uint64_t(_mm256_movemask_ps(ge)) << i;
+    }
+    return bits;
+}
+
+// packs two vectors of 16 compare results into one 32-bit mask in order
+__attribute__((target("avx2"))) inline uint32_t Movemask16AVX2(__m256i a,
+                                                               __m256i b) {
+    auto packed = _mm256_permute4x64_epi64(_mm256_packs_epi16(a, b), 0xD8);
+    return _mm256_movemask_epi8(packed);
+}
+
+__attribute__((target("avx2"))) uint64_t
+EqualMask16AVX2(const uint16_t *entries, uint32_t value) {
+    auto wanted = _mm256_set1_epi16(static_cast<int16_t>(value));
+    uint64_t bits = 0;
+    for (int i = 0; i < 64; i += 32) {
+        auto a = _mm256_cmpeq_epi16(
+            _mm256_loadu_si256(reinterpret_cast<const __m256i *>(entries + i)),
+            wanted);
+        auto b = _mm256_cmpeq_epi16(_mm256_loadu_si256(
+                                        reinterpret_cast<const __m256i *>(
+                                            entries + i + 16)),
+                                    wanted);
+        bits |= uint64_t(Movemask16AVX2(a, b)) << i;
+    }
+    return bits;
+}
+
+__attribute__((target("avx2"))) uint64_t
+AtLeastMask16AVX2(const uint16_t *entries, uint32_t value) {
+    auto flip = _mm256_set1_epi16(static_cast<int16_t>(0x8000));
+    auto below =
+        _mm256_set1_epi16(static_cast<int16_t>((value - 1) ^ 0x8000));
+    uint64_t bits = 0;
+    for (int i = 0; i < 64; i += 32) {
+        auto a = _mm256_cmpgt_epi16(
+            _mm256_xor_si256(_mm256_loadu_si256(
+                                 reinterpret_cast<const __m256i *>(entries + i)),
+                             flip),
+            below);
+        auto b = _mm256_cmpgt_epi16(
+            _mm256_xor_si256(_mm256_loadu_si256(
+                                 reinterpret_cast<const __m256i *>(
+                                     entries + i + 16)),
+                             flip),
+            below);
+        bits |= uint64_t(Movemask16AVX2(a, b)) << i;
+    }
+    return bits;
+}
+
+__attribute__((target("avx512f"))) uint64_t
+EqualMask32AVX512(const uint32_t *entries, uint32_t value) {
+    auto mask = _mm512_set1_epi32(0x0FFFFFFF);
+    auto wanted = _mm512_set1_epi32(value);
+    uint64_t bits = 0;
+    for (int i = 0; i < 64; i += 16) {
+        auto x = _mm512_and_si512(_mm512_loadu_si512(entries + i), mask);
+        bits |= uint64_t(_mm512_cmpeq_epu32_mask(x, wanted)) << i;
+    }
+    return bits;
+}
+
+__attribute__((target("avx512f"))) uint64_t
+AtLeastMask32AVX512(const uint32_t *entries, uint32_t value) {
+    auto mask = _mm512_set1_epi32(0x0FFFFFFF);
+    auto least = _mm512_set1_epi32(value);
+    uint64_t bits = 0;
+    for (int i = 0; i < 64; i += 16) {
+        auto x = _mm512_and_si512(_mm512_loadu_si512(entries + i), mask);
+        bits |= uint64_t(_mm512_cmpge_epu32_mask(x, least)) << i;
+    }
+    return bits;
+}
+
+__attribute__((target("avx512f,avx512bw"))) uint64_t
+EqualMask16AVX512(const uint16_t *entries, uint32_t value) {
+    auto wanted = _mm512_set1_epi16(static_cast<int16_t>(value));
+    return uint64_t(_mm512_cmpeq_epu16_mask(_mm512_loadu_si512(entries),
+                                            wanted)) |
+           uint64_t(_mm512_cmpeq_epu16_mask(_mm512_loadu_si512(entries + 32),
+                                            wanted))
+               << 32;
+}
+
+__attribute__((target("avx512f,avx512bw"))) uint64_t
+AtLeastMask16AVX512(const uint16_t *entries, uint32_t value) {
+    auto least = _mm512_set1_epi16(static_cast<int16_t>(value));
+    return uint64_t(_mm512_cmpge_epu16_mask(_mm512_loadu_si512(entries),
+                                            least)) |
+           uint64_t(_mm512_cmpge_epu16_mask(_mm512_loadu_si512(entries + 32),
+                                            least))
+               << 32;
+}
+
+#endif
+
+const ScanKernels<uint16_t> kKernels16[] = {
+    {ScanISA::Scalar, EqualMaskScalar<uint16_t>, AtLeastMaskScalar<uint16_t>},
+#if defined(__x86_64__)
+    {ScanISA::SSE2, EqualMask16SSE2, AtLeastMask16SSE2},
+    {ScanISA::AVX2, EqualMask16AVX2, AtLeastMask16AVX2},
+    {ScanISA::AVX512, EqualMask16AVX512, AtLeastMask16AVX512},
+#endif
+};
+
+const ScanKernels<uint32_t> kKernels32[] = {
+    {ScanISA::Scalar, EqualMaskScalar<uint32_t>, AtLeastMaskScalar<uint32_t>},
+#if defined(__x86_64__)
+    {ScanISA::SSE2, EqualMask32SSE2, AtLeastMask32SSE2},
+    {ScanISA::AVX2, EqualMask32AVX2, AtLeastMask32AVX2},
+    {ScanISA::AVX512, EqualMask32AVX512, AtLeastMask32AVX512},
+#endif
+};
+
+bool Supported(ScanISA isa) {
+#if defined(__x86_64__)
+    switch (isa) {
+    case ScanISA::Scalar:
+    case ScanISA::SSE2:
+        return true;
+    case ScanISA::AVX2:
+        return __builtin_cpu_supports("avx2");
+    case ScanISA::AVX512:
+        return __builtin_cpu_supports("avx512f") &&
+               __builtin_cpu_supports("avx512bw");
+    }
+    return false;
+#else
+    return isa == ScanISA::Scalar;
+#endif
+}
+
+template <typename Entry, size_t N>
+const ScanKernels<Entry> *Find(const ScanKernels<Entry> (&table)[N],
+                               ScanISA isa) {
+    if (!Supported(isa))
+        return nullptr;
+    for (auto &kernels : table)
+        if (kernels.isa == isa)
+            return &kernels;
+    return nullptr;
+}
+
+template <typename Entry, size_t N>
+const ScanKernels<Entry> &Best(const ScanKernels<Entry> (&table)[N]) {
+    for (auto i = N; i-- > 0;)
+        if (Supported(table[i].isa))
+            return table[i];
+    return table[0];
+}
+
+} // namespace
+
+template <>
+const ScanKernels<uint16_t> *ScanKernelsFor<uint16_t>(ScanISA isa) {
+    return Find(kKernels16, isa);
+}
+
+template <>
+const ScanKernels<uint32_t> *ScanKernelsFor<uint32_t>(ScanISA isa) {
+    return Find(kKernels32, isa);
+}
+
+template <> const ScanKernels<uint16_t> &BestScanKernels<uint16_t>() {
+    static const auto &best = Best(kKernels16);
+    return best;
+}
+
+template <> const ScanKernels<uint32_t> &BestScanKernels<uint32_t>() {
+    static const auto &best = Best(kKernels32);
+    return best;
+}
+
+template <typename Entry>
+FATHistogram HistogramOfEntries(const ScanKernels<Entry> &kernels,
+                                const Entry *entries, size_t n,
+                                const FATSpecialValues &values) {
+    FATHistogram histogram;
+    uint64_t at_least_reserved = 0;
+    size_t i = 0;
+    for (; i + 64 <= n; i += 64) {
+        auto block = entries + i;
+        histogram.free += std::popcount(kernels.equal_mask(block, 0));
+        histogram.bad += std::popcount(kernels.equal_mask(block, values.bad));
+        histogram.end_of_chain += std::popcount(
+            kernels.at_least_mask(block, values.end_of_chain_min));
+        at_least_reserved +=
+            std::popcount(kernels.at_least_mask(block, values.reserved_min));
+    }
+    for (; i < n; ++i) {
+        auto value = ValueOf(entries[i]);
+        histogram.free += value == 0;
+        histogram.bad += value == values.bad;
+        histogram.end_of_chain += value >= values.end_of_chain_min;
+        at_least_reserved += value >= values.reserved_min;
+    }
+    // bad and end of chain values lie above the reserved range
+    histogram.reserved =
+        at_least_reserved - histogram.bad - histogram.end_of_chain;
+    histogram.used = n - histogram.free - at_least_reserved;
+    return histogram;
+}
+
+template FATHistogram HistogramOfEntries(const ScanKernels<uint16_t> &,
+                                         const uint16_t *, size_t,
+                                         const FATSpecialValues &);
+template FATHistogram HistogramOfEntries(const ScanKernels<uint32_t> &,
+                                         const uint32_t *, size_t,
+                                         const FATSpecialValues &);
+
+} // namespace cs5250
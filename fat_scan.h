@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace cs5250 {
+
+// instruction sets the FAT scan kernels are built for, slowest first
+enum class ScanISA { Scalar, SSE2, AVX2, AVX512 };
+
+const char *ScanISAName(ScanISA isa);
+
+/*
+ * Kernels over a FAT of 16- or 32-bit entries. FAT32 entries are compared
+ * on their low 28 bits only.
+ *
+ * Every kernel looks at 64 entries and returns one bit per entry, so the
+ * whole-FAT scans below only call through the table once per 64 entries.
+ */
+template <typename Entry> struct ScanKernels {
+    ScanISA isa;
+    // entries equal to `value`
+    uint64_t (*equal_mask)(const Entry *entries, uint32_t value);
+    // entries at least `value`, which must not be 0
+    uint64_t (*at_least_mask)(const Entry *entries, uint32_t value);
+};
+
+// the kernels for `isa`, or nullptr when this CPU cannot run them
+template <typename Entry> const ScanKernels<Entry> *ScanKernelsFor(ScanISA isa);
+
+// the fastest kernels this CPU can run, picked once per process
+template <typename Entry> const ScanKernels<Entry> &BestScanKernels();
+
+// FAT entries by kind
+struct FATHistogram {
+    uint64_t free = 0;
+    uint64_t used = 0;
+    uint64_t reserved = 0;
+    uint64_t bad = 0;
+    uint64_t end_of_chain = 0;
+};
+
+// the values that mark the special entries of one FAT width
+struct FATSpecialValues {
+    uint32_t reserved_min;
+    uint32_t bad;
+    uint32_t end_of_chain_min;
+};
+
+template <typename Entry>
+FATHistogram HistogramOfEntries(const ScanKernels<Entry> &kernels,
+                                const Entry *entries, size_t n,
+                                const FATSpecialValues &values);
+
+} // namespace cs5250
@@ -0,0 +1,168 @@
+// Microbenchmark of the FAT scan kernels: checks that every kernel set this
+// CPU can run agrees with the scalar one, then times each against a scalar
+// loop over FATMap::Lookup on a synthetic FAT.
+#include "fat_map.h"
+#include "fat_scan.h"
+#include <bit>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iterator>
+#include <random>
+#include <vector>
+
+using namespace cs5250;
+
+namespace {
+
+// chains of a few dozen clusters with free gaps between them
+template <typename Format>
+std::vector<typename Format::Entry> SyntheticFAT(uint32_t entries) {
+    std::vector<typename Format::Entry> fat(entries, 0);
+    std::mt19937 random(5250);
+    uint32_t cluster = 2;
+    while (cluster < entries) {
+        auto length = std::min<uint32_t>(random() % 64 + 1, entries - cluster);
+        for (uint32_t i = 0; i + 1 < length; ++i)
+            fat[cluster + i] = cluster + i + 1;
+        fat[cluster + length - 1] = Format::kEndOfChain;
+        cluster += length + random() % 16;
+    }
+    return fat;
+}
+
+// entries of every kind, with the 4 bits FAT32 ignores set at random, and
+// a length that leaves a tail shorter than one kernel call
+template <typename Format>
+std::vector<typename Format::Entry> MixedFAT(uint32_t entries) {
+    using Entry = typename Format::Entry;
+    const uint32_t values[] = {0,
+                               1,
+                               2,
+                               Format::kReservedMin - 1,
+                               Format::kReservedMin,
+                               Format::kBad,
+                               Format::kEndOfChainMin,
+                               Format::kEndOfChain};
+    std::mt19937 random(5250);
+    std::vector<Entry> fat(entries);
+    for (auto &entry : fat) {
+        uint32_t value = random() % 2 ? values[random() % std::size(values)]
+                                      : random() & Format::kEndOfChain;
+        if constexpr (sizeof(Entry) == 4)
+            value |= random() & 0xF0000000;
+        entry = static_cast<Entry>(value);
+    }
+    return fat;
+}
+
+// whether `kernels` give the same masks and histogram as the scalar kernels
+template <typename Format>
+bool Agrees(const ScanKernels<typename Format::Entry> &kernels,
+            const std::vector<typename Format::Entry> &fat) {
+    using Entry = typename Format::Entry;
+    auto &scalar = *ScanKernelsFor<Entry>(ScanISA::Scalar);
+    const uint32_t values[] = {0, 1, 2, Format::kReservedMin, Format::kBad,
+                               Format::kEndOfChainMin, Format::kEndOfChain};
+    for (size_t i = 0; i + 64 <= fat.size(); i += 64)
+        for (auto value : values) {
+            if (kernels.equal_mask(fat.data() + i, value) !=
+                scalar.equal_mask(fat.data() + i, value))
+                return false;
+            if (value != 0 &&
+                kernels.at_least_mask(fat.data() + i, value) !=
+                    scalar.at_least_mask(fat.data() + i, value))
+                return false;
+        }
+    FATSpecialValues special{Format::kReservedMin, Format::kBad,
+                             Format::kEndOfChainMin};
+    auto a = HistogramOfEntries(kernels, fat.data(), fat.size(), special);
+    auto b = HistogramOfEntries(scalar, fat.data(), fat.size(), special);
+    return a.free == b.free && a.used == b.used && a.reserved == b.reserved &&
+           a.bad == b.bad && a.end_of_chain == b.end_of_chain;
+}
+
+template <typename F> double Time(F &&function, int rounds) {
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < rounds; ++i)
+        function();
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    return elapsed.count() / rounds;
+}
+
+void Report(const char *width, const char *name, const char *scan,
+            double seconds, size_t entries, size_t entry_size) {
+    printf("%-6s %-8s %-10s %8.3f ns/entry %8.2f GB/s\n", width, name, scan,
+           seconds * 1e9 / entries, entries * entry_size / seconds / 1e9);
+}
+
+template <typename Format>
+void Bench(const char *width, uint32_t entries, int rounds) {
+    using Entry = typename Format::Entry;
+    auto fat = SyntheticFAT<Format>(entries);
+    auto bytes = fat.size() * sizeof(Entry);
+
+    // the baseline: one virtual Lookup per entry
+    FATMapOf<Format> map({reinterpret_cast<uint8_t *>(fat.data())}, bytes,
+                         entries);
+    volatile size_t sink = 0;
+    auto scalar = Time(
+        [&] {
+            size_t count = 0;
+            for (uint32_t i = 0; i < entries; ++i)
+                count += map.Lookup(i) == 0;
+            sink = count;
+        },
+        rounds);
+    Report(width, "lookup", "count", scalar, entries, sizeof(Entry));
+
+    FATSpecialValues values{Format::kReservedMin, Format::kBad,
+                            Format::kEndOfChainMin};
+    auto mixed = MixedFAT<Format>(64 * 1024 + 37);
+    for (auto isa : {ScanISA::Scalar, ScanISA::SSE2, ScanISA::AVX2,
+                     ScanISA::AVX512}) {
+        auto kernels = ScanKernelsFor<Entry>(isa);
+        if (!kernels)
+            continue;
+        if (!Agrees<Format>(*kernels, mixed)) {
+            fprintf(stderr, "%s %s kernels disagree with scalar\n", width,
+                    ScanISAName(isa));
+            exit(1);
+        }
+        // the free mask of every whole word, as the free bitmap is built
+        auto count = Time(
+            [&] {
+                size_t count = 0;
+                for (uint32_t i = 0; i + 64 <= entries; i += 64)
+                    count += std::popcount(
+                        kernels->equal_mask(fat.data() + i, 0));
+                sink = count;
+            },
+            rounds);
+        auto histogram = Time(
+            [&] {
+                sink = HistogramOfEntries(*kernels, fat.data(), entries, values)
+                           .used;
+            },
+            rounds);
+        Report(width, ScanISAName(isa), "count", count, entries,
+               sizeof(Entry));
+        Report(width, ScanISAName(isa), "histogram", histogram, entries,
+               sizeof(Entry));
+    }
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+    uint32_t entries = argc > 1 ? strtoul(argv[1], nullptr, 0) : 1 << 24;
+    int rounds = argc > 2 ? atoi(argv[2]) : 10;
+    if (entries < 2 || rounds < 1) {
+        fprintf(stderr, "Usage: %s [entries] [rounds]\n", argv[0]);
+        exit(1);
+    }
+    Bench<FAT32Format>("fat32", entries, rounds);
+    // a FAT16 cannot address more than 64K clusters
+    Bench<FAT16Format>("fat16", std::min<uint32_t>(entries, 0xFFF0), rounds);
+}
@@ -4,23 +4,44 @@
 #include <cstdint>
 
 namespace cs5250 {
+
+/*
+ * Free cluster count and next-free hint. FAT32 keeps them in the FSInfo
+ * sector; FAT12/16 have no such sector, so they are only kept in memory,
+ * counted from the FAT when the image is opened.
+ */
 class FSInfoManager {
   private:
     FSInfo *fs_info_;
+    uint32_t free_count_ = 0;
+    uint32_t next_free_ = 2;
 
   public:
     FSInfoManager(uint8_t *data) : fs_info_(reinterpret_cast<FSInfo *>(data)) {}
 
-    uint32_t GetFreeClusterCount() { return fs_info_->FSI_Free_Count; }
+    explicit FSInfoManager(uint32_t free_count)
+        : fs_info_(nullptr), free_count_(free_count) {}
+
+    uint32_t GetFreeClusterCount() {
+        return fs_info_ ? fs_info_->FSI_Free_Count : free_count_;
+    }
 
     void SetFreeClusterCount(uint32_t count) {
-        fs_info_->FSI_Free_Count = count;
+        if (fs_info_)
+            fs_info_->FSI_Free_Count = count;
+        else
+            free_count_ = count;
     }
 
-    uint32_t GetNextFreeCluster() { return fs_info_->FSI_Nxt_Free; }
+    uint32_t GetNextFreeCluster() {
+        return fs_info_ ? fs_info_->FSI_Nxt_Free : next_free_;
+    }
 
     void SetNextFreeCluster(uint32_t cluster) {
-        fs_info_->FSI_Nxt_Free = cluster;
+        if (fs_info_)
+            fs_info_->FSI_Nxt_Free = cluster;
+        else
+            next_free_ = cluster;
     }
 };
-} // namespace cs5250
\ No newline at end of file
+} // namespace cs5250
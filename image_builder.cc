@@ -0,0 +1,599 @@
+#include "image_builder.h"
+#include "fat.h"
+#include "fat_error.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <fcntl.h>
+#include <filesystem>
+#include <memory>
+#include <unordered_set>
+#include <unistd.h>
+
+namespace cs5250 {
+
+namespace {
+
+constexpr uint32_t kBytesPerSector = 512;
+constexpr uint32_t kReservedSectors = 32;
+constexpr uint32_t kNumberOfFATs = 2;
+// fewer clusters than this and the volume reads as FAT16
+constexpr uint32_t kMinimumClusters = 65525;
+constexpr uint32_t kMaximumClusters = 0x0FFFFFF5 - 2;
+constexpr uint32_t kEndOfChain = 0x0FFFFFFF;
+// a directory holds at most this many entries
+constexpr uint64_t kMaximumDirEntries = 65536;
+// the data region goes out in writes of this size
+constexpr uint64_t kWriteBytes = uint64_t(1) << 20;
+// files whose pieces are interleaved with each other when fragmenting
+constexpr size_t kInterleavedFiles = 4;
+
+uint8_t AttrOf(FATDirectory::Attr attr) { return static_cast<uint8_t>(attr); }
+
+uint32_t LongNameEntryCount(const std::string &name) {
+    return (name.size() + 12) / 13;
+}
+
+// sectors per FAT and data clusters of an image of `total_sectors`
+std::pair<uint32_t, uint64_t> Geometry(uint64_t total_sectors,
+                                       uint32_t sectors_per_cluster) {
+    uint32_t fat_sectors = 1;
+    while (true) {
+        auto fixed = kReservedSectors + uint64_t(kNumberOfFATs) * fat_sectors;
+        if (fixed >= total_sectors)
+            return {fat_sectors, 0};
+        auto clusters = (total_sectors - fixed) / sectors_per_cluster;
+        auto needed = ((clusters + 2) * 4 + kBytesPerSector - 1) /
+                      kBytesPerSector;
+        if (needed <= fat_sectors)
+            return {fat_sectors, clusters};
+        fat_sectors = needed;
+    }
+}
+
+// the 8.3 name of the `number`th entry of a directory: what can be kept of
+// the long name, with "~number" at the end of the base
+FATDirectory::ShortName ShortNameOf(const std::string &name,
+                                    uint32_t number) {
+    auto valid = [](char c) {
+        return isalnum(static_cast<unsigned char>(c)) ||
+               strchr("$%'-_@~`!(){}^#&", c) != nullptr;
+    };
+    auto dot = name.rfind('.');
+    std::string base, ext;
+    for (size_t i = 0; i < std::min(dot, name.size()); ++i)
+        if (valid(name[i]))
+            base += toupper(static_cast<unsigned char>(name[i]));
+    if (dot != std::string::npos)
+        for (size_t i = dot + 1; i < name.size() && ext.size() < 3; ++i)
+            if (valid(name[i]))
+                ext += toupper(static_cast<unsigned char>(name[i]));
+    if (base.empty())
+        base = "F";
+
+    auto tail = "~" + std::to_string(number);
+    base = base.substr(0, 8 - tail.size()) + tail;
+
+    FATDirectory::ShortName short_name;
+    memset(&short_name, ' ', sizeof(short_name));
+    memcpy(short_name.name, base.data(), base.size());
+    memcpy(short_name.ext, ext.data(), ext.size());
+    return short_name;
+}
+
+uint8_t CheckSumOf(const FATDirectory::ShortName &name) {
+    auto bytes = reinterpret_cast<const uint8_t *>(&name);
+    uint8_t sum = 0;
+    for (size_t i = 0; i < sizeof(name); ++i)
+        sum = ((sum & 1) ? 0x80 : 0) + (sum >> 1) + bytes[i];
+    return sum;
+}
+
+// the long name entries of `name`, in the order they are stored: the last
+// part of the name first
+void AppendLongName(std::vector<uint8_t> &dir, uint64_t &offset,
+                    const std::string &name, uint8_t checksum) {
+    auto count = LongNameEntryCount(name);
+    for (auto ord = count; ord >= 1; --ord) {
+        LongNameDirectory entry;
+        entry.LDIR_Ord = ord | (ord == count ? 0x40 : 0);
+        entry.LDIR_Attr = AttrOf(FATDirectory::Attr::LongName);
+        entry.LDIR_Type = 0;
+        entry.LDIR_Chksum = checksum;
+        entry.LDIR_FstClusLO = 0;
+
+        // a part shorter than 13 characters ends in a NUL, then padding
+        auto char_at = [&](size_t i) {
+            auto at = (ord - 1) * 13 + i;
+            if (at < name.size())
+                return LongNameDirectory::UnicodeChar(name[at]);
+            if (at == name.size())
+                return LongNameDirectory::UnicodeChar(0);
+            return LongNameDirectory::UnicodeChar(0xFF, 0xFF);
+        };
+        for (size_t i = 0; i < 5; ++i)
+            entry.LDIR_Name1.values[i] = char_at(i);
+        for (size_t i = 0; i < 6; ++i)
+            entry.LDIR_Name2.values[i] = char_at(5 + i);
+        for (size_t i = 0; i < 2; ++i)
+            entry.LDIR_Name3.values[i] = char_at(11 + i);
+        memcpy(dir.data() + offset, &entry, sizeof(entry));
+        offset += sizeof(entry);
+    }
+}
+
+void SetFirstCluster(FATDirectory &entry, uint32_t cluster) {
+    entry.DIR_FstClusHI = cluster >> 16;
+    entry.DIR_FstClusLO = cluster & 0xffff;
+}
+
+// the data region, appended to in large writes
+class Output {
+  private:
+    int fd_;
+    uint64_t offset_;
+    std::vector<uint8_t> buffer_;
+    size_t used_ = 0;
+
+  public:
+    Output(int fd, uint64_t offset)
+        : fd_(fd), offset_(offset), buffer_(kWriteBytes) {}
+
+    // room for up to `bytes` at the end, to be filled and then committed
+    std::pair<uint8_t *, uint64_t> Reserve(uint64_t bytes) {
+        if (used_ == buffer_.size())
+            Flush();
+        return {buffer_.data() + used_,
+                std::min<uint64_t>(bytes, buffer_.size() - used_)};
+    }
+
+    void Commit(uint64_t bytes) { used_ += bytes; }
+
+    void Append(const uint8_t *data, uint64_t bytes) {
+        while (bytes > 0) {
+            auto [to, room] = Reserve(bytes);
+            if (data)
+                memcpy(to, data, room);
+            else
+                memset(to, 0, room);
+            Commit(room);
+            if (data)
+                data += room;
+            bytes -= room;
+        }
+    }
+
+    void Flush() {
+        for (size_t done = 0; done < used_;) {
+            auto written = pwrite(fd_, buffer_.data() + done, used_ - done,
+                                  offset_ + done);
+            if (written == -1 && errno == EINTR)
+                continue;
+            if (written <= 0)
+                throw FATError(std::string("failed to write the image: ") +
+                               strerror(errno));
+            done += written;
+        }
+        offset_ += used_;
+        used_ = 0;
+    }
+};
+
+void WriteAll(int fd, const uint8_t *data, uint64_t bytes, uint64_t offset) {
+    while (bytes > 0) {
+        auto written = pwrite(fd, data, bytes, offset);
+        if (written == -1 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            throw FATError(std::string("failed to write the image: ") +
+                           strerror(errno));
+        data += written;
+        offset += written;
+        bytes -= written;
+    }
+}
+
+// a local file read front to back as the image is written, open only
+// while it is being read
+ImageBuilder::Source LocalFile(const std::string &path, uint64_t size) {
+    struct File {
+        std::string path;
+        int fd = -1;
+        ~File() {
+            if (fd != -1)
+                close(fd);
+        }
+    };
+    auto file = std::make_shared<File>();
+    file->path = path;
+    return [file, size](uint64_t offset, uint8_t *data, uint64_t bytes) {
+        if (file->fd == -1) {
+            file->fd = open(file->path.c_str(), O_RDONLY);
+            if (file->fd == -1)
+                return false;
+            posix_fadvise(file->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        }
+        for (uint64_t done = 0; done < bytes;) {
+            auto got =
+                pread(file->fd, data + done, bytes - done, offset + done);
+            if (got == -1 && errno == EINTR)
+                continue;
+            // a file that shrank since it was added
+            if (got <= 0)
+                return false;
+            done += got;
+        }
+        if (offset + bytes == size) {
+            close(file->fd);
+            file->fd = -1;
+        }
+        return true;
+    };
+}
+
+} // namespace
+
+ImageBuilder::ImageBuilder() {
+    entries_.push_back({"", kRoot, true, 0, nullptr, {}});
+}
+
+uint32_t ImageBuilder::Add(uint32_t parent, Entry entry) {
+    if (parent >= entries_.size())
+        throw FATError("no directory " + std::to_string(parent));
+    if (!entries_[parent].is_dir)
+        throw FATError("not a directory: " + PathOf(parent));
+    if (entry.name.empty() || entry.name == "." || entry.name == ".." ||
+        entry.name.size() > 255 ||
+        entry.name.find('/') != std::string::npos)
+        throw FATError("invalid name " + entry.name);
+    uint32_t id = entries_.size();
+    entries_.push_back(std::move(entry));
+    entries_[parent].children.push_back(id);
+    return id;
+}
+
+uint32_t ImageBuilder::AddDir(uint32_t parent, const std::string &name) {
+    ++dir_count_;
+    return Add(parent, {name, parent, true, 0, nullptr, {}});
+}
+
+void ImageBuilder::AddFile(uint32_t parent, const std::string &name,
+                           uint64_t size, Source source) {
+    if (size > UINT32_MAX)
+        throw FATError("file " + name + " is too large for FAT32");
+    Add(parent, {name, parent, false, size, std::move(source), {}});
+}
+
+void ImageBuilder::AddLocalDir(uint32_t dir, const std::string &local) {
+    namespace fs = std::filesystem;
+    std::vector<fs::directory_entry> items;
+    try {
+        for (auto &item : fs::directory_iterator(local))
+            if (item.is_directory() || item.is_regular_file())
+                items.push_back(item);
+        // the same tree makes the same image
+        std::sort(items.begin(), items.end());
+        for (auto &item : items) {
+            auto name = item.path().filename().string();
+            if (item.is_directory())
+                AddLocalDir(AddDir(dir, name), item.path().string());
+            else
+                AddFile(dir, name, item.file_size(),
+                        LocalFile(item.path().string(), item.file_size()));
+        }
+    } catch (const fs::filesystem_error &e) {
+        throw FATError(e.what());
+    }
+}
+
+std::string ImageBuilder::PathOf(uint32_t id) const {
+    if (id == kRoot)
+        return "/";
+    std::string path;
+    for (; id != kRoot; id = entries_[id].parent)
+        path = "/" + entries_[id].name + path;
+    return path;
+}
+
+uint64_t ImageBuilder::DirEntryCount(uint32_t dir) const {
+    uint64_t count = dir == kRoot ? 0 : 2;
+    for (auto child : entries_[dir].children)
+        count += LongNameEntryCount(entries_[child].name) + 1;
+    return count;
+}
+
+std::vector<uint32_t>
+ImageBuilder::ClusterCounts(uint32_t bytes_per_cluster) const {
+    std::vector<uint32_t> counts(entries_.size());
+    for (uint32_t id = 0; id < entries_.size(); ++id) {
+        auto &entry = entries_[id];
+        // a directory takes a cluster even when empty, a file only when not
+        auto bytes = entry.is_dir
+                         ? std::max<uint64_t>(DirEntryCount(id), 1) *
+                               sizeof(FATDirectory)
+                         : entry.size;
+        counts[id] = (bytes + bytes_per_cluster - 1) / bytes_per_cluster;
+    }
+    return counts;
+}
+
+uint64_t ImageBuilder::MinimumBytes(uint32_t bytes_per_cluster) const {
+    uint64_t clusters = 0;
+    for (auto count : ClusterCounts(bytes_per_cluster))
+        clusters += count;
+    clusters = std::max<uint64_t>(clusters, kMinimumClusters);
+    uint64_t fat_sectors =
+        ((clusters + 2) * 4 + kBytesPerSector - 1) / kBytesPerSector;
+    auto bytes = (kReservedSectors + kNumberOfFATs * fat_sectors) *
+                     kBytesPerSector +
+                 clusters * bytes_per_cluster;
+    // the FAT that Write settles on for a size can be a sector or two
+    // larger than the one needed, taking clusters from the data region
+    while (Geometry(bytes / kBytesPerSector, bytes_per_cluster /
+                                                 kBytesPerSector)
+               .second < clusters)
+        bytes += bytes_per_cluster;
+    return bytes;
+}
+
+uint32_t ImageBuilder::DefaultClusterBytes() const {
+    // the sizes Microsoft's format tools use for FAT32 volumes
+    auto bytes = MinimumBytes(kBytesPerSector);
+    if (bytes <= uint64_t(260) << 20)
+        return 512;
+    if (bytes <= uint64_t(8) << 30)
+        return 4096;
+    if (bytes <= uint64_t(16) << 30)
+        return 8192;
+    if (bytes <= uint64_t(32) << 30)
+        return 16384;
+    return 32768;
+}
+
+std::vector<uint8_t>
+ImageBuilder::DirContents(uint32_t dir, uint64_t bytes,
+                          const std::vector<uint32_t> &first_clusters) const {
+    std::vector<uint8_t> contents(bytes, 0);
+    uint64_t offset = 0;
+    auto append = [&](const FATDirectory &entry) {
+        memcpy(contents.data() + offset, &entry, sizeof(entry));
+        offset += sizeof(entry);
+    };
+
+    // "." and "..", the latter with cluster 0 when the parent is the root
+    if (dir != kRoot) {
+        auto parent = entries_[dir].parent;
+        uint32_t dot_clusters[2] = {
+            first_clusters[dir], parent == kRoot ? 0 : first_clusters[parent]};
+        for (auto i = 0; i < 2; ++i) {
+            FATDirectory dot;
+            memset(&dot, 0, sizeof(dot));
+            memset(&dot.DIR_Name, ' ', sizeof(dot.DIR_Name));
+            memset(dot.DIR_Name.name, '.', i + 1);
+            dot.DIR_Attr = AttrOf(FATDirectory::Attr::Directory);
+            SetFirstCluster(dot, dot_clusters[i]);
+            append(dot);
+        }
+    }
+
+    uint32_t number = 0;
+    std::unordered_set<std::string> names;
+    for (auto child : entries_[dir].children) {
+        auto &entry = entries_[child];
+        if (!names.insert(entry.name).second)
+            throw FATError("duplicate name " + PathOf(child));
+
+        FATDirectory short_entry;
+        memset(&short_entry, 0, sizeof(short_entry));
+        short_entry.DIR_Name = ShortNameOf(entry.name, ++number);
+        short_entry.DIR_Attr = AttrOf(
+            entry.is_dir ? FATDirectory::Attr::Directory
+                         : FATDirectory::Attr::Archive);
+        SetFirstCluster(short_entry, first_clusters[child]);
+        short_entry.DIR_FileSize = entry.size;
+
+        AppendLongName(contents, offset, entry.name,
+                       CheckSumOf(short_entry.DIR_Name));
+        append(short_entry);
+    }
+    return contents;
+}
+
+uint64_t ImageBuilder::Write(const std::string &path,
+                             const ImageLayout &layout) const {
+    auto bytes_per_cluster = layout.bytes_per_cluster;
+    if (bytes_per_cluster < kBytesPerSector || bytes_per_cluster > 32768 ||
+        (bytes_per_cluster & (bytes_per_cluster - 1)) != 0)
+        throw FATError("invalid cluster size " +
+                       std::to_string(bytes_per_cluster));
+    auto sectors_per_cluster = bytes_per_cluster / kBytesPerSector;
+
+    auto image_bytes = layout.image_bytes != 0
+                           ? layout.image_bytes
+                           : MinimumBytes(bytes_per_cluster);
+    auto total_sectors = image_bytes / kBytesPerSector;
+    if (total_sectors > UINT32_MAX)
+        throw FATError("image is too large for FAT32");
+    auto [fat_sectors, cluster_count] =
+        Geometry(total_sectors, sectors_per_cluster);
+    if (cluster_count < kMinimumClusters)
+        throw FATError("image is too small for FAT32, at least " +
+                       std::to_string(MinimumBytes(bytes_per_cluster)) +
+                       " bytes are needed");
+    if (cluster_count > kMaximumClusters)
+        throw FATError("image has too many clusters for FAT32");
+
+    for (uint32_t id = 0; id < entries_.size(); ++id)
+        if (entries_[id].is_dir && DirEntryCount(id) > kMaximumDirEntries)
+            throw FATError("too many entries in " + PathOf(id));
+
+    // directories first, breadth first, so a walk of the tree reads the
+    // image front to back
+    auto counts = ClusterCounts(bytes_per_cluster);
+    std::vector<uint32_t> dirs, files;
+    std::deque<uint32_t> queue{kRoot};
+    while (!queue.empty()) {
+        auto dir = queue.front();
+        queue.pop_front();
+        dirs.push_back(dir);
+        for (auto child : entries_[dir].children)
+            if (entries_[child].is_dir)
+                queue.push_back(child);
+    }
+    for (uint32_t id = 0; id < entries_.size(); ++id)
+        if (!entries_[id].is_dir && counts[id] != 0)
+            files.push_back(id);
+
+    std::vector<Piece> pieces;
+    uint64_t next_cluster = 2;
+    auto allocate = [&](uint32_t id, uint32_t count) {
+        pieces.push_back({id, static_cast<uint32_t>(next_cluster), count});
+        next_cluster += count;
+    };
+    for (auto dir : dirs)
+        allocate(dir, counts[dir]);
+    if (layout.fragment_clusters == 0) {
+        for (auto file : files)
+            allocate(file, counts[file]);
+    } else {
+        // a piece of each file of a group in turn, until the group is done
+        for (size_t group = 0; group < files.size();
+             group += kInterleavedFiles) {
+            auto end = std::min(files.size(), group + kInterleavedFiles);
+            std::vector<uint32_t> left(files.begin() + group,
+                                       files.begin() + end);
+            for (auto &file : left)
+                file = counts[file];
+            for (bool any = true; any;) {
+                any = false;
+                for (auto i = group; i < end; ++i) {
+                    auto &remaining = left[i - group];
+                    if (remaining == 0)
+                        continue;
+                    auto count =
+                        std::min(remaining, layout.fragment_clusters);
+                    allocate(files[i], count);
+                    remaining -= count;
+                    any = true;
+                }
+            }
+        }
+    }
+    auto used = next_cluster - 2;
+    if (used > cluster_count)
+        throw FATError("image is too small, at least " +
+                       std::to_string(MinimumBytes(bytes_per_cluster)) +
+                       " bytes are needed");
+
+    // chain the pieces of every entry in the order they were allocated
+    std::vector<uint32_t> fat(cluster_count + 2, 0);
+    fat[0] = 0x0FFFFFF8;
+    fat[1] = kEndOfChain;
+    std::vector<uint32_t> first_clusters(entries_.size(), 0);
+    std::vector<uint32_t> last_clusters(entries_.size(), 0);
+    for (auto &piece : pieces) {
+        if (last_clusters[piece.entry] != 0)
+            fat[last_clusters[piece.entry]] = piece.first_cluster;
+        else
+            first_clusters[piece.entry] = piece.first_cluster;
+        for (uint32_t i = 0; i + 1 < piece.cluster_count; ++i)
+            fat[piece.first_cluster + i] = piece.first_cluster + i + 1;
+        last_clusters[piece.entry] =
+            piece.first_cluster + piece.cluster_count - 1;
+        fat[last_clusters[piece.entry]] = kEndOfChain;
+    }
+
+    // boot sector and FSInfo, each with its backup
+    std::vector<uint8_t> reserved(kReservedSectors * kBytesPerSector, 0);
+    auto bpb = reinterpret_cast<BPB *>(reserved.data());
+    memcpy(bpb->BS_jmpBoot, "\xEB\x58\x90", 3);
+    memcpy(bpb->BS_OEMName, "MSWIN4.1", 8);
+    bpb->BPB_BytsPerSec = kBytesPerSector;
+    bpb->BPB_SecPerClus = sectors_per_cluster;
+    bpb->BPB_RsvdSecCnt = kReservedSectors;
+    bpb->BPB_NumFATs = kNumberOfFATs;
+    bpb->BPB_Media = 0xF8;
+    bpb->BPB_SecPerTrk = 63;
+    bpb->BPB_NumHeads = 255;
+    bpb->BPB_TotSec32 = total_sectors;
+    bpb->fat32.BPB_FATSz32 = fat_sectors;
+    bpb->fat32.BPB_RootClus = first_clusters[kRoot];
+    bpb->fat32.BPB_FSInfo = 1;
+    bpb->fat32.BPB_BkBootSec = 6;
+    bpb->fat32.BS_DrvNum = 0x80;
+    bpb->fat32.BS_BootSig = 0x29;
+    uint32_t volume_id = time(nullptr);
+    memcpy(bpb->fat32.BS_VolID, &volume_id, sizeof(volume_id));
+    memcpy(bpb->fat32.BS_VolLab, "NO NAME    ", 11);
+    memcpy(bpb->fat32.BS_FilSysType, "FAT32   ", 8);
+    bpb->Signature_word = 0xAA55;
+
+    auto fs_info =
+        reinterpret_cast<FSInfo *>(reserved.data() + kBytesPerSector);
+    fs_info->FSI_LeadSig = 0x41615252;
+    fs_info->FSI_StrucSig = 0x61417272;
+    fs_info->FSI_Free_Count = cluster_count - used;
+    fs_info->FSI_Nxt_Free = used < cluster_count ? next_cluster : 0xFFFFFFFF;
+    fs_info->FSI_TrailSig = 0xAA550000;
+    memcpy(reserved.data() + 6 * kBytesPerSector, reserved.data(),
+           2 * kBytesPerSector);
+
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+        throw FATError("failed to create " + path + ": " + strerror(errno));
+    try {
+        // what is not written reads as zeros: free clusters and the slack
+        // after the last file
+        if (ftruncate(fd, total_sectors * kBytesPerSector) == -1)
+            throw FATError("failed to size " + path + ": " + strerror(errno));
+
+        WriteAll(fd, reserved.data(), reserved.size(), 0);
+        // the entries past the last cluster are left zero
+        std::vector<uint8_t> fat_bytes(uint64_t(fat_sectors) *
+                                       kBytesPerSector);
+        memcpy(fat_bytes.data(), fat.data(), fat.size() * sizeof(uint32_t));
+        for (uint32_t copy = 0; copy < kNumberOfFATs; ++copy)
+            WriteAll(fd, fat_bytes.data(), fat_bytes.size(),
+                     reserved.size() + copy * fat_bytes.size());
+
+        Output data(fd, reserved.size() + kNumberOfFATs * fat_bytes.size());
+        // how far into each file its pieces so far reach
+        std::vector<uint64_t> written(entries_.size(), 0);
+        for (auto &piece : pieces) {
+            auto &entry = entries_[piece.entry];
+            uint64_t piece_bytes =
+                uint64_t(piece.cluster_count) * bytes_per_cluster;
+            if (entry.is_dir) {
+                auto contents =
+                    DirContents(piece.entry, piece_bytes, first_clusters);
+                data.Append(contents.data(), contents.size());
+                continue;
+            }
+            auto &offset = written[piece.entry];
+            auto bytes = std::min(piece_bytes, entry.size - offset);
+            for (uint64_t done = 0; done < bytes;) {
+                auto [to, room] = data.Reserve(bytes - done);
+                if (!entry.source(offset + done, to, room))
+                    throw FATError("failed to read " + PathOf(piece.entry));
+                data.Commit(room);
+                done += room;
+            }
+            data.Append(nullptr, piece_bytes - bytes);
+            offset += bytes;
+        }
+        data.Flush();
+    } catch (const FATError &) {
+        close(fd);
+        unlink(path.c_str());
+        throw;
+    }
+    if (close(fd) == -1) {
+        unlink(path.c_str());
+        throw FATError("failed to write " + path);
+    }
+    return total_sectors * kBytesPerSector;
+}
+
+} // namespace cs5250
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace cs5250 {
+
+// how an ImageBuilder lays out the image it writes
+struct ImageLayout {
+    // a power of two from 512 to 32K
+    uint32_t bytes_per_cluster = 4096;
+
+    // size of the image, 0 for the smallest FAT32 image that holds the tree
+    uint64_t image_bytes = 0;
+
+    // cut every file into pieces of this many clusters, the pieces of a few
+    // files at a time interleaved; 0 keeps each file contiguous
+    uint32_t fragment_clusters = 0;
+};
+
+/*
+ * A FAT32 image planned whole before any of it is written.
+ *
+ * Directories and files are added as a tree. Write then gives each of them
+ * its clusters at once (directories first, breadth first, then files in
+ * the order they were added) and writes the image front to back in one
+ * pass: reserved sectors, both FATs, then the data region. Every entry gets
+ * a long name and an 8.3 name made unique by a numeric tail.
+ *
+ * Failures are thrown as FATError.
+ */
+class ImageBuilder {
+  public:
+    // fill `bytes` of `data` with the bytes of a file from `offset` on;
+    // false if they cannot be had
+    using Source =
+        std::function<bool(uint64_t offset, uint8_t *data, uint64_t bytes)>;
+
+    // the root directory, parent of the first entries added
+    static constexpr uint32_t kRoot = 0;
+
+    ImageBuilder();
+
+    // add an empty directory to `parent`; its id, for adding entries to it
+    uint32_t AddDir(uint32_t parent, const std::string &name);
+
+    // add a file of `size` bytes to `parent`, read from `source` as it is
+    // written
+    void AddFile(uint32_t parent, const std::string &name, uint64_t size,
+                 Source source);
+
+    // add everything under the local directory `local` to `dir`: its
+    // directories and regular files, in name order, each file read when
+    // the image is written; other kinds of files are skipped
+    void AddLocalDir(uint32_t dir, const std::string &local);
+
+    // the size of the smallest FAT32 image with clusters of
+    // `bytes_per_cluster` that holds the tree
+    uint64_t MinimumBytes(uint32_t bytes_per_cluster) const;
+
+    // the cluster size mkfs would pick for a FAT32 volume holding the tree
+    uint32_t DefaultClusterBytes() const;
+
+    size_t DirCount() const { return dir_count_; }
+    size_t FileCount() const { return entries_.size() - dir_count_; }
+
+    // write the image to `path`, replacing the file there, and return its
+    // size; the file is removed again if writing fails
+    uint64_t Write(const std::string &path, const ImageLayout &layout) const;
+
+  private:
+    struct Entry {
+        std::string name;
+        uint32_t parent;
+        bool is_dir;
+        uint64_t size;
+        Source source;
+        std::vector<uint32_t> children;
+    };
+
+    // where a run of clusters of an entry sits
+    struct Piece {
+        uint32_t entry;
+        uint32_t first_cluster;
+        uint32_t cluster_count;
+    };
+
+    std::vector<Entry> entries_;
+    size_t dir_count_ = 1;
+
+    uint32_t Add(uint32_t parent, Entry entry);
+
+    // the path of an entry, for messages
+    std::string PathOf(uint32_t id) const;
+
+    // directory entries that `dir` takes, "." and ".." included
+    uint64_t DirEntryCount(uint32_t dir) const;
+
+    // clusters each entry takes with clusters of `bytes_per_cluster`
+    std::vector<uint32_t> ClusterCounts(uint32_t bytes_per_cluster) const;
+
+    // the contents of `dir`, given the first cluster of every entry
+    std::vector<uint8_t>
+    DirContents(uint32_t dir, uint64_t bytes,
+                const std::vector<uint32_t> &first_clusters) const;
+};
+
+} // namespace cs5250
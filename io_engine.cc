@@ -0,0 +1,569 @@
+#include "io_engine.h"
+#include "fat_error.h"
+#include "thread_pool.h"
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <fcntl.h>
+#include <mutex>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <vector>
+
+#ifdef FAT_HAVE_IO_URING
+#include <linux/io_uring.h>
+#endif
+
+namespace cs5250 {
+
+IOEngine::Done IOEngine::Join(size_t count, Done done) {
+    if (count == 0) {
+        done(true);
+        return [](bool) {};
+    }
+    struct State {
+        std::atomic<size_t> left;
+        std::atomic<bool> ok{true};
+        Done done;
+    };
+    auto state = std::make_shared<State>();
+    state->left = count;
+    state->done = std::move(done);
+    return [state](bool ok) {
+        if (!ok)
+            state->ok = false;
+        if (--state->left == 0)
+            state->done(state->ok);
+    };
+}
+
+void IOEngine::Finish(const std::shared_ptr<Group> &group, bool ok,
+                      std::atomic<bool> &any_failed) {
+    if (!ok) {
+        group->failed = true;
+        any_failed = true;
+    }
+    if (--group->pending == 0)
+        group->done(!group->failed);
+}
+
+namespace {
+
+// the thread engine runs a worker per chunk in flight, since each one
+// mostly waits on a blocking call, but no more than this many
+constexpr unsigned kMaxCopyThreads = 64;
+
+// exactly `bytes` at `offset`, retried across short transfers
+bool PreadExact(int fd, uint8_t *data, uint64_t bytes, uint64_t offset) {
+    while (bytes > 0) {
+        auto got = pread(fd, data, bytes, offset);
+        if (got == -1 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            return false;
+        data += got;
+        offset += got;
+        bytes -= got;
+    }
+    return true;
+}
+
+bool PwriteExact(int fd, const uint8_t *data, uint64_t bytes,
+                 uint64_t offset) {
+    while (bytes > 0) {
+        auto written = pwrite(fd, data, bytes, offset);
+        if (written == -1 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return false;
+        data += written;
+        offset += written;
+        bytes -= written;
+    }
+    return true;
+}
+
+/*
+ * The fallback: every chunk is a blocking call on a pool thread, with no
+ * more chunks queued on the pool than the queue depth.
+ */
+class ThreadEngine : public IOEngine {
+  private:
+    ThreadPool pool_;
+    unsigned depth_;
+    std::mutex mutex_;
+    std::condition_variable slot_free_;
+    unsigned in_flight_ = 0;
+    std::atomic<bool> failed_{false};
+    // cleared once the kernel cannot copy between two of the files
+    std::atomic<bool> use_copy_range_{true};
+
+    // run `work` for a chunk of `group` once a slot is free
+    template <typename F>
+    void Queue(const std::shared_ptr<Group> &group, F &&work) {
+        {
+            std::unique_lock lock(mutex_);
+            slot_free_.wait(lock, [this] { return in_flight_ < depth_; });
+            ++in_flight_;
+        }
+        ++group->pending;
+        pool_.Submit([this, group, work = std::forward<F>(work)] {
+            Finish(group, work(), failed_);
+            {
+                std::lock_guard lock(mutex_);
+                --in_flight_;
+            }
+            slot_free_.notify_one();
+        });
+    }
+
+    // queue `function(at, bytes)` for every chunk of an operation, each
+    // task with its own copy of it
+    template <typename F>
+    void Split(uint64_t bytes, Done done, const F &function) {
+        auto group = std::make_shared<Group>(std::move(done));
+        for (uint64_t at = 0; at < bytes; at += kChunkBytes) {
+            auto chunk = std::min(kChunkBytes, bytes - at);
+            Queue(group, [function, at, chunk] { return function(at, chunk); });
+        }
+        Finish(group, true, failed_);
+    }
+
+    bool CopyChunk(int from, uint64_t from_offset, int to, uint64_t to_offset,
+                   uint64_t bytes) {
+        // in kernel when both files allow it
+        while (bytes > 0 && use_copy_range_) {
+            loff_t in = from_offset, out = to_offset;
+            auto copied = copy_file_range(from, &in, to, &out, bytes, 0);
+            if (copied > 0) {
+                from_offset += copied;
+                to_offset += copied;
+                bytes -= copied;
+            } else if (copied == 0) {
+                // the source ended early: this copy is short, not the
+                // files unfit for copy_file_range
+                return false;
+            } else if (errno == EINTR) {
+                continue;
+            } else if (errno == EXDEV || errno == ENOSYS || errno == EINVAL ||
+                       errno == EOPNOTSUPP) {
+                use_copy_range_ = false;
+            } else {
+                return false;
+            }
+        }
+        if (bytes == 0)
+            return true;
+        thread_local std::unique_ptr<uint8_t[]> buffer(
+            new uint8_t[kChunkBytes]);
+        return PreadExact(from, buffer.get(), bytes, from_offset) &&
+               PwriteExact(to, buffer.get(), bytes, to_offset);
+    }
+
+  public:
+    ThreadEngine(unsigned threads, unsigned depth)
+        : pool_(threads), depth_(depth) {}
+
+    ~ThreadEngine() override { pool_.Wait(); }
+
+    const char *Name() const override { return "threads"; }
+
+    void Read(int fd, uint64_t offset, uint8_t *data, uint64_t bytes,
+              Done done) override {
+        Split(bytes, std::move(done), [=](uint64_t at, uint64_t chunk) {
+            return PreadExact(fd, data + at, chunk, offset + at);
+        });
+    }
+
+    void Write(int fd, uint64_t offset, const uint8_t *data, uint64_t bytes,
+               Done done) override {
+        Split(bytes, std::move(done), [=](uint64_t at, uint64_t chunk) {
+            return PwriteExact(fd, data + at, chunk, offset + at);
+        });
+    }
+
+    void Copy(int from, uint64_t from_offset, int to, uint64_t to_offset,
+              uint64_t bytes, Done done) override {
+        Split(bytes, std::move(done),
+              [=, this](uint64_t at, uint64_t chunk) {
+                  return CopyChunk(from, from_offset + at, to, to_offset + at,
+                                   chunk);
+              });
+    }
+
+    bool Wait() override {
+        pool_.Wait();
+        return !failed_.exchange(false);
+    }
+};
+
+#ifdef FAT_HAVE_IO_URING
+
+/*
+ * io_uring through its system calls: every slot of the queue carries one
+ * chunk and has at most one request in the ring at a time, so neither ring
+ * can overflow. Requests are only handed to the kernel when a slot or the
+ * end of the run is waited for, in one call for all of them.
+ */
+class UringEngine : public IOEngine {
+  private:
+    struct Chunk {
+        enum class Kind { Read, Write, CopyRead, CopyWrite } kind;
+        int fd;
+        int to;
+        uint64_t offset;
+        uint64_t to_offset;
+        uint8_t *data;
+        // left of the chunk
+        uint64_t bytes;
+        // a copy's bytes in the slot's buffer, and how many of them are
+        // written
+        uint64_t held;
+        uint64_t written;
+        std::shared_ptr<Group> group;
+    };
+
+    int ring_fd_ = -1;
+    void *sq_ring_ = MAP_FAILED;
+    void *cq_ring_ = MAP_FAILED;
+    size_t sq_ring_bytes_ = 0;
+    size_t cq_ring_bytes_ = 0;
+    io_uring_sqe *sqes_ = static_cast<io_uring_sqe *>(MAP_FAILED);
+    size_t sqes_bytes_ = 0;
+    unsigned *sq_tail_, *sq_mask_, *sq_array_;
+    unsigned *cq_head_, *cq_tail_, *cq_mask_;
+    io_uring_cqe *cqes_;
+    // requests written to the ring but not yet handed to the kernel
+    unsigned queued_ = 0;
+
+    std::vector<Chunk> slots_;
+    std::vector<unsigned> free_;
+    // a buffer per slot for copies, registered with the ring if it can be
+    std::unique_ptr<uint8_t[]> buffers_;
+    bool fixed_buffers_ = false;
+    // the image file, registered as fixed file 0
+    int fixed_fd_ = -1;
+    std::atomic<bool> failed_{false};
+
+    uint8_t *BufferOf(unsigned slot) {
+        return buffers_.get() + uint64_t(slot) * kChunkBytes;
+    }
+
+    void Push(unsigned slot);
+    void Complete(unsigned slot, int result);
+    void Enter(unsigned wait);
+    unsigned AcquireSlot();
+
+    template <typename F> void Split(uint64_t bytes, Done done, F &&fill) {
+        auto group = std::make_shared<Group>(std::move(done));
+        for (uint64_t at = 0; at < bytes; at += kChunkBytes) {
+            auto slot = AcquireSlot();
+            auto &chunk = slots_[slot];
+            chunk = {};
+            chunk.bytes = std::min(kChunkBytes, bytes - at);
+            chunk.group = group;
+            fill(chunk, at);
+            ++group->pending;
+            Push(slot);
+        }
+        Finish(group, true, failed_);
+    }
+
+  public:
+    UringEngine() = default;
+    ~UringEngine() override;
+
+    // the ring with `depth` slots, false if the kernel refuses it
+    bool Open(unsigned depth, int image_fd);
+
+    const char *Name() const override { return "io_uring"; }
+
+    void Read(int fd, uint64_t offset, uint8_t *data, uint64_t bytes,
+              Done done) override {
+        Split(bytes, std::move(done), [=](Chunk &chunk, uint64_t at) {
+            chunk.kind = Chunk::Kind::Read;
+            chunk.fd = fd;
+            chunk.offset = offset + at;
+            chunk.data = data + at;
+        });
+    }
+
+    void Write(int fd, uint64_t offset, const uint8_t *data, uint64_t bytes,
+               Done done) override {
+        Split(bytes, std::move(done), [=](Chunk &chunk, uint64_t at) {
+            chunk.kind = Chunk::Kind::Write;
+            chunk.fd = fd;
+            chunk.offset = offset + at;
+            chunk.data = const_cast<uint8_t *>(data) + at;
+        });
+    }
+
+    void Copy(int from, uint64_t from_offset, int to, uint64_t to_offset,
+              uint64_t bytes, Done done) override;
+
+    bool Wait() override {
+        while (free_.size() < slots_.size())
+            Enter(1);
+        return !failed_.exchange(false);
+    }
+};
+
+bool UringEngine::Open(unsigned depth, int image_fd) {
+    io_uring_params params{};
+    ring_fd_ = syscall(__NR_io_uring_setup, depth, &params);
+    if (ring_fd_ < 0)
+        return false;
+
+    sq_ring_bytes_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_bytes_ =
+        params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    // both rings share one mapping on any recent kernel
+    auto single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap)
+        sq_ring_bytes_ = cq_ring_bytes_ =
+            std::max(sq_ring_bytes_, cq_ring_bytes_);
+    sq_ring_ = mmap(nullptr, sq_ring_bytes_, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+    if (sq_ring_ == MAP_FAILED)
+        return false;
+    if (single_mmap) {
+        cq_ring_ = sq_ring_;
+    } else {
+        cq_ring_ = mmap(nullptr, cq_ring_bytes_, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring_fd_,
+                        IORING_OFF_CQ_RING);
+        if (cq_ring_ == MAP_FAILED)
+            return false;
+    }
+    sqes_bytes_ = params.sq_entries * sizeof(io_uring_sqe);
+    sqes_ = static_cast<io_uring_sqe *>(
+        mmap(nullptr, sqes_bytes_, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES));
+    if (sqes_ == MAP_FAILED)
+        return false;
+
+    auto sq = static_cast<uint8_t *>(sq_ring_);
+    sq_tail_ = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+    sq_mask_ = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+    sq_array_ = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+    auto cq = static_cast<uint8_t *>(cq_ring_);
+    cq_head_ = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+    cq_mask_ = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+
+    slots_.resize(std::min(depth, params.sq_entries));
+    for (unsigned slot = slots_.size(); slot-- > 0;)
+        free_.push_back(slot);
+
+    // the image takes part in nearly every request; it is still used
+    // unregistered if this fails
+    if (syscall(__NR_io_uring_register, ring_fd_, IORING_REGISTER_FILES,
+                &image_fd, 1) == 0)
+        fixed_fd_ = image_fd;
+    return true;
+}
+
+UringEngine::~UringEngine() {
+    // the kernel may still be writing into the buffers
+    if (ring_fd_ >= 0 && sqes_ != MAP_FAILED) {
+        try {
+            Wait();
+        } catch (const FATError &) {
+        }
+    }
+    if (sqes_ != MAP_FAILED)
+        munmap(sqes_, sqes_bytes_);
+    if (cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_)
+        munmap(cq_ring_, cq_ring_bytes_);
+    if (sq_ring_ != MAP_FAILED)
+        munmap(sq_ring_, sq_ring_bytes_);
+    if (ring_fd_ >= 0)
+        close(ring_fd_);
+}
+
+void UringEngine::Copy(int from, uint64_t from_offset, int to,
+                       uint64_t to_offset, uint64_t bytes, Done done) {
+    if (!buffers_) {
+        buffers_.reset(new uint8_t[slots_.size() * kChunkBytes]);
+        // registered buffers are pinned once instead of on every request;
+        // plain reads and writes do when the memlock limit is too low
+        std::vector<iovec> iovecs(slots_.size());
+        for (unsigned slot = 0; slot < slots_.size(); ++slot)
+            iovecs[slot] = {BufferOf(slot), kChunkBytes};
+        fixed_buffers_ =
+            syscall(__NR_io_uring_register, ring_fd_, IORING_REGISTER_BUFFERS,
+                    iovecs.data(), iovecs.size()) == 0;
+    }
+    Split(bytes, std::move(done), [=](Chunk &chunk, uint64_t at) {
+        chunk.kind = Chunk::Kind::CopyRead;
+        chunk.fd = from;
+        chunk.to = to;
+        chunk.offset = from_offset + at;
+        chunk.to_offset = to_offset + at;
+    });
+}
+
+void UringEngine::Push(unsigned slot) {
+    auto &chunk = slots_[slot];
+    auto tail = *sq_tail_;
+    auto index = tail & *sq_mask_;
+    auto sqe = &sqes_[index];
+    memset(sqe, 0, sizeof(*sqe));
+
+    bool write = false, copy = false;
+    int fd = chunk.fd;
+    uint64_t offset = chunk.offset;
+    uint8_t *address = chunk.data;
+    uint64_t length = chunk.bytes;
+    switch (chunk.kind) {
+    case Chunk::Kind::Read:
+        break;
+    case Chunk::Kind::Write:
+        write = true;
+        break;
+    case Chunk::Kind::CopyRead:
+        copy = true;
+        address = BufferOf(slot);
+        break;
+    case Chunk::Kind::CopyWrite:
+        write = copy = true;
+        fd = chunk.to;
+        offset = chunk.to_offset + chunk.written;
+        address = BufferOf(slot) + chunk.written;
+        length = chunk.held - chunk.written;
+        break;
+    }
+
+    if (copy && fixed_buffers_) {
+        sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+        sqe->buf_index = slot;
+    } else {
+        sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+    }
+    if (fd == fixed_fd_) {
+        sqe->fd = 0;
+        sqe->flags |= IOSQE_FIXED_FILE;
+    } else {
+        sqe->fd = fd;
+    }
+    sqe->off = offset;
+    sqe->addr = reinterpret_cast<uint64_t>(address);
+    sqe->len = length;
+    sqe->user_data = slot;
+
+    sq_array_[index] = index;
+    __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+    ++queued_;
+}
+
+void UringEngine::Complete(unsigned slot, int result) {
+    auto &chunk = slots_[slot];
+    if (result == -EINTR || result == -EAGAIN) {
+        Push(slot);
+        return;
+    }
+
+    // a chunk ends at its last byte or its first error; end of file before
+    // the last byte counts as one
+    bool ok = result > 0;
+    bool more = false;
+    if (ok) {
+        switch (chunk.kind) {
+        case Chunk::Kind::Read:
+        case Chunk::Kind::Write:
+            chunk.offset += result;
+            chunk.data += result;
+            chunk.bytes -= result;
+            more = chunk.bytes > 0;
+            break;
+        case Chunk::Kind::CopyRead:
+            chunk.kind = Chunk::Kind::CopyWrite;
+            chunk.held = result;
+            chunk.written = 0;
+            more = true;
+            break;
+        case Chunk::Kind::CopyWrite:
+            chunk.written += result;
+            if (chunk.written < chunk.held) {
+                more = true;
+                break;
+            }
+            chunk.offset += chunk.held;
+            chunk.to_offset += chunk.held;
+            chunk.bytes -= chunk.held;
+            chunk.kind = Chunk::Kind::CopyRead;
+            more = chunk.bytes > 0;
+            break;
+        }
+    }
+    if (more) {
+        Push(slot);
+        return;
+    }
+    auto group = std::move(chunk.group);
+    free_.push_back(slot);
+    Finish(group, ok, failed_);
+}
+
+void UringEngine::Enter(unsigned wait) {
+    while (true) {
+        auto entered =
+            syscall(__NR_io_uring_enter, ring_fd_, queued_, wait,
+                    wait ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+        if (entered >= 0) {
+            queued_ -= entered;
+            break;
+        }
+        if (errno == EINTR)
+            continue;
+        // completions need reaping before more can be submitted
+        if (errno == EBUSY || errno == EAGAIN)
+            break;
+        throw FATError(std::string("io_uring_enter: ") + strerror(errno));
+    }
+
+    auto head = *cq_head_;
+    auto tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head) {
+        auto &cqe = cqes_[head & *cq_mask_];
+        auto slot = static_cast<unsigned>(cqe.user_data);
+        auto result = cqe.res;
+        // the entry is handed back before its chunk can queue another
+        __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+        Complete(slot, result);
+    }
+}
+
+unsigned UringEngine::AcquireSlot() {
+    while (free_.empty())
+        Enter(1);
+    auto slot = free_.back();
+    free_.pop_back();
+    return slot;
+}
+
+#endif
+
+} // namespace
+
+std::unique_ptr<IOEngine> IOEngine::Create(const FATOptions &options,
+                                           int image_fd) {
+    auto depth = std::max(options.queue_depth, 1u);
+#ifdef FAT_HAVE_IO_URING
+    if (options.io_engine != IOEngineKind::Threads) {
+        auto uring = std::make_unique<UringEngine>();
+        if (uring->Open(depth, image_fd))
+            return uring;
+    }
+#endif
+    if (options.io_engine == IOEngineKind::Uring)
+        throw FATError("io_uring is not available");
+    return std::make_unique<ThreadEngine>(std::min(depth, kMaxCopyThreads),
+                                          depth);
+}
+
+} // namespace cs5250
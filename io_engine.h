@@ -0,0 +1,78 @@
+#pragma once
+
+#include "fat_options.h"
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+
+namespace cs5250 {
+
+/*
+ * Bulk reads and writes for copying files in and out of an image, kept in
+ * flight a queue depth at a time.
+ *
+ * An operation is cut into chunks that go out as slots of the queue free
+ * up, so one large file still keeps the disk busy; queueing blocks while
+ * every slot is taken. Its callback runs once all of its chunks are done,
+ * possibly on another thread and alongside other callbacks.
+ *
+ * io_uring is used when the kernel allows it, with the buffers for copies
+ * between files and the image file registered up front; otherwise the
+ * operations run on a pool of threads.
+ */
+class IOEngine {
+  public:
+    // told whether the whole operation succeeded
+    using Done = std::function<void(bool)>;
+
+    // operations are cut into chunks of this size
+    static constexpr uint64_t kChunkBytes = uint64_t(256) << 10;
+
+    // an engine for a run of copies, `image_fd` being the file most
+    // operations touch; throws FATError if --io-engine=uring cannot be had
+    static std::unique_ptr<IOEngine> Create(const FATOptions &options,
+                                            int image_fd);
+
+    // a callback that calls `done` once it has itself been called `count`
+    // times, with whether every call succeeded
+    static Done Join(size_t count, Done done);
+
+    virtual ~IOEngine() = default;
+
+    virtual const char *Name() const = 0;
+
+    // read `bytes` of `fd` at `offset` into `data`
+    virtual void Read(int fd, uint64_t offset, uint8_t *data, uint64_t bytes,
+                      Done done) = 0;
+
+    // write `bytes` at `data` to `fd` at `offset`
+    virtual void Write(int fd, uint64_t offset, const uint8_t *data,
+                       uint64_t bytes, Done done) = 0;
+
+    // copy `bytes` of `from` at `from_offset` to `to` at `to_offset`
+    virtual void Copy(int from, uint64_t from_offset, int to,
+                      uint64_t to_offset, uint64_t bytes, Done done) = 0;
+
+    // block until every operation has completed and its callback returned;
+    // false if any of them failed
+    virtual bool Wait() = 0;
+
+  protected:
+    // an operation whose chunks are still in flight; the one queueing it
+    // holds a reference too, so that it cannot finish before every chunk
+    // has gone out
+    struct Group {
+        std::atomic<size_t> pending{1};
+        std::atomic<bool> failed{false};
+        Done done;
+
+        explicit Group(Done done) : done(std::move(done)) {}
+    };
+
+    // drop one reference to `group` after a chunk, or the queueing, ended
+    static void Finish(const std::shared_ptr<Group> &group, bool ok,
+                       std::atomic<bool> &any_failed);
+};
+
+} // namespace cs5250
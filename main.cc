@@ -1,5 +1,8 @@
+#include "commands.h"
 #include "fat_manager.h"
+#include "server.h"
 #include <fcntl.h>
+#include <fstream>
 #include <iostream>
 #include <linux/limits.h>
 #include <stdbool.h>
@@ -8,61 +11,288 @@
 #include <string.h>
 #include <sys/mman.h>
 #include <unistd.h>
+#include <vector>
+
+static unsigned ParseCount(const std::string &name, const std::string &value) {
+    char *end = nullptr;
+    auto count = strtoul(value.c_str(), &end, 10);
+    if (value.empty() || *end != '\0') {
+        fprintf(stderr, "--%s expects a number\n", name.c_str());
+        exit(1);
+    }
+    return count;
+}
+
+// take the `--name[=value]` options out of argv, so that the positional
+// arguments keep their usual places
+static cs5250::FATOptions ParseOptions(int &argc, char *argv[]) {
+    using cs5250::IsOneOf;
+    std::vector<std::pair<std::string, std::string>> given;
+    int kept = 1;
+    for (int i = 1; i < argc; ++i) {
+        auto arg = std::string(argv[i]);
+        if (arg.substr(0, 2) != "--") {
+            argv[kept++] = argv[i];
+            continue;
+        }
+        auto eq = arg.find('=');
+        if (eq != std::string::npos)
+            given.push_back({arg.substr(2, eq - 2), arg.substr(eq + 1)});
+        else if (IsOneOf(arg, "--threads", "--queue-depth") && i + 1 < argc)
+            given.push_back({arg.substr(2), argv[++i]});
+        else
+            given.push_back({arg.substr(2), ""});
+    }
+    argc = kept;
+
+    cs5250::FATOptions options;
+    for (auto &[name, value] : given) {
+        if (name == "index") {
+            // the index sits next to the image unless told otherwise
+            if (!value.empty())
+                options.index_path = value;
+            else if (argc > 1)
+                options.index_path = std::string(argv[1]) + ".fatidx";
+        } else if (name == "threads") {
+            options.threads = ParseCount(name, value);
+        } else if (name == "alloc") {
+            if (value == "first")
+                options.alloc = cs5250::AllocPolicy::First;
+            else if (value == "contig")
+                options.alloc = cs5250::AllocPolicy::Contiguous;
+            else {
+                fprintf(stderr, "Invalid value for --alloc: %s\n",
+                        value.c_str());
+                exit(1);
+            }
+        } else if (name == "sync") {
+            if (value == "none")
+                options.sync = cs5250::SyncPolicy::None;
+            else if (value == "command")
+                options.sync = cs5250::SyncPolicy::Command;
+            else if (value == "batch")
+                options.sync = cs5250::SyncPolicy::Batch;
+            else {
+                fprintf(stderr, "Invalid value for --sync: %s\n",
+                        value.c_str());
+                exit(1);
+            }
+        } else if (name == "io") {
+            if (value == "mmap")
+                options.io = cs5250::IOBackend::Mmap;
+            else if (value == "pread")
+                options.io = cs5250::IOBackend::Pread;
+            else {
+                fprintf(stderr, "Invalid value for --io: %s\n",
+                        value.c_str());
+                exit(1);
+            }
+        } else if (name == "cache") {
+            try {
+                options.cache_bytes = cs5250::ParseBytes(value);
+            } catch (const cs5250::FATError &e) {
+                fprintf(stderr, "--cache: %s\n", e.what());
+                exit(1);
+            }
+        } else if (name == "io-engine") {
+            if (value == "auto")
+                options.io_engine = cs5250::IOEngineKind::Auto;
+            else if (value == "uring")
+                options.io_engine = cs5250::IOEngineKind::Uring;
+            else if (value == "threads")
+                options.io_engine = cs5250::IOEngineKind::Threads;
+            else {
+                fprintf(stderr, "Invalid value for --io-engine: %s\n",
+                        value.c_str());
+                exit(1);
+            }
+        } else if (name == "queue-depth") {
+            options.queue_depth = ParseCount(name, value);
+        } else if (name == "read-only") {
+            options.read_only = true;
+        } else if (name == "advise") {
+            if (value == "on")
+                options.advise = true;
+            else if (value == "off")
+                options.advise = false;
+            else {
+                fprintf(stderr, "Invalid value for --advise: %s\n",
+                        value.c_str());
+                exit(1);
+            }
+        } else if (name == "populate") {
+            options.populate = true;
+        } else if (name == "on-error") {
+            if (value == "stop")
+                options.keep_going = false;
+            else if (value == "continue")
+                options.keep_going = true;
+            else {
+                fprintf(stderr, "Invalid value for --on-error: %s\n",
+                        value.c_str());
+                exit(1);
+            }
+        } else if (name == "verbose") {
+            options.verbose = true;
+        } else if (name == "stats") {
+            options.stats = true;
+        } else {
+            fprintf(stderr, "Unknown option: --%s\n", name.c_str());
+            exit(1);
+        }
+    }
+    return options;
+}
+
+// with --stats, print on stderr what `command` did and start counting
+// afresh for the next one
+static void ReportStats(cs5250::FATManager &mgr, const std::string &command) {
+    auto &stats = mgr.Statistics();
+    if (!stats.Enabled())
+        return;
+    stats.Print(std::cerr, command);
+    stats.Reset();
+}
+
+// run every line of a script, reporting each one on stderr; returns the
+// number of lines that failed
+static unsigned RunBatch(cs5250::FATManager &mgr, std::istream &script,
+                         bool keep_going) {
+    unsigned failed = 0;
+    std::string line;
+    for (unsigned number = 1; std::getline(script, line); ++number) {
+        try {
+            auto args = cs5250::SplitLine(line);
+            // blank lines and comments
+            if (args.empty() || args[0][0] == '#')
+                continue;
+            if (args[0] == "batch")
+                throw cs5250::FATError("batch cannot be nested");
+            cs5250::RunCommand(mgr, args);
+            std::cerr << number << ": ok" << std::endl;
+            ReportStats(mgr, line);
+        } catch (const cs5250::FATError &e) {
+            std::cerr << number << ": error: " << e.what() << std::endl;
+            ReportStats(mgr, line);
+            ++failed;
+            if (!keep_going)
+                break;
+        }
+    }
+    // with --sync=batch the whole script is committed at once; written
+    // back here rather than on close, so that --stats sees it
+    try {
+        mgr.WriteBack();
+    } catch (const cs5250::FATError &e) {
+        std::cerr << "error: " << e.what() << std::endl;
+        ++failed;
+    }
+    if (!mgr.Statistics().Empty())
+        ReportStats(mgr, "end of batch");
+    return failed;
+}
 
 int main(int argc, char *argv[]) {
     setbuf(stdout, NULL);
+    auto options = ParseOptions(argc, argv);
     if (argc < 3) {
-        fprintf(stderr, "Usage: %s [path] [command]\n", argv[0]);
+        fprintf(stderr,
+                "Usage: %s [--index[=path]] [--threads N] "
+                "[--alloc=first|contig] [--on-error=stop|continue] "
+                "[--sync=none|command|batch] [--io=mmap|pread] "
+                "[--cache=SIZE] [--io-engine=auto|uring|threads] "
+                "[--queue-depth N] [--read-only] [--advise=on|off] "
+                "[--populate] [--verbose] [--stats] [path] [command]\n",
+                argv[0]);
         exit(1);
     }
     const char *diskimg = argv[1];
 
     using cs5250::FATManager;
     auto file_path = std::string(diskimg);
-    FATManager mgr{file_path};
-
     auto command = std::string(argv[2]);
 
-    if (command == "ck") {
-        mgr.Ck();
-    } else if (command == "ls") {
-        mgr.Ls();
-    } else if (command == "cp") {
-        if (argc < 5) {
-            fprintf(stderr,
-                    "Usage: %s %s %s local:[path] image:[path] or %s %s %s "
-                    "image:[path] local:[path]\n",
-                    argv[0], argv[1], argv[2], argv[0], argv[1], argv[2]);
+    if (command == "serve") {
+        if (argc < 4) {
+            fprintf(stderr, "Usage: %s %s serve [socket] [image...]\n",
+                    argv[0], argv[1]);
             exit(1);
         }
-        // argv[3] or argv[4] should be in the format of "image:/path/to/file"
-        // and "local:/path/to/file" try to read the first 6 characters
-        auto src = std::string(argv[3]);
-        auto dst = std::string(argv[4]);
+        cs5250::Server server(argv[3]);
+        server.AddImage(file_path, options);
+        for (int i = 4; i < argc; ++i) {
+            // every image gets its own index next to it
+            auto image_options = options;
+            if (!image_options.index_path.empty())
+                image_options.index_path = std::string(argv[i]) + ".fatidx";
+            server.AddImage(argv[i], std::move(image_options));
+        }
+        try {
+            server.Run();
+        } catch (const cs5250::FATError &e) {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+        return 0;
+    }
 
-        if (src.substr(0, 6) == "image:" && dst.substr(0, 6) == "local:") {
-            mgr.CopyFileTo(src.substr(6), dst.substr(6));
-        } else if (src.substr(0, 6) == "local:" &&
-                   dst.substr(0, 6) == "image:") {
-            mgr.CopyFileFrom(src.substr(6), dst.substr(6));
-        } else {
-            fprintf(stderr,
-                    "Usage: %s %s %s local:[path] image:[path] or %s %s %s "
-                    "image:[path] local:[path]\n",
-                    argv[0], argv[1], argv[2], argv[0], argv[1], argv[2]);
-            exit(1);
+    // the image does not exist yet
+    if (command == "mkimage") {
+        try {
+            cs5250::MakeImage(file_path,
+                              std::vector<std::string>(argv + 2, argv + argc));
+        } catch (const cs5250::FATError &e) {
+            std::cerr << e.what() << std::endl;
+            return 1;
         }
+        return 0;
+    }
 
-    } else if (command == "rm") {
-        if (argc < 4) {
-            fprintf(stderr, "Usage: %s %s %s [path]\n", argv[0], argv[1],
-                    argv[2]);
-            exit(1);
+    // a single command that only reads gets a read-only mapping, which
+    // also opens images the user may not write
+    if (command != "batch" &&
+        !cs5250::IsMutatingCommand(
+            std::vector<std::string>(argv + 2, argv + argc)))
+        options.read_only = true;
+
+    auto keep_going = options.keep_going;
+    FATManager mgr{file_path, std::move(options)};
+
+    if (command == "batch") {
+        // the script is read from stdin when no file (or "-") is given
+        std::ifstream file;
+        std::istream *script = &std::cin;
+        if (argc > 3 && std::string(argv[3]) != "-") {
+            file.open(argv[3]);
+            if (!file) {
+                fprintf(stderr, "failed to open script %s\n", argv[3]);
+                exit(1);
+            }
+            script = &file;
         }
-        auto path = std::string(argv[3]);
-        mgr.Delete(path);
-    } else {
-        std::cerr << "Unknown command: " << command << std::endl;
-        exit(1);
+        if (RunBatch(mgr, *script, keep_going) != 0)
+            return 1;
+        return 0;
+    }
+
+    std::string command_line = argv[2];
+    for (int i = 3; i < argc; ++i)
+        command_line += std::string(" ") + argv[i];
+    int status = 0;
+    try {
+        cs5250::RunCommand(mgr,
+                           std::vector<std::string>(argv + 2, argv + argc));
+    } catch (const cs5250::FATError &e) {
+        std::cerr << e.what() << std::endl;
+        status = 1;
+    }
+    // the write-back on close is part of the command
+    try {
+        mgr.WriteBack();
+    } catch (const cs5250::FATError &e) {
+        std::cerr << e.what() << std::endl;
+        status = 1;
     }
+    ReportStats(mgr, command_line);
+    return status;
 }
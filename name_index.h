@@ -0,0 +1,104 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+namespace cs5250 {
+
+// FAT compares names without regard to case, so names are folded to upper
+// case for hashing and comparison
+inline char FoldNameChar(char c) {
+    return (c >= 'a' && c <= 'z') ? static_cast<char>(c - 'a' + 'A') : c;
+}
+
+inline uint32_t FoldedNameHash(std::string_view name) {
+    uint32_t hash = 2166136261u;
+    for (auto c : name) {
+        hash ^= static_cast<uint8_t>(FoldNameChar(c));
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+inline bool FoldedNameEqual(std::string_view a, std::string_view b) {
+    if (a.size() != b.size())
+        return false;
+    for (size_t i = 0; i < a.size(); ++i)
+        if (FoldNameChar(a[i]) != FoldNameChar(b[i]))
+            return false;
+    return true;
+}
+
+/*
+ * Open addressing table from name hashes to positions.
+ *
+ * Only the hash and the position are stored; a probe hit is confirmed by the
+ * caller against the names at that position, so looking up a name never
+ * allocates.
+ */
+class NameIndex {
+  private:
+    struct Slot {
+        uint32_t hash;
+        uint32_t position_plus_one; // 0 marks an empty slot
+    };
+
+    std::vector<Slot> slots_;
+    size_t used_ = 0;
+
+    void Grow() {
+        auto old = std::move(slots_);
+        slots_.assign(old.empty() ? 16 : old.size() * 2, Slot{0, 0});
+        used_ = 0;
+        for (auto &slot : old)
+            if (slot.position_plus_one != 0)
+                Place(slot);
+    }
+
+    void Place(Slot slot) {
+        auto mask = slots_.size() - 1;
+        for (auto i = slot.hash & mask;; i = (i + 1) & mask) {
+            if (slots_[i].position_plus_one == 0) {
+                slots_[i] = slot;
+                ++used_;
+                return;
+            }
+        }
+    }
+
+  public:
+    void Clear() {
+        slots_.clear();
+        used_ = 0;
+    }
+
+    size_t Size() const { return used_; }
+
+    size_t MemoryUsage() const { return slots_.capacity() * sizeof(Slot); }
+
+    void Insert(uint32_t hash, uint32_t position) {
+        // keep the load factor under 1/2
+        if ((used_ + 1) * 2 > slots_.size())
+            Grow();
+        Place({hash, position + 1});
+    }
+
+    // first position stored under `hash` for which `matches(position)` holds
+    template <typename F>
+    std::optional<uint32_t> Find(uint32_t hash, F &&matches) const {
+        if (slots_.empty())
+            return std::nullopt;
+        auto mask = slots_.size() - 1;
+        for (auto i = hash & mask; slots_[i].position_plus_one != 0;
+             i = (i + 1) & mask) {
+            if (slots_[i].hash == hash &&
+                matches(slots_[i].position_plus_one - 1))
+                return slots_[i].position_plus_one - 1;
+        }
+        return std::nullopt;
+    }
+};
+
+} // namespace cs5250
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <string_view>
+
+namespace cs5250 {
+
+/*
+ * Splits a path into its components in place. Empty components from
+ * leading, trailing or repeated slashes are skipped.
+ *
+ *     PathTokenizer tokens(path);
+ *     for (std::string_view name; tokens.Next(name);)
+ *         if (tokens.AtEnd()) ... // `name` is the last component
+ */
+class PathTokenizer {
+  private:
+    std::string_view path_;
+    size_t pos_ = 0;
+
+    void SkipSlashes() {
+        while (pos_ < path_.size() && path_[pos_] == '/')
+            ++pos_;
+    }
+
+  public:
+    explicit PathTokenizer(std::string_view path) : path_(path) {
+        SkipSlashes();
+    }
+
+    bool Next(std::string_view &component) {
+        if (pos_ >= path_.size())
+            return false;
+        auto end = path_.find('/', pos_);
+        if (end == std::string_view::npos)
+            end = path_.size();
+        component = path_.substr(pos_, end - pos_);
+        pos_ = end;
+        SkipSlashes();
+        return true;
+    }
+
+    // whether the component returned last was the final one
+    bool AtEnd() const { return pos_ >= path_.size(); }
+};
+
+} // namespace cs5250
@@ -1,3 +1,3 @@
 #!/bin/bash
 
-fsck.fat disk.img
\ No newline at end of file
+./build/fat disk.img verify
@@ -0,0 +1,16 @@
+#!/bin/bash
+
+# round trip of a tree with an empty file: into a fresh image, out with
+# cp -r, and back in over itself, which must replace rather than duplicate
+set -e
+rm -rf round_trip round_trip_out round_trip.img
+mkdir -p round_trip/sub
+echo data > round_trip/a.txt
+: > round_trip/empty
+: > round_trip/sub/empty
+./build/fat round_trip.img mkimage local:./round_trip
+./build/fat round_trip.img cp -r image:/ local:./round_trip_out
+diff -r round_trip round_trip_out
+./build/fat round_trip.img cp -r local:./round_trip image:/
+./build/fat round_trip.img verify
+./build/fat round_trip.img ls
@@ -0,0 +1,156 @@
+#include "server.h"
+#include "commands.h"
+#include "socket_protocol.h"
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <poll.h>
+#include <sstream>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+
+namespace cs5250 {
+
+Server::~Server() {
+    if (listen_fd_ != -1) {
+        close(listen_fd_);
+        unlink(socket_path_.c_str());
+    }
+}
+
+void Server::AddImage(const std::string &path, FATOptions options) {
+    auto image = std::make_unique<Image>();
+    image->manager = std::make_unique<FATManager>(path, std::move(options));
+    image->manager->LoadAll();
+    images_[path] = std::move(image);
+}
+
+std::string Server::Handle(const std::string &request) {
+    auto error = [](const std::string &message) {
+        return std::string(1, kStatusError) + message;
+    };
+
+    std::vector<std::string> args;
+    try {
+        args = SplitLine(request);
+    } catch (const FATError &e) {
+        return error(e.what());
+    }
+    if (args.size() < 2)
+        return error("usage: [image] [command]");
+    auto it = images_.find(args[0]);
+    if (it == images_.end())
+        return error("image " + args[0] + " is not served");
+    args.erase(args.begin());
+    if (IsOneOf(args[0], "batch", "serve"))
+        return error(args[0] + " cannot be run by the server");
+
+    auto &image = *it->second;
+    std::ostringstream out;
+    out.put(kStatusOk);
+    try {
+        if (IsMutatingCommand(args)) {
+            std::unique_lock lock(image.mutex);
+            // mirror the FAT before the next request, even after a failure
+            struct SyncOnExit {
+                FATManager &manager;
+                ~SyncOnExit() { manager.SyncFATs(); }
+            } sync{*image.manager};
+            RunCommand(*image.manager, args, out);
+        } else {
+            std::shared_lock lock(image.mutex);
+            RunCommand(*image.manager, args, out);
+        }
+    } catch (const FATError &e) {
+        return error(e.what());
+    }
+    return std::move(out).str();
+}
+
+void Server::Serve(int client_fd) {
+    for (std::string request;
+         ReadMessage(client_fd, request, kMaxRequestSize);)
+        if (!WriteMessage(client_fd, Handle(request)))
+            break;
+
+    // with --sync=batch the requests of a connection are committed together
+    for (auto &[path, image] : images_) {
+        std::unique_lock lock(image->mutex);
+        try {
+            image->manager->EndBatch();
+        } catch (const FATError &e) {
+            std::cerr << e.what() << std::endl;
+        }
+    }
+
+    std::lock_guard lock(clients_mutex_);
+    close(client_fd);
+    clients_.erase(client_fd);
+    clients_done_.notify_all();
+}
+
+void Server::Run() {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (socket_path_.size() >= sizeof(address.sun_path))
+        throw FATError("socket path too long");
+    strcpy(address.sun_path, socket_path_.c_str());
+
+    listen_fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd_ == -1)
+        throw FATError("failed to create socket");
+    unlink(socket_path_.c_str());
+    if (bind(listen_fd_, reinterpret_cast<sockaddr *>(&address),
+             sizeof(address)) == -1 ||
+        listen(listen_fd_, SOMAXCONN) == -1)
+        throw FATError("failed to listen on " + socket_path_);
+
+    // the signals are taken through a descriptor, so that every thread
+    // started from here on has them blocked
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+    int signal_fd = signalfd(-1, &signals, SFD_CLOEXEC);
+    if (signal_fd == -1)
+        throw FATError("failed to set up signal handling");
+    // a client going away mid-response must not end the server
+    signal(SIGPIPE, SIG_IGN);
+
+    while (true) {
+        pollfd fds[2] = {{listen_fd_, POLLIN, 0}, {signal_fd, POLLIN, 0}};
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (fds[1].revents & POLLIN)
+            break;
+        if (!(fds[0].revents & POLLIN))
+            continue;
+
+        auto client_fd = accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+        if (client_fd == -1)
+            continue;
+        {
+            std::lock_guard lock(clients_mutex_);
+            clients_.insert(client_fd);
+        }
+        std::thread([this, client_fd] { Serve(client_fd); }).detach();
+    }
+    close(signal_fd);
+
+    // wake every connection out of its read and wait for it to finish its
+    // current request
+    std::unique_lock lock(clients_mutex_);
+    for (auto fd : clients_)
+        shutdown(fd, SHUT_RDWR);
+    clients_done_.wait(lock, [this] { return clients_.empty(); });
+}
+
+} // namespace cs5250
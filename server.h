@@ -0,0 +1,59 @@
+#pragma once
+
+#include "fat_manager.h"
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace cs5250 {
+
+/*
+ * Keeps images opened with their directory trees loaded and runs commands
+ * sent over a Unix domain socket (see socket_protocol.h).
+ *
+ * Each connection is served by its own thread and may send any number of
+ * requests. Commands that only read an image run in parallel; commands that
+ * change it hold that image exclusively.
+ */
+class Server {
+  private:
+    struct Image {
+        std::unique_ptr<FATManager> manager;
+        std::shared_mutex mutex;
+    };
+
+    const std::string socket_path_;
+    std::unordered_map<std::string, std::unique_ptr<Image>> images_;
+    int listen_fd_ = -1;
+
+    // connections being served, shut down when the server stops
+    std::mutex clients_mutex_;
+    std::condition_variable clients_done_;
+    std::unordered_set<int> clients_;
+
+    void Serve(int client_fd);
+
+    // run one request, the response carrying the status byte first
+    std::string Handle(const std::string &request);
+
+  public:
+    explicit Server(std::string socket_path)
+        : socket_path_(std::move(socket_path)) {}
+
+    Server(const Server &) = delete;
+    Server &operator=(const Server &) = delete;
+
+    ~Server();
+
+    // open an image and load its tree; requests name it by `path`
+    void AddImage(const std::string &path, FATOptions options);
+
+    // accept connections until SIGINT or SIGTERM
+    void Run();
+};
+
+} // namespace cs5250
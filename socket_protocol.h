@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cerrno>
+#include <cstdint>
+#include <string>
+#include <unistd.h>
+
+namespace cs5250 {
+
+/*
+ * Framing used between `fat serve` and its clients over a Unix socket.
+ *
+ * Every message is a 32-bit length in host byte order followed by that many
+ * bytes. A request is a command line naming the image first, e.g.
+ * `disk.img ls`; a response is a status byte (kStatusOk or kStatusError)
+ * followed by the output of the command or the error message.
+ */
+constexpr uint8_t kStatusOk = 0;
+constexpr uint8_t kStatusError = 1;
+
+// requests longer than this are refused
+constexpr uint32_t kMaxRequestSize = 1 << 20;
+
+inline bool ReadFull(int fd, void *buffer, size_t size) {
+    auto data = static_cast<uint8_t *>(buffer);
+    while (size > 0) {
+        auto got = read(fd, data, size);
+        if (got == -1 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            return false;
+        data += got;
+        size -= got;
+    }
+    return true;
+}
+
+inline bool WriteFull(int fd, const void *buffer, size_t size) {
+    auto data = static_cast<const uint8_t *>(buffer);
+    while (size > 0) {
+        auto written = write(fd, data, size);
+        if (written == -1 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return false;
+        data += written;
+        size -= written;
+    }
+    return true;
+}
+
+// false at end of stream or when the message is larger than `max_size`
+inline bool ReadMessage(int fd, std::string &message,
+                        uint32_t max_size = UINT32_MAX) {
+    uint32_t size;
+    if (!ReadFull(fd, &size, sizeof(size)) || size > max_size)
+        return false;
+    message.resize(size);
+    return ReadFull(fd, message.data(), size);
+}
+
+inline bool WriteMessage(int fd, const std::string &message) {
+    uint32_t size = message.size();
+    return WriteFull(fd, &size, sizeof(size)) &&
+           WriteFull(fd, message.data(), message.size());
+}
+
+} // namespace cs5250
@@ -0,0 +1,130 @@
+#include "stats.h"
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <string>
+#include <sys/resource.h>
+#include <tuple>
+#include <utility>
+
+namespace cs5250 {
+
+namespace {
+
+const char *const kCounterNames[] = {
+    "dirs_parsed",        "entries_parsed", "fat_lookups",
+    "clusters_allocated", "clusters_freed", "bytes_copied",
+    "free_entries_scanned",
+};
+
+const char *const kPhaseNames[] = {
+    "tree_scan", "fat_walk", "allocate", "copy", "flush", "command",
+};
+
+// minor and major page faults of the process so far
+std::pair<uint64_t, uint64_t> PageFaults() {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == -1)
+        return {0, 0};
+    return {uint64_t(usage.ru_minflt), uint64_t(usage.ru_majflt)};
+}
+
+void PrintString(std::ostream &out, const std::string &text) {
+    static const char kHex[] = "0123456789abcdef";
+    out << '"';
+    for (unsigned char c : text) {
+        if (c == '"' || c == '\\')
+            out << '\\' << c;
+        else if (c < 0x20)
+            out << "\\u00" << kHex[c >> 4] << kHex[c & 0xF];
+        else
+            out << c;
+    }
+    out << '"';
+}
+
+} // namespace
+
+void Stats::Record(Phase phase, uint64_t nanoseconds) {
+    auto &histogram = phases_[static_cast<size_t>(phase)];
+    histogram.buckets[std::bit_width(nanoseconds)].fetch_add(
+        1, std::memory_order_relaxed);
+    histogram.count.fetch_add(1, std::memory_order_relaxed);
+    histogram.total_ns.fetch_add(nanoseconds, std::memory_order_relaxed);
+    auto max = histogram.max_ns.load(std::memory_order_relaxed);
+    while (nanoseconds > max &&
+           !histogram.max_ns.compare_exchange_weak(max, nanoseconds,
+                                                   std::memory_order_relaxed))
+        ;
+}
+
+void Stats::Reset() {
+    for (auto &counter : counters_)
+        counter.store(0, std::memory_order_relaxed);
+    for (auto &histogram : phases_) {
+        for (auto &bucket : histogram.buckets)
+            bucket.store(0, std::memory_order_relaxed);
+        histogram.count.store(0, std::memory_order_relaxed);
+        histogram.total_ns.store(0, std::memory_order_relaxed);
+        histogram.max_ns.store(0, std::memory_order_relaxed);
+    }
+    std::tie(minor_faults_, major_faults_) = PageFaults();
+}
+
+bool Stats::Empty() const {
+    for (auto &counter : counters_)
+        if (counter.load(std::memory_order_relaxed) != 0)
+            return false;
+    for (auto &histogram : phases_)
+        if (histogram.count.load(std::memory_order_relaxed) != 0)
+            return false;
+    return true;
+}
+
+void Stats::Print(std::ostream &out, const std::string &command) const {
+    auto [minor, major] = PageFaults();
+    out << "{\"command\": ";
+    PrintString(out, command);
+    out << ", \"counters\": {";
+    for (size_t i = 0; i < kCounters; ++i)
+        out << (i ? ", " : "") << '"' << kCounterNames[i]
+            << "\": " << counters_[i].load(std::memory_order_relaxed);
+    out << "}, \"page_faults\": {\"minor\": " << minor - minor_faults_
+        << ", \"major\": " << major - major_faults_ << "}, \"phases\": {";
+    for (size_t i = 0; i < kPhases; ++i) {
+        auto &histogram = phases_[i];
+        auto count = histogram.count.load(std::memory_order_relaxed);
+        auto max = histogram.max_ns.load(std::memory_order_relaxed);
+        // a percentile is reported as the upper bound of its bucket, or
+        // the slowest sample if that is lower
+        auto percentile = [&](uint64_t per_mille) -> uint64_t {
+            uint64_t rank = (count * per_mille + 999) / 1000, seen = 0;
+            for (size_t b = 0; b < kBuckets; ++b) {
+                seen += histogram.buckets[b].load(std::memory_order_relaxed);
+                if (seen >= rank && b < 64)
+                    return std::min((uint64_t(1) << b) - 1, max);
+            }
+            return max;
+        };
+        out << (i ? ", " : "") << '"' << kPhaseNames[i]
+            << "\": {\"count\": " << count << ", \"total_ns\": "
+            << histogram.total_ns.load(std::memory_order_relaxed)
+            << ", \"max_ns\": " << max << ", \"p50_ns\": " << percentile(500)
+            << ", \"p99_ns\": " << percentile(990) << ", \"histogram\": {";
+        bool first = true;
+        for (size_t b = 0; b < kBuckets; ++b) {
+            auto samples = histogram.buckets[b].load(std::memory_order_relaxed);
+            if (samples == 0)
+                continue;
+            // keyed by the exclusive upper bound of the bucket
+            out << (first ? "" : ", ") << '"'
+                << (b < 64 ? std::to_string(uint64_t(1) << b) : "inf")
+                << "\": " << samples;
+            first = false;
+        }
+        out << "}}";
+    }
+    out << "}}" << std::endl;
+}
+
+} // namespace cs5250
@@ -0,0 +1,133 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+namespace cs5250 {
+
+// what a FATManager counts while --stats is on
+enum class Counter {
+    // directories parsed from their clusters, and the live entries in them
+    DirsParsed,
+    EntriesParsed,
+    // FAT entries read, one per cluster of every chain walked
+    FATLookups,
+    ClustersAllocated,
+    ClustersFreed,
+    // file data copied into or out of the image
+    BytesCopied,
+    // FAT entries the searches for free clusters went over
+    FreeEntriesScanned,
+};
+
+// the parts of a command whose latency is recorded, a sample each time one
+// runs
+enum class Phase {
+    // parsing the entries of one directory
+    TreeScan,
+    // walking one chain of the FAT into extents
+    FATWalk,
+    // finding and chaining the clusters of one file
+    Allocate,
+    // copying one file in or out, from queueing to completion
+    Copy,
+    // writing back the changes to the image
+    Flush,
+    // one whole command
+    Command,
+};
+
+/*
+ * Operation counters and per-phase latency histograms of a FATManager.
+ *
+ * Everything is a relaxed atomic, so the parallel tree walk and copies
+ * record into the same Stats. A disabled Stats records nothing and does
+ * not read the clock. Latencies fall into buckets by powers of two of
+ * nanoseconds; page faults are taken from getrusage for the whole process.
+ */
+class Stats {
+  public:
+    using Clock = std::chrono::steady_clock;
+
+    // records the time from its construction to its destruction as one
+    // sample of a phase
+    class Timer {
+      private:
+        Stats *stats_;
+        Phase phase_;
+        Clock::time_point start_;
+
+      public:
+        Timer(Stats *stats, Phase phase)
+            : stats_(stats), phase_(phase), start_(stats->Start()) {}
+        Timer(const Timer &) = delete;
+        Timer &operator=(const Timer &) = delete;
+        ~Timer() { stats_->Finish(phase_, start_); }
+    };
+
+    explicit Stats(bool enabled = false) : enabled_(enabled) { Reset(); }
+
+    bool Enabled() const { return enabled_; }
+
+    void Add(Counter counter, uint64_t amount = 1) {
+        if (enabled_)
+            counters_[static_cast<size_t>(counter)].fetch_add(
+                amount, std::memory_order_relaxed);
+    }
+
+    Timer Time(Phase phase) { return Timer(this, phase); }
+
+    // for phases that end in a callback: the time to pass to Finish, the
+    // zero point when disabled
+    Clock::time_point Start() const {
+        return enabled_ ? Clock::now() : Clock::time_point();
+    }
+
+    void Finish(Phase phase, Clock::time_point start) {
+        if (enabled_)
+            Record(phase, std::chrono::duration_cast<std::chrono::nanoseconds>(
+                              Clock::now() - start)
+                              .count());
+    }
+
+    // clear every counter and histogram, and take the page faults from
+    // here on
+    void Reset();
+
+    // whether nothing was recorded since the last reset
+    bool Empty() const;
+
+    // everything recorded since the last reset as one line of JSON,
+    // labelled with `command`
+    void Print(std::ostream &out, const std::string &command) const;
+
+  private:
+    static constexpr size_t kCounters =
+        static_cast<size_t>(Counter::FreeEntriesScanned) + 1;
+    static constexpr size_t kPhases = static_cast<size_t>(Phase::Command) + 1;
+    // bucket i holds the samples below 2^i ns and at least 2^(i-1) ns
+    static constexpr size_t kBuckets = 65;
+
+    struct Histogram {
+        std::array<std::atomic<uint64_t>, kBuckets> buckets{};
+        std::atomic<uint64_t> count{0};
+        std::atomic<uint64_t> total_ns{0};
+        std::atomic<uint64_t> max_ns{0};
+    };
+
+    bool enabled_;
+    std::array<std::atomic<uint64_t>, kCounters> counters_{};
+    std::array<Histogram, kPhases> phases_;
+    // minor and major faults of the process at the last reset
+    uint64_t minor_faults_ = 0;
+    uint64_t major_faults_ = 0;
+
+    void Record(Phase phase, uint64_t nanoseconds);
+};
+
+} // namespace cs5250
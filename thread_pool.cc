@@ -0,0 +1,100 @@
+#include "thread_pool.h"
+
+namespace cs5250 {
+
+namespace {
+// the pool and deque the current thread works on, if it is a worker
+thread_local ThreadPool *current_pool = nullptr;
+thread_local size_t current_queue = 0;
+} // namespace
+
+ThreadPool::ThreadPool(unsigned thread_count) {
+    if (thread_count == 0)
+        thread_count = 1;
+    for (unsigned i = 0; i < thread_count; ++i)
+        queues_.push_back(std::make_unique<Queue>());
+    for (unsigned i = 0; i < thread_count; ++i)
+        threads_.emplace_back([this, i] { WorkerLoop(i); });
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(wake_mutex_);
+        stopping_ = true;
+    }
+    wake_.notify_all();
+    for (auto &thread : threads_)
+        thread.join();
+}
+
+void ThreadPool::Submit(std::function<void()> task) {
+    auto index = current_pool == this
+                     ? current_queue
+                     : next_queue_.fetch_add(1) % queues_.size();
+    pending_.fetch_add(1);
+    {
+        std::lock_guard<std::mutex> lock(queues_[index]->mutex);
+        queues_[index]->tasks.push_back(std::move(task));
+    }
+    {
+        std::lock_guard<std::mutex> lock(wake_mutex_);
+        queued_.fetch_add(1);
+    }
+    wake_.notify_one();
+}
+
+void ThreadPool::Wait() {
+    std::unique_lock<std::mutex> lock(wake_mutex_);
+    done_.wait(lock, [this] { return pending_.load() == 0; });
+}
+
+bool ThreadPool::PopOrSteal(size_t self, std::function<void()> &task) {
+    {
+        auto &own = *queues_[self];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.tasks.empty()) {
+            task = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            return true;
+        }
+    }
+    for (size_t i = 1; i < queues_.size(); ++i) {
+        auto &victim = *queues_[(self + i) % queues_.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tasks.empty()) {
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+void ThreadPool::WorkerLoop(size_t index) {
+    current_pool = this;
+    current_queue = index;
+
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(wake_mutex_);
+            wake_.wait(lock,
+                       [this] { return stopping_ || queued_.load() > 0; });
+            if (stopping_ && queued_.load() == 0)
+                return;
+        }
+
+        std::function<void()> task;
+        if (!PopOrSteal(index, task))
+            continue;
+        queued_.fetch_sub(1);
+
+        task();
+
+        if (pending_.fetch_sub(1) == 1) {
+            std::lock_guard<std::mutex> lock(wake_mutex_);
+            done_.notify_all();
+        }
+    }
+}
+
+} // namespace cs5250
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace cs5250 {
+
+/*
+ * Thread pool with one task deque per worker.
+ *
+ * A task submitted from a worker goes to that worker's own deque, which it
+ * pops from the back; idle workers steal from the front of the others. This
+ * keeps a recursive walk mostly depth first on each core while spreading
+ * wide directories across all of them.
+ */
+class ThreadPool {
+  private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    std::vector<std::unique_ptr<Queue>> queues_;
+    std::vector<std::thread> threads_;
+
+    // tasks sitting in some deque, and tasks not yet finished
+    std::atomic<size_t> queued_{0};
+    std::atomic<size_t> pending_{0};
+    std::atomic<size_t> next_queue_{0};
+
+    std::mutex wake_mutex_;
+    std::condition_variable wake_;
+    std::condition_variable done_;
+    bool stopping_ = false;
+
+    bool PopOrSteal(size_t self, std::function<void()> &task);
+
+    void WorkerLoop(size_t index);
+
+  public:
+    explicit ThreadPool(unsigned thread_count);
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    ~ThreadPool();
+
+    size_t Size() const { return threads_.size(); }
+
+    void Submit(std::function<void()> task);
+
+    // block until every submitted task, including the ones submitted by
+    // other tasks, has finished
+    void Wait();
+
+    // number of threads for a `--threads` value, 0 meaning one per core
+    static unsigned ThreadCountFor(unsigned requested) {
+        if (requested != 0)
+            return requested;
+        auto cores = std::thread::hardware_concurrency();
+        return cores == 0 ? 1 : cores;
+    }
+};
+
+} // namespace cs5250
@@ -0,0 +1,382 @@
+#include "cluster_claims.h"
+#include "fat_manager.h"
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <vector>
+
+namespace cs5250 {
+
+namespace {
+
+// clusters `first` to `first + count - 1`
+struct ClusterRun {
+    uint32_t first;
+    uint32_t count;
+};
+
+// sort runs found by separate workers and join the ones that touch
+std::vector<ClusterRun> MergeRuns(std::vector<ClusterRun> runs) {
+    std::sort(runs.begin(), runs.end(),
+              [](const ClusterRun &a, const ClusterRun &b) {
+                  return a.first < b.first;
+              });
+    std::vector<ClusterRun> merged;
+    for (auto &run : runs) {
+        if (!merged.empty() &&
+            merged.back().first + merged.back().count == run.first)
+            merged.back().count += run.count;
+        else
+            merged.push_back(run);
+    }
+    return merged;
+}
+
+/*
+ * Problems found by the verify workers. They are printed sorted by kind and
+ * then by cluster, so the report does not depend on which worker got where
+ * first.
+ */
+class Problems {
+  private:
+    struct Problem {
+        std::string kind;
+        uint64_t key;
+        std::string detail;
+    };
+
+    std::mutex mutex_;
+    std::vector<Problem> problems_;
+
+  public:
+    void Add(const std::string &kind, uint64_t key,
+             const std::string &detail) {
+        std::lock_guard lock(mutex_);
+        problems_.push_back({kind, key, detail});
+    }
+
+    size_t Count() const { return problems_.size(); }
+
+    size_t Count(const std::string &kind) const {
+        return std::count_if(problems_.begin(), problems_.end(),
+                             [&](const Problem &p) { return p.kind == kind; });
+    }
+
+    void Print(std::ostream &out) {
+        std::sort(problems_.begin(), problems_.end(),
+                  [](const Problem &a, const Problem &b) {
+                      return std::tie(a.kind, a.key, a.detail) <
+                             std::tie(b.kind, b.key, b.detail);
+                  });
+        for (auto &problem : problems_)
+            out << problem.kind << " " << problem.detail << std::endl;
+    }
+};
+
+} // namespace
+
+size_t FATManager::Verify(std::ostream &out) {
+    // changes not yet mirrored are not a disagreement between the copies
+    SyncFATs();
+
+    // a FAT too short for the data region leaves the rest unaddressable
+    auto cluster_end =
+        std::min(MaximumValidClusterNumber() + 1, fat_map_->EntryCount());
+    ClusterClaims claims(cluster_end);
+    Problems problems;
+    std::atomic<uint64_t> files{0}, dirs{0};
+
+    // clusters a chain ran into after another chain, or itself, had claimed
+    // them; which chain gets there first depends on the workers, so the
+    // claimants are named by a second pass, and a size is only checked
+    // against a chain that shares no cluster
+    struct SizeMismatch {
+        uint32_t first_cluster;
+        std::string path;
+        std::string detail;
+    };
+    std::mutex shared_mutex;
+    std::vector<uint32_t> shared;
+    std::vector<SizeMismatch> mismatches;
+
+    // claim the clusters of a chain; its length, or nullopt when it leaves
+    // the data region or runs into a cluster that is already claimed, in
+    // which case whatever follows belongs to another chain
+    auto walk_chain = [&](uint32_t first_cluster,
+                          const std::string &path) -> std::optional<uint32_t> {
+        uint32_t length = 0, previous = 0;
+        for (auto cluster = first_cluster;;) {
+            if (cluster < 2 || cluster >= cluster_end) {
+                problems.Add("bad-chain", previous,
+                             "cluster=" + std::to_string(previous) +
+                                 " next=" + std::to_string(cluster) +
+                                 " path=" + path);
+                return std::nullopt;
+            }
+            if (!claims.Claim(cluster)) {
+                std::lock_guard lock(shared_mutex);
+                shared.push_back(cluster);
+                return std::nullopt;
+            }
+            ++length;
+            auto next = fat_map_->Lookup(cluster);
+            if (fat_map_->IsEndOfFile(next))
+                return length;
+            previous = cluster;
+            cluster = next;
+        }
+    };
+
+    ThreadPool pool(ThreadPool::ThreadCountFor(options_.threads));
+
+    // directories are read from the image rather than the tree or the
+    // index, each by its own task, and only once their chain is sound
+    std::function<void(uint32_t, const std::string &)> check_dir =
+        [&](uint32_t first_cluster, const std::string &path) {
+            ++dirs;
+            if (!IsFixedRoot(first_cluster)) {
+                if (!walk_chain(first_cluster, path))
+                    return;
+            }
+            // an error here would otherwise end the worker, and the process
+            std::vector<SimpleStruct> entries;
+            try {
+                entries = ReadDirEntries(first_cluster);
+            } catch (const FATError &) {
+                problems.Add("bad-dir", first_cluster,
+                             "cluster=" + std::to_string(first_cluster) +
+                                 " path=" + path);
+                return;
+            }
+            auto prefix = path == "/" ? path : path + "/";
+            for (auto &entry : entries) {
+                auto entry_path = prefix + entry.name;
+                if (entry.is_dir) {
+                    pool.Submit([&check_dir, cluster = entry.first_cluster,
+                                 entry_path] {
+                        check_dir(cluster, entry_path);
+                    });
+                    continue;
+                }
+                ++files;
+                if (entry.first_cluster == 0) {
+                    if (entry.size != 0)
+                        problems.Add("size-mismatch", 0,
+                                     "size=" + std::to_string(entry.size) +
+                                         " clusters=0 path=" + entry_path);
+                    continue;
+                }
+                auto length = walk_chain(entry.first_cluster, entry_path);
+                if (length && *length != ClustersForBytes(entry.size)) {
+                    std::lock_guard lock(shared_mutex);
+                    mismatches.push_back(
+                        {entry.first_cluster, entry_path,
+                         "size=" + std::to_string(entry.size) +
+                             " clusters=" + std::to_string(*length) +
+                             " path=" + entry_path});
+                }
+            }
+        };
+    pool.Submit([&] { check_dir(root_cluster_number_, "/"); });
+    pool.Wait();
+
+    // every chain through a shared cluster is named, found by walking the
+    // tree again on this thread in name order; only a damaged image pays
+    // for it
+    std::sort(shared.begin(), shared.end());
+    shared.erase(std::unique(shared.begin(), shared.end()), shared.end());
+    std::vector<std::vector<std::string>> claimants(shared.size());
+    if (!shared.empty()) {
+        auto find_claimants = [&](uint32_t first_cluster,
+                                  const std::string &path) {
+            std::vector<bool> found(shared.size());
+            // a chain that loops comes back to a shared cluster, and one
+            // that loops past none of them is cut at the number of clusters
+            uint32_t cluster = first_cluster;
+            for (uint32_t length = 0;
+                 cluster >= 2 && cluster < cluster_end && length < cluster_end;
+                 ++length) {
+                auto it = std::lower_bound(shared.begin(), shared.end(),
+                                           cluster);
+                if (it != shared.end() && *it == cluster) {
+                    auto i = it - shared.begin();
+                    if (found[i])
+                        return;
+                    found[i] = true;
+                    claimants[i].push_back(path);
+                }
+                auto next = fat_map_->Lookup(cluster);
+                if (fat_map_->IsEndOfFile(next))
+                    return;
+                cluster = next;
+            }
+        };
+        std::function<void(uint32_t, const std::string &)> find_in_dir =
+            [&](uint32_t first_cluster, const std::string &path) {
+                if (!IsFixedRoot(first_cluster))
+                    find_claimants(first_cluster, path);
+                std::vector<SimpleStruct> entries;
+                try {
+                    entries = ReadDirEntries(first_cluster);
+                } catch (const FATError &) {
+                    return;
+                }
+                std::sort(entries.begin(), entries.end(),
+                          [](const SimpleStruct &a, const SimpleStruct &b) {
+                              return a.name < b.name;
+                          });
+                auto prefix = path == "/" ? path : path + "/";
+                for (auto &entry : entries) {
+                    if (entry.is_dir)
+                        find_in_dir(entry.first_cluster, prefix + entry.name);
+                    else if (entry.first_cluster != 0)
+                        find_claimants(entry.first_cluster,
+                                       prefix + entry.name);
+                }
+            };
+        find_in_dir(root_cluster_number_, "/");
+        for (size_t i = 0; i < shared.size(); ++i) {
+            std::string paths;
+            for (auto &path : claimants[i])
+                paths += " path=" + path;
+            problems.Add("cross-linked", shared[i],
+                         "cluster=" + std::to_string(shared[i]) + paths);
+        }
+    }
+    for (auto &mismatch : mismatches) {
+        auto is_claimant = std::any_of(
+            claimants.begin(), claimants.end(), [&](auto &paths) {
+                return std::find(paths.begin(), paths.end(), mismatch.path) !=
+                       paths.end();
+            });
+        if (!is_claimant)
+            problems.Add("size-mismatch", mismatch.first_cluster,
+                         mismatch.detail);
+    }
+
+    // with every chain claimed, a cluster in use that nobody claimed is lost
+    constexpr uint32_t kChunk = 1 << 16;
+    std::mutex runs_mutex;
+    std::vector<ClusterRun> lost;
+    std::atomic<uint64_t> used{0};
+    auto bad = fat_map_->BadCluster();
+    for (uint32_t begin = 2; begin < cluster_end; begin += kChunk) {
+        pool.Submit([&, begin] {
+            auto end = std::min(cluster_end, begin + kChunk);
+            std::vector<ClusterRun> runs;
+            uint64_t claimed = 0;
+            for (auto cluster = begin; cluster < end; ++cluster) {
+                if (claims.IsClaimed(cluster)) {
+                    ++claimed;
+                    continue;
+                }
+                auto entry = fat_map_->Lookup(cluster);
+                if (entry == 0 || entry == bad)
+                    continue;
+                if (!runs.empty() &&
+                    runs.back().first + runs.back().count == cluster)
+                    ++runs.back().count;
+                else
+                    runs.push_back({cluster, 1});
+            }
+            used += claimed;
+            std::lock_guard lock(runs_mutex);
+            lost.insert(lost.end(), runs.begin(), runs.end());
+        });
+    }
+
+    // every copy of the FAT should match the first, unless FAT32 has
+    // mirroring turned off
+    auto bpb = reinterpret_cast<const BPB *>(image_);
+    auto mirrored = fat_type_ != FATType::FAT32 ||
+                    !(bpb->fat32.BPB_ExtFlags & 0x80);
+    std::vector<std::vector<ClusterRun>> differing(number_of_fats_);
+    if (mirrored) {
+        auto first_fat = StartAddressOfSector(reserved_sector_count_);
+        for (uint32_t copy = 1; copy < number_of_fats_; ++copy) {
+            auto fat = first_fat + uint64_t(copy) * sector_count_per_fat_ *
+                                       bytes_per_sector_;
+            for (uint32_t begin = 0; begin < sector_count_per_fat_;
+                 begin += 2048) {
+                pool.Submit([&, first_fat, fat, copy, begin] {
+                    auto end = std::min(sector_count_per_fat_, begin + 2048);
+                    auto offset = uint64_t(begin) * bytes_per_sector_;
+                    if (memcmp(first_fat + offset, fat + offset,
+                               uint64_t(end - begin) * bytes_per_sector_) == 0)
+                        return;
+                    std::vector<ClusterRun> sectors;
+                    for (auto sector = begin; sector < end; ++sector) {
+                        offset = uint64_t(sector) * bytes_per_sector_;
+                        if (memcmp(first_fat + offset, fat + offset,
+                                   bytes_per_sector_) == 0)
+                            continue;
+                        if (!sectors.empty() &&
+                            sectors.back().first + sectors.back().count ==
+                                sector)
+                            ++sectors.back().count;
+                        else
+                            sectors.push_back({sector, 1});
+                    }
+                    std::lock_guard lock(runs_mutex);
+                    differing[copy].insert(differing[copy].end(),
+                                           sectors.begin(), sectors.end());
+                });
+            }
+        }
+    }
+    pool.Wait();
+
+    uint64_t lost_clusters = 0;
+    for (auto &run : MergeRuns(std::move(lost))) {
+        lost_clusters += run.count;
+        problems.Add("lost", run.first,
+                     "cluster=" + std::to_string(run.first) +
+                         " count=" + std::to_string(run.count));
+    }
+    uint64_t differing_sectors = 0;
+    for (uint32_t copy = 1; copy < number_of_fats_; ++copy) {
+        for (auto &run : MergeRuns(std::move(differing[copy]))) {
+            differing_sectors += run.count;
+            problems.Add("fat-mirror", uint64_t(copy) << 32 | run.first,
+                         "fat=" + std::to_string(copy) +
+                             " sector=" + std::to_string(run.first) +
+                             " count=" + std::to_string(run.count));
+        }
+    }
+
+    // FAT12/16 keep no FSInfo; their counts are taken from the FAT
+    auto histogram = fat_map_->Histogram();
+    if (fat_type_ == FATType::FAT32) {
+        auto free_count = fs_info_manager_->GetFreeClusterCount();
+        if (free_count != 0xFFFFFFFF && free_count != histogram.free)
+            problems.Add("fsinfo-free", 0,
+                         "recorded=" + std::to_string(free_count) +
+                             " counted=" + std::to_string(histogram.free));
+        auto next_free = fs_info_manager_->GetNextFreeCluster();
+        if (next_free != 0xFFFFFFFF &&
+            (next_free < 2 || next_free >= cluster_end))
+            problems.Add("fsinfo-next-free", 0,
+                         "recorded=" + std::to_string(next_free));
+    }
+
+    problems.Print(out);
+    out << "Files = " << files << std::endl;
+    out << "Directories = " << dirs << std::endl;
+    out << "UsedClusters = " << used << std::endl;
+    out << "FreeClusters = " << histogram.free << std::endl;
+    out << "BadClusters = " << histogram.bad << std::endl;
+    out << "LostClusters = " << lost_clusters << std::endl;
+    out << "CrossLinks = " << problems.Count("cross-linked") << std::endl;
+    out << "BadChains = " << problems.Count("bad-chain") << std::endl;
+    out << "SizeMismatches = " << problems.Count("size-mismatch")
+        << std::endl;
+    out << "BadDirs = " << problems.Count("bad-dir") << std::endl;
+    out << "FATMirrorSectors = " << differing_sectors << std::endl;
+    out << "Problems = " << problems.Count() << std::endl;
+    return problems.Count();
+}
+
+} // namespace cs5250